@@ -0,0 +1,196 @@
+#include "bloom.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dust-internal.h"
+#include "io.h"
+#include "memory.h"
+#include "types.h"
+
+/* The filter is split into blocks the size of a cache line, and all of a
+ * fingerprint's bits are set in just one of them, so that checking for a
+ * fingerprint costs at most one cache miss. */
+#define BLOOM_BLOCK_BYTES 64
+#define BLOOM_BLOCK_BITS (BLOOM_BLOCK_BYTES * 8)
+#define BLOOM_BITS_PER_ENTRY 10
+#define BLOOM_PROBES 8
+
+#define BLOOM_VERSION 1
+
+struct bloom_header {
+  uint64_t_be version;
+  uint64_t_be num_blocks;
+  uint64_t_be count;
+};
+
+struct dust_bloom {
+  uint64_t num_blocks; /* always a power of two */
+  uint64_t count;
+  unsigned char *bits; /* num_blocks blocks */
+};
+
+static uint64_t fingerprint_bits(const unsigned char *fingerprint, size_t offset, size_t len)
+{
+  uint64_t bits = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    bits = (bits << 8) | fingerprint[offset + i];
+  }
+  return bits;
+}
+
+/* Fingerprints are uniformly distributed, so their bits are used as they
+ * are: some to pick the block, and some more to pick bits within it, by
+ * double hashing. */
+static unsigned char *bloom_block(const struct dust_bloom *bloom, const unsigned char *fingerprint)
+{
+  uint64_t block = fingerprint_bits(fingerprint, 24, 8) & (bloom->num_blocks - 1);
+  return bloom->bits + block * BLOOM_BLOCK_BYTES;
+}
+
+static uint32_t bloom_probe(const unsigned char *fingerprint, int i)
+{
+  uint32_t a = fingerprint_bits(fingerprint, 12, 4);
+  uint32_t b = fingerprint_bits(fingerprint, 20, 4) | 1;
+  return (a + i * b) % BLOOM_BLOCK_BITS;
+}
+
+static struct dust_bloom *allocate_bloom(uint64_t num_blocks)
+{
+  struct dust_bloom *bloom = dmalloc(sizeof *bloom);
+
+  bloom->num_blocks = num_blocks;
+  bloom->count = 0;
+  bloom->bits = calloc(num_blocks, BLOOM_BLOCK_BYTES);
+  assert(bloom->bits);
+  return bloom;
+}
+
+struct dust_bloom *dust_bloom_new(uint64_t num_entries)
+{
+  uint64_t num_blocks = 1;
+
+  while (num_blocks * BLOOM_BLOCK_BITS < num_entries * BLOOM_BITS_PER_ENTRY) {
+    num_blocks <<= 1;
+  }
+  return allocate_bloom(num_blocks);
+}
+
+uint64_t dust_bloom_capacity(const struct dust_bloom *bloom)
+{
+  assert(bloom);
+  return bloom->num_blocks * BLOOM_BLOCK_BITS / BLOOM_BITS_PER_ENTRY;
+}
+
+uint64_t dust_bloom_count(const struct dust_bloom *bloom)
+{
+  assert(bloom);
+  return bloom->count;
+}
+
+void dust_bloom_add(struct dust_bloom *bloom, const unsigned char *fingerprint)
+{
+  unsigned char *block = NULL;
+
+  assert(bloom);
+  assert(fingerprint);
+
+  block = bloom_block(bloom, fingerprint);
+  for (int i = 0; i < BLOOM_PROBES; i++) {
+    uint32_t bit = bloom_probe(fingerprint, i);
+    block[bit / 8] |= 1 << (bit % 8);
+  }
+  bloom->count++;
+}
+
+int dust_bloom_may_contain(const struct dust_bloom *bloom, const unsigned char *fingerprint)
+{
+  const unsigned char *block = NULL;
+
+  assert(bloom);
+  assert(fingerprint);
+
+  block = bloom_block(bloom, fingerprint);
+  for (int i = 0; i < BLOOM_PROBES; i++) {
+    uint32_t bit = bloom_probe(fingerprint, i);
+    if (!(block[bit / 8] & (1 << (bit % 8)))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+struct dust_bloom *dust_bloom_load(const char *path)
+{
+  struct dust_bloom *bloom = NULL;
+  struct bloom_header header;
+  uint64_t num_blocks = 0;
+  FILE *stream = NULL;
+
+  assert(path);
+
+  stream = fopen(path, "r");
+  if (!stream) {
+    return NULL;
+  }
+  if (fread(&header, sizeof header, 1, stream) != 1
+      || uint64be_to_host(header.version) != BLOOM_VERSION) {
+    goto fail;
+  }
+
+  num_blocks = uint64be_to_host(header.num_blocks);
+  if (num_blocks == 0 || (num_blocks & (num_blocks - 1)) != 0) {
+    goto fail;
+  }
+
+  bloom = allocate_bloom(num_blocks);
+  bloom->count = uint64be_to_host(header.count);
+  if (fread(bloom->bits, BLOOM_BLOCK_BYTES, num_blocks, stream) != num_blocks) {
+    goto fail;
+  }
+
+  fclose(stream);
+  return bloom;
+
+fail:
+  if (bloom) {
+    dust_bloom_free(&bloom);
+  }
+  fclose(stream);
+  return NULL;
+}
+
+static void write_bloom(FILE *stream, void *data)
+{
+  const struct dust_bloom *bloom = data;
+  struct bloom_header header;
+
+  header.version = uint64host_to_be(BLOOM_VERSION);
+  header.num_blocks = uint64host_to_be(bloom->num_blocks);
+  header.count = uint64host_to_be(bloom->count);
+  dfwrite(&header, sizeof header, 1, stream);
+  dfwrite(bloom->bits, BLOOM_BLOCK_BYTES, bloom->num_blocks, stream);
+}
+
+int dust_bloom_save(const struct dust_bloom *bloom, const char *path)
+{
+  assert(bloom);
+  assert(path);
+
+  if (replace_file(path, write_bloom, (void *)bloom) != 0) {
+    return !DUST_OK;
+  }
+  return DUST_OK;
+}
+
+void dust_bloom_free(struct dust_bloom **bloom)
+{
+  assert(bloom && *bloom);
+  free((*bloom)->bits);
+  free(*bloom);
+  *bloom = NULL;
+}
@@ -0,0 +1,164 @@
+#include "chunking.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <string.h>
+
+/* Normalized chunking (as in FastCDC): before the average size is reached a
+ * boundary needs more hash bits to be zero than after it, which pulls chunk
+ * sizes in towards the average. The masks select the top bits of the gear
+ * hash, since those depend on the most recent 64 bytes of input. */
+#define CDC_MASK_SMALL ((((uint64_t)1 << 16) - 1) << (64 - 16))
+#define CDC_MASK_LARGE ((((uint64_t)1 << 12) - 1) << (64 - 12))
+
+/* Random values, one per byte value, for the gear hash. Generated once with
+ * splitmix64; changing them changes where every chunk boundary falls. */
+static const uint64_t gear[256] = {
+  0x56c170196ce526a2ULL, 0x8f8daa2964ff8985ULL, 0x4bd3b69a33fde1cfULL,
+  0xf2392fcc76399f78ULL, 0xa98f2537d2478b4bULL, 0xd206ea8381de2ff3ULL,
+  0x542151e80a6db53bULL, 0x9c7b10d0d35c9a9fULL, 0xc52469a7cd4112d9ULL,
+  0xb1ed592f48916aafULL, 0x209146a6e6bfb75eULL, 0x1ebb64889f131fffULL,
+  0xe7333fe0583fa34cULL, 0x6b33fa2d57a9e5f4ULL, 0x4e80f89412ef75f4ULL,
+  0xbd9276536ae83238ULL, 0x5eda16eb59c6a942ULL, 0x0036075c4d7076e0ULL,
+  0xe3a5e2f6c159956aULL, 0x7415f9b92a9163a7ULL, 0x51529d1ae8fbe606ULL,
+  0x3911b901031bec08ULL, 0x541413dcf7afda1cULL, 0xe38cadbdb0a279f8ULL,
+  0x9225854351d561bcULL, 0x0f7840f9ebb5d89bULL, 0x36828e279f073005ULL,
+  0x55f7d48af1771391ULL, 0x0323be6f6ae122f2ULL, 0xb4e51ae74f089caeULL,
+  0x8ac06a59ca007e9fULL, 0x15896bb88e438a31ULL, 0x3ac2124442673eb5ULL,
+  0x93c236597a2b75b3ULL, 0x40521463bb94f5d8ULL, 0xd273281664d78335ULL,
+  0x82ebcabef12a9023ULL, 0x0e98e9a88828404aULL, 0x341c61a3e5a4c424ULL,
+  0x241b284dc957a5faULL, 0xff03c578c3e2b785ULL, 0x1a974c8de6d6c0b0ULL,
+  0x80dc5c3687a6c61cULL, 0xe4ff3f6c2cb950e1ULL, 0xb9f0e71753caa2ccULL,
+  0xec60d7cc5e0be073ULL, 0xdafe281553545103ULL, 0x33e2a03d5b6b29bfULL,
+  0xbea3a400749419b8ULL, 0x5b33a80858c65398ULL, 0x3a691b34176a3daeULL,
+  0x481bf076f2ac5f8eULL, 0x2988f929ffa05e70ULL, 0xeb3aa79b22092575ULL,
+  0x444c02885867cd4eULL, 0xf3975391daab95d6ULL, 0x5a3d1ff6e1af9715ULL,
+  0xaa767414817ad4bdULL, 0xe8e87adbb5457d44ULL, 0x4cef06f8c503e4f8ULL,
+  0xe0d1a92146fb0e1fULL, 0x1e4ac70b88f19913ULL, 0x317be0b7d1e9b2c3ULL,
+  0xe1bbfa5d38e0af08ULL, 0xe07d5b1b7c705d00ULL, 0x31ce74d4899beb38ULL,
+  0xefcb003eea2eb872ULL, 0xb777c4cf3a2a8256ULL, 0x8c4200162711d1a9ULL,
+  0xdbbe6629903cd319ULL, 0xe4ed200af8604e03ULL, 0xa3d1525508ea250aULL,
+  0xb109af23cc3739b1ULL, 0x679f4ed5e4c2f49bULL, 0x10fb5a19e74736d5ULL,
+  0xa4a340ebf6a153bdULL, 0x9a7a5667a69316daULL, 0xc585efe2d35fc224ULL,
+  0xbe1d30f228084aebULL, 0x2fe789fd19c3351eULL, 0xecafed10b085ac61ULL,
+  0x138434b725bf3de7ULL, 0xc4af16a7763e6b2fULL, 0x4fdd7d48ae24ce1dULL,
+  0x2b376e0946a579c2ULL, 0x9948c8f69fad29b0ULL, 0xb2767f870564a937ULL,
+  0xd6512a63fec3d846ULL, 0x5959902f07fd5924ULL, 0x8a5fd29c50370aa2ULL,
+  0x9d1ffe88b0ae21f9ULL, 0x7c070d39e5afa5d4ULL, 0x1367c37e2c0bacfbULL,
+  0xec5dd5e76ef3f450ULL, 0x4378eee2ebe991a1ULL, 0x103295fa36110069ULL,
+  0x68b236ddd51379baULL, 0xa035c2ea4e08ffbcULL, 0xa1c8aed7a5ea4647ULL,
+  0x6c3efa552591a750ULL, 0x8cebc9e0b8a5da26ULL, 0x876dd6ecdc7c6cb0ULL,
+  0x3ddd629262562621ULL, 0x3df8a8024b3c1f05ULL, 0xd8908a5f8a9d86aaULL,
+  0x731a60071119903fULL, 0x3ebde5d63124fda1ULL, 0x5c0799840c6e517fULL,
+  0x6268e83ee9c39fdcULL, 0x25bb33c2a139a21bULL, 0x4e9e02d3412fe3eeULL,
+  0x626c1c0a007a8474ULL, 0x7dd78c195b9c29c4ULL, 0xdfcc216caaf6f72eULL,
+  0x381ea8b5345602afULL, 0x1dc932cb2018e1ddULL, 0x5b50dc29c04d1d9bULL,
+  0xcf05e923efc2d5adULL, 0x7b9bb4916d25d2a9ULL, 0xf62868640b54b7bbULL,
+  0xb979f14fd5cb7941ULL, 0xa7dbcb07c617e943ULL, 0x0de16d08cdb7010bULL,
+  0x2f2c4aed4370e16aULL, 0x1ef7e75ebc7d460eULL, 0xd8a14490d5798155ULL,
+  0xeecdd302ff5a4d6fULL, 0x6c2b85916028bb60ULL, 0x6c199a6a472a668bULL,
+  0x33690d9cb98e757cULL, 0xae36a2f82d267479ULL, 0x59a7ace279acefbbULL,
+  0x161e14c4b17d51dbULL, 0x155a47ec2732e2aeULL, 0xe22359c79cdd2485ULL,
+  0x9cac7885c592e0a8ULL, 0x8b666ba6707e9384ULL, 0x50f8bbee5dfae615ULL,
+  0xe39a95c59f0c193fULL, 0x377eb8a2aad6e25dULL, 0x45af878eeeb0bdd8ULL,
+  0xc32802ca3c224707ULL, 0x5a1360f2d1eba767ULL, 0x36b6b69c609f82abULL,
+  0x53b79bd552051772ULL, 0x879a5e4723a45b2eULL, 0x6ce8c98c21e2f327ULL,
+  0x881e52b75e628633ULL, 0xd65e9905d5d51e32ULL, 0x097126ac3db9f668ULL,
+  0x415e3d14507ef2dbULL, 0x80bc7d967cb2dadfULL, 0x406e96aa2d6e7ba4ULL,
+  0x0289de6eed92c77bULL, 0xb45fb21beb322ceeULL, 0x3b0561b5821e751dULL,
+  0x8832f56884c97feeULL, 0x10a9e6cb383ce72dULL, 0x14cc0f3eaf084e9dULL,
+  0x72a28ff98dda4404ULL, 0x995d7bf254671c45ULL, 0xb1d897745317ab38ULL,
+  0x91675aada6f0cf50ULL, 0x4be3f81dd6637ecaULL, 0x36b573fc7f8dae94ULL,
+  0x267aad171d92502cULL, 0xe2d99f48cc7723deULL, 0xb92fa79bf0785c40ULL,
+  0x001abc9927cecf24ULL, 0x2154734e3a0beb96ULL, 0x63b00fa57a24f97aULL,
+  0x7bb0fec364a85582ULL, 0x98c314e643ca7e7aULL, 0xe5f5c48453e6b20fULL,
+  0x85a2728ea595e8c7ULL, 0xdc50836219c57bc8ULL, 0xc38659336a2cfe4dULL,
+  0xab5c40298254a6b8ULL, 0x0e2241d80b0a88acULL, 0xe96efdfcaf830d88ULL,
+  0x31c46a730555a6caULL, 0xa4bd3861d6dc53e9ULL, 0x3ef51e7572c36db1ULL,
+  0x8817a5ba003d9a8cULL, 0x30a244780dc51b3cULL, 0x5f625b85ae7626a7ULL,
+  0x840e181eeb2ae2e3ULL, 0xd0cb82d9a4a5912cULL, 0x7324abc23014827bULL,
+  0xbcd0b7c5a5c45bb3ULL, 0xda7976953a828359ULL, 0x199c3e0f13af6d33ULL,
+  0x1f4cc6f3fe9e5508ULL, 0x07a7db00da7ab619ULL, 0xecccb19d32639b54ULL,
+  0xe5d1dfeed3c8c1daULL, 0x1aa3869dc53effbdULL, 0x67f64584af8ed82fULL,
+  0x1550b53b61c2775fULL, 0xaea977d6190688c9ULL, 0x786604feea12909cULL,
+  0x223da252231a0065ULL, 0xc122d1bf6f88bd3cULL, 0x0f0ef59554ea9109ULL,
+  0x3974a65bf0c0d0c7ULL, 0xcaaa3658c994ae95ULL, 0xe730ecf3835dfdf3ULL,
+  0x3057d5ca9b500a0dULL, 0xa1ca78d10e4078a8ULL, 0xacb34fcbc1984840ULL,
+  0xecfd6fdda390f276ULL, 0x0b93447cd60f09d8ULL, 0xf022127eea8a45aeULL,
+  0xf48f2d15a1639b20ULL, 0x2aeeeeaa99fb531bULL, 0xba15a92d65c3feebULL,
+  0xbf6ee16f13ca55b6ULL, 0xfdf6edd05aef4da5ULL, 0xe9f8cce4dfe26c60ULL,
+  0x2d8aca25217a26d6ULL, 0x006b93383e36e6ddULL, 0x4bec96c1f4eafa30ULL,
+  0x5d40907d969fab23ULL, 0xf3cf5c3d4c067cb1ULL, 0xe9419aedb239bfe6ULL,
+  0x7c58cbb9983cf746ULL, 0x230c88fb034d95ecULL, 0x9a868d69c7079b00ULL,
+  0xeb0fd1f8a5119f41ULL, 0x4480550838f87cf8ULL, 0xd50ca05a9a1d9f4dULL,
+  0x9b72a92d48145116ULL, 0x504b0b294c4838d2ULL, 0xb8d66210f85e56b2ULL,
+  0x7c64645252973f3cULL, 0xfd77be1704d9ccf5ULL, 0x36aedc86774f9960ULL,
+  0x39755ff8fb856385ULL, 0x39962495940ececaULL, 0x3770b764ae5928b8ULL,
+  0xb4b9d74aca0df161ULL, 0x79ee696e98671dc9ULL, 0xe5811828cfb0ac1eULL,
+  0x0f80c120446e63d6ULL, 0x1fbb9188825979c8ULL, 0xefe223783aa7d660ULL,
+  0x4ce4516e32a5f546ULL, 0x8a6c0fde69242f2aULL, 0xde30ebf2eed17a96ULL,
+  0x770a3e603340b78eULL, 0x8783655cc1c83b93ULL, 0xf45bfcf2971686f1ULL,
+  0x8e422669ea3cbd9dULL, 0xcf55508a31c0fc90ULL, 0xc7537271ae2d5392ULL,
+  0xf2ae3925416189ffULL,
+};
+
+static size_t content_defined_length(const unsigned char *buf, size_t len)
+{
+  uint64_t hash = 0;
+  size_t i = DUST_CDC_MIN_SIZE;
+  size_t normal = DUST_CDC_AVG_SIZE;
+
+  if (len <= DUST_CDC_MIN_SIZE) {
+    return len;
+  }
+  if (len > DUST_CDC_MAX_SIZE) {
+    len = DUST_CDC_MAX_SIZE;
+  }
+  if (normal > len) {
+    normal = len;
+  }
+
+  for (; i < normal; i++) {
+    hash = (hash << 1) + gear[buf[i]];
+    if (!(hash & CDC_MASK_SMALL)) {
+      return i + 1;
+    }
+  }
+  for (; i < len; i++) {
+    hash = (hash << 1) + gear[buf[i]];
+    if (!(hash & CDC_MASK_LARGE)) {
+      return i + 1;
+    }
+  }
+
+  return len;
+}
+
+size_t dust_chunk_length(int chunking, const unsigned char *buf, size_t len, int eof)
+{
+  assert(buf || len == 0);
+  assert(eof || len >= DUST_DATA_BLOCK_SIZE);
+
+  switch (chunking) {
+  case DUST_CHUNKING_FIXED:
+    return len < DUST_DATA_BLOCK_SIZE ? len : DUST_DATA_BLOCK_SIZE;
+  case DUST_CHUNKING_CONTENT:
+    return content_defined_length(buf, len);
+  default:
+    assert(0 && "invalid chunking mode");
+  }
+  return 0;
+}
+
+int dust_chunking_from_name(const char *name)
+{
+  assert(name);
+
+  if (strcmp(name, "fixed") == 0) {
+    return DUST_CHUNKING_FIXED;
+  }
+  if (strcmp(name, "content") == 0) {
+    return DUST_CHUNKING_CONTENT;
+  }
+  return -1;
+}
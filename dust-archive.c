@@ -2,7 +2,9 @@
 #define _GNU_SOURCE
 
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,169 +15,1166 @@
 
 #include <openssl/sha.h>
 
+#include "chunking.h"
 #include "dust-internal.h"
+#include "dust-file-utils.h"
+#include "hardlinks.h"
 #include "io.h"
+#include "memory.h"
 #include "options.h"
+#include "prefetch.h"
+#include "queue.h"
+#include "stat-cache.h"
+#include "types.h"
+#include "walk.h"
+
+/* Which DUST_CHUNKING_* mode to cut file data with. */
+int g_chunking = DUST_CHUNKING_FIXED;
+
+/* How many threads read and fingerprint files. With more than one, the
+ * arena and index are written by a separate thread, in the same order as
+ * a single-threaded run would write them. */
+int g_threads = 1;
+
+/* If set, workers read small files with io_uring, where it's available,
+ * many at a time. Implies a pipelined run, even with only one thread. */
+int g_io_uring = 0;
+
+/* If set, blocks are looked for in manifests of recently put blocks,
+ * instead of the whole index; see DUST_INDEX_FLAG_SAMPLED. */
+int g_sampled_index = 0;
+
+/* Which DUST_CODEC_* to compress newly-stored blocks with. */
+int g_codec = DUST_CODEC_NONE;
+
+/* How often to sync the arena (and so add what's been written to it to the
+ * index); see dust_arena_set_sync_policy(). */
+uint64_t g_sync_bytes = 0;
+uint64_t g_sync_ms = 0;
+
+/* Pipelined runs hand file data from the workers to the writer in
+ * segments of up to this many bytes. */
+#define SEGMENT_SIZE (1024 * 1024)
+#define SEGMENT_MAX_CHUNKS (SEGMENT_SIZE / DUST_CDC_MIN_SIZE)
+#define SEGMENTS_PER_WORKER 4
+
+/* How far the thread reading paths may get ahead of the writer. */
+#define ENTRY_QUEUE_LENGTH 1024
+
+/* With --io-uring, each worker has up to this many files of up to this
+ * size being read at once. */
+#define PREFETCH_DEPTH 64
+#define PREFETCH_MAX_FILE_SIZE (256 * 1024)
+
+/* Fingerprint trees can't be deeper than this: DUST_DATA_BLOCK_SIZE /
+ * DUST_FINGERPRINT_SIZE fingerprints fit in each block, so a tree this deep
+ * could name far more than 2^64 blocks. */
+#define MAX_TREE_LEVELS 8
+
+/* One level of a fingerprint tree: the fingerprints which will make up its
+ * next block, and how many fingerprints it has been given so far. */
+struct tree_level {
+  unsigned char *block; /* DUST_DATA_BLOCK_SIZE bytes, allocated once needed */
+  uint32_t used;        /* bytes of block filled so far */
+  uint64_t count;
+  struct dust_fingerprint first;
+};
+
+/* Collects the fingerprints of a file's blocks, in order, and stores the
+ * tree of fingerprint blocks that names them. Each level of the tree is
+ * kept in memory, and a block of it is stored as soon as it fills, so the
+ * cost of a file's tree is one block of memory per level.
+ * The tree is exactly the one add_file() would build by cutting the list
+ * of fingerprints into fixed-size blocks, and those blocks' fingerprints
+ * into fixed-size blocks in turn, and so on until one fingerprint is left;
+ * in particular each level finishes with a short (possibly empty) block. */
+struct file_builder {
+  dust_index *index;
+  dust_arena *arena;
+  int levels;
+  struct tree_level level[MAX_TREE_LEVELS];
+};
+
+static void file_builder_init(struct file_builder *builder,
+                              dust_index *index,
+                              dust_arena *arena)
+{
+  assert(builder);
+  builder->index = index;
+  builder->arena = arena;
+  builder->levels = 0;
+}
+
+static void file_builder_add_at(struct file_builder *builder,
+                                int n,
+                                struct dust_fingerprint f)
+{
+  assert(n < MAX_TREE_LEVELS);
+  assert(n <= builder->levels);
+
+  struct tree_level *level = &builder->level[n];
+
+  if (n == builder->levels) {
+    level->block = NULL;
+    level->used = 0;
+    level->count = 0;
+    builder->levels++;
+  }
+
+  if (level->count == 0) {
+    /* If this turns out to be the only fingerprint at this level, it
+     * names the file by itself, and there's no block to store. */
+    level->first = f;
+    level->count++;
+    return;
+  }
+
+  if (level->block == NULL) {
+    level->block = dmalloc(DUST_DATA_BLOCK_SIZE);
+    memcpy(level->block, level->first.bytes, DUST_FINGERPRINT_SIZE);
+    level->used = DUST_FINGERPRINT_SIZE;
+  }
+
+  memcpy(level->block + level->used, f.bytes, DUST_FINGERPRINT_SIZE);
+  level->used += DUST_FINGERPRINT_SIZE;
+  level->count++;
+
+  if (level->used == DUST_DATA_BLOCK_SIZE) {
+    struct dust_fingerprint parent = dust_put(builder->index,
+                                              builder->arena,
+                                              level->block,
+                                              level->used,
+                                              DUST_TYPE_FINGERPRINTS);
+    level->used = 0;
+    file_builder_add_at(builder, n + 1, parent);
+  }
+}
+
+static void file_builder_add(struct file_builder *builder, struct dust_fingerprint f)
+{
+  assert(builder);
+  file_builder_add_at(builder, 0, f);
+}
+
+/* Frees what the builder holds, without storing anything more. */
+static void file_builder_free(struct file_builder *builder)
+{
+  assert(builder);
+
+  for (int n = 0; n < builder->levels; n++) {
+    free(builder->level[n].block);
+    builder->level[n].block = NULL;
+  }
+  builder->levels = 0;
+}
+
+static struct dust_fingerprint file_builder_finish(struct file_builder *builder)
+{
+  struct dust_fingerprint f;
+
+  assert(builder);
+  assert(builder->levels > 0);
+
+  /* Store the last block of each level, until a level is left with only
+   * one fingerprint; that one names the file. Storing a level's last block
+   * may create the level above it, so builder->levels is re-read each
+   * time around. */
+  for (int n = 0; ; n++) {
+    struct tree_level *level = &builder->level[n];
+
+    assert(n < builder->levels);
+    assert(level->count > 0);
+
+    if (level->count == 1) {
+      f = level->first;
+      break;
+    }
+
+    struct dust_fingerprint parent = dust_put(builder->index,
+                                              builder->arena,
+                                              level->block,
+                                              level->used,
+                                              DUST_TYPE_FINGERPRINTS);
+    level->used = 0;
+    file_builder_add_at(builder, n + 1, parent);
+  }
+
+  file_builder_free(builder);
+  return f;
+}
+
+/* Reads a file with pread(), skipping over its holes where the system can
+ * tell us where they are. Holes read as zeroes, without touching the disk;
+ * those zeroes then get the reserved fingerprint for zeroes, so they're
+ * never stored either. Can also read a file which is already in memory. */
+struct file_reader {
+  const unsigned char *data; /* if non-null, the whole file, size bytes long */
+  int fd;
+  off_t pos;
+  int sparse;       /* set while we're relying on SEEK_DATA and SEEK_HOLE */
+  off_t size;       /* of the file when we started; only valid if sparse,
+                     * or if reading from memory */
+  off_t data_start; /* the next region of data in the file starts here... */
+  off_t data_end;   /* ...and ends here; only valid if sparse */
+};
+
+static void file_reader_init(struct file_reader *reader, FILE *file)
+{
+  struct stat sb;
+
+  assert(reader);
+  assert(file);
+
+  reader->data = NULL;
+  reader->fd = fileno(file);
+  reader->pos = 0;
+  reader->sparse = 0;
+  reader->size = 0;
+  reader->data_start = 0;
+  reader->data_end = 0;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  if (0 == fstat(reader->fd, &sb) && S_ISREG(sb.st_mode)) {
+    reader->sparse = 1;
+    reader->size = sb.st_size;
+  }
+#else
+  (void)sb;
+#endif
+}
+
+static void file_reader_init_memory(struct file_reader *reader,
+                                   const unsigned char *data,
+                                   size_t size)
+{
+  assert(reader);
+
+  reader->data = data;
+  reader->fd = -1;
+  reader->pos = 0;
+  reader->sparse = 0;
+  reader->size = size;
+  reader->data_start = 0;
+  reader->data_end = 0;
+}
+
+/* Reads up to len bytes into buf. Returns the number of bytes read, which
+ * is 0 only at the end of the file, or -1 if reading fails. */
+static ssize_t file_reader_read(struct file_reader *reader, unsigned char *buf, size_t len)
+{
+  ssize_t rv = 0;
+
+  assert(reader);
+  assert(buf);
+
+  if (reader->data) {
+    if ((off_t)len > reader->size - reader->pos) {
+      len = reader->size - reader->pos;
+    }
+    memcpy(buf, reader->data + reader->pos, len);
+    reader->pos += len;
+    return len;
+  }
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  /* Anything past the size the file had when we started can only be
+   * found by reading, so don't look for holes there. */
+  if (reader->sparse && reader->pos >= reader->size) {
+    reader->sparse = 0;
+  }
+
+  if (reader->sparse && reader->pos >= reader->data_end) {
+    off_t data = lseek(reader->fd, reader->pos, SEEK_DATA);
+    off_t hole = -1;
+
+    if (data == -1 && errno == ENXIO) {
+      /* There's nothing but a hole from here to the end. */
+      data = reader->size;
+      hole = reader->size;
+    } else if (data != -1) {
+      hole = lseek(reader->fd, data, SEEK_HOLE);
+    }
+
+    if (data == -1 || hole == -1) {
+      reader->sparse = 0;
+    } else {
+      reader->data_start = data;
+      reader->data_end = hole;
+    }
+  }
+
+  if (reader->sparse) {
+    if (reader->pos < reader->data_start) {
+      if ((off_t)len > reader->data_start - reader->pos) {
+        len = reader->data_start - reader->pos;
+      }
+      memset(buf, 0, len);
+      reader->pos += len;
+      return len;
+    }
+    if ((off_t)len > reader->data_end - reader->pos) {
+      len = reader->data_end - reader->pos;
+    }
+  }
+#endif
+
+  do {
+    rv = pread(reader->fd, buf, len, reader->pos);
+  } while (rv == -1 && errno == EINTR);
+  if (rv > 0) {
+    reader->pos += rv;
+  }
+  return rv;
+}
+
+typedef void emit_chunk_fn(unsigned char *data,
+                           uint32_t size,
+                           struct dust_fingerprint fingerprint,
+                           void *data_out);
+
+/* Reads from reader to the end of its file, cutting it into chunks as
+ * directed by "chunking", and calls emit() with each chunk and its
+ * fingerprint in turn. There's always at least one chunk, even for an
+ * empty file. If context is non-null, it's updated with the contents of
+ * the file, in the same pass as the fingerprints are calculated.
+ * Returns DUST_OK on success, and some other value if reading fails.
+ */
+static int read_chunks_from(struct file_reader *reader,
+                            int chunking,
+                            SHA256_CTX *context,
+                            emit_chunk_fn emit,
+                            void *data_out)
+{
+  /* Holds the chunk being cut, plus at least one block of lookahead. */
+  size_t buffer_size = 2 * DUST_DATA_BLOCK_SIZE;
+  unsigned char *buffer = dmalloc(buffer_size);
+  size_t start = 0, end = 0;
+  int eof = 0;
+
+  while (1) {
+    if (!eof && end - start < DUST_DATA_BLOCK_SIZE) {
+      memmove(buffer, buffer + start, end - start);
+      end -= start;
+      start = 0;
+    }
+    while (!eof && end - start < DUST_DATA_BLOCK_SIZE) {
+      ssize_t bytes_read = file_reader_read(reader, buffer + end, buffer_size - end);
+      if (bytes_read == -1) {
+        free(buffer);
+        return !DUST_OK;
+      }
+      end += bytes_read;
+      eof = (bytes_read == 0);
+    }
+
+    size_t bytes = dust_chunk_length(chunking, buffer + start, end - start, eof);
+    unsigned char *chunk = buffer + start;
+    start += bytes;
+
+    emit(chunk, bytes, dust_fingerprint_data_and_hash(chunk, bytes, context), data_out);
 
-#define DUST_VERSION 1
+    /* Fixed-size chunking always finishes with a short (possibly empty)
+     * block, which keeps its output identical to that of older versions. */
+    if (eof && (chunking == DUST_CHUNKING_FIXED
+                ? bytes < DUST_DATA_BLOCK_SIZE
+                : start == end)) {
+      break;
+    }
+  }
 
-#define DUST_MAGIC ((uint32_t)0xa7842a73ULL)
+  free(buffer);
+  return DUST_OK;
+}
 
-#define DUST_TYPE_FILEDATA     0
-#define DUST_TYPE_FINGERPRINTS 1
+/* As read_chunks_from(), reading file with a file_reader. */
+static int read_chunks(FILE *file,
+                       int chunking,
+                       SHA256_CTX *context,
+                       emit_chunk_fn emit,
+                       void *data_out)
+{
+  struct file_reader reader;
 
-#define DUST_LISTING_FILE      0
-#define DUST_LISTING_DIRECTORY 1
-#define DUST_LISTING_SYMLINK   2
+  assert(file);
+
+  /* Anything written through file must reach the descriptor first. */
+  if (0 != fflush(file)) {
+    return !DUST_OK;
+  }
+  file_reader_init(&reader, file);
+
+  return read_chunks_from(&reader, chunking, context, emit, data_out);
+}
+
+struct add_file_state {
+  dust_index *index;
+  dust_arena *arena;
+  uint32_t type;
+  struct file_builder builder;
+};
+
+static void put_chunk(unsigned char *data,
+                      uint32_t size,
+                      struct dust_fingerprint fingerprint,
+                      void *data_out)
+{
+  struct add_file_state *state = data_out;
+
+  dust_put_fingerprinted(state->index, state->arena, data, size, state->type, fingerprint);
+  file_builder_add(&state->builder, fingerprint);
+}
 
+/* Stores the contents of file in the arena, cut into chunks as directed by
+ * "chunking", and returns the fingerprint which names them.
+ * Lists of fingerprints are always cut with DUST_CHUNKING_FIXED, since
+ * they must be split on fingerprint boundaries.
+ */
 struct dust_fingerprint add_file(FILE *file,
                                  dust_index *index,
                                  dust_arena *arena,
                                  unsigned char *hash,
-                                 uint32_t type)
+                                 uint32_t type,
+                                 int chunking)
 {
-  unsigned char block[DUST_DATA_BLOCK_SIZE];
+  struct add_file_state state;
   SHA256_CTX context;
-  FILE *fplisting = tmpfile();
-  uint64_t fpcount = 0;
 
   assert(file);
   assert(index);
   assert(arena);
 
-  if (!fplisting) {
-    fprintf(stderr, "Couldn't open fingerprint listing. Bailing.\n");
+  if (hash) {
+    assert(1 == SHA256_Init(&context));
+  }
+
+  state.index = index;
+  state.arena = arena;
+  state.type = type;
+  file_builder_init(&state.builder, index, arena);
+
+  if (read_chunks(file, chunking, hash ? &context : NULL, put_chunk, &state) != DUST_OK) {
+    /* TODO return an error code, instead of blowing up */
+    fprintf(stderr, "Error encountered while reading from file. Bailing.\n");
     exit(1);
   }
 
   if (hash) {
-    assert(1 == SHA256_Init(&context));
+    assert(1 == SHA256_Final(hash, &context));
+  }
+
+  return file_builder_finish(&state.builder);
+}
+
+/* One path to be archived, and what lstat() had to say about it. */
+struct archive_entry {
+  char *path;
+  size_t pathlen;
+  struct stat sb;
+  int failed; /* couldn't be stat()ed; a message has already been printed */
+  int worker; /* in pipelined runs, which worker reads this (regular) file */
+  int unchanged; /* regular file which hasn't changed since g_since was made */
+  struct dust_fingerprint fingerprint; /* from g_since; valid if unchanged */
+  unsigned char hash[SHA256_DIGEST_LENGTH]; /* from g_since; valid if unchanged */
+  const char *link_target; /* earlier path of the same regular file, if any */
+};
+
+/* If non-null, paths to archive come from walking directory trees,
+ * rather than from stdin. */
+struct dust_walk *g_walk = NULL;
+
+/* Path of an earlier archive; files which it shows haven't changed since
+ * it was made are archived again without being read. */
+char *g_since_path = NULL;
+struct dust_stat_cache *g_since = NULL;
+
+/* Where each file with more than one link was first archived. */
+struct dust_link_table *g_links = NULL;
+
+static struct archive_entry *next_walk_entry(void)
+{
+  struct archive_entry *entry = dmalloc(sizeof *entry);
+  int rv = dust_walk_next(g_walk, &entry->path, &entry->sb);
+
+  if (rv == 0) {
+    free(entry);
+    return NULL;
+  }
+
+  if (rv == -1) {
+    entry->path = dstrdup("");
+    entry->failed = 1;
+  } else {
+    entry->failed = 0;
+  }
+  entry->pathlen = strlen(entry->path);
+  entry->worker = -1;
+
+  return entry;
+}
+
+static struct archive_entry *next_stdin_entry(void)
+{
+  struct archive_entry *entry = NULL;
+  char *filename = NULL;
+  size_t linecap = 0;
+  ssize_t linelen = 0;
+
+  linelen = getline(&filename, &linecap, stdin);
+  if (linelen <= 0) {
+    free(filename);
+    return NULL;
+  }
+
+  /* drop the trailing newline */
+  if (filename[linelen-1] == '\n') {
+    filename[linelen-1] = '\0';
+    linelen--;
+  }
+
+  entry = dmalloc(sizeof *entry);
+  entry->path = filename;
+  entry->pathlen = linelen;
+  entry->failed = 0;
+  entry->worker = -1;
+
+  if (0 != lstat(filename, &entry->sb)) {
+    fprintf(stderr,
+            "Failed to stat file '%s'. Bailing.\n",
+            filename);
+    entry->failed = 1;
+  }
+
+  return entry;
+}
+
+/* Returns the next path to archive, and what lstat() says about it, or
+ * NULL once there are no more paths. */
+static struct archive_entry *next_entry(void)
+{
+  struct archive_entry *entry = g_walk ? next_walk_entry() : next_stdin_entry();
+
+  if (!entry) {
+    return NULL;
+  }
+
+  entry->link_target = NULL;
+  if (g_links && !entry->failed && S_ISREG(entry->sb.st_mode)
+      && entry->sb.st_nlink > 1) {
+    entry->link_target = dust_link_table_find_or_add(g_links,
+                                                     &entry->sb,
+                                                     entry->path);
+  }
+
+  entry->unchanged = 0;
+  if (g_since && !entry->failed && S_ISREG(entry->sb.st_mode)
+      && !entry->link_target) {
+    entry->unchanged = dust_stat_cache_lookup(g_since,
+                                              entry->path,
+                                              &entry->sb,
+                                              &entry->fingerprint,
+                                              entry->hash);
+  }
+
+  return entry;
+}
+
+static void free_entry(struct archive_entry *entry)
+{
+  assert(entry);
+  free(entry->path);
+  free(entry);
+}
+
+/* A run of consecutive chunks of one file, handed from a worker to the
+ * writer. */
+struct segment {
+  unsigned char *data; /* the chunks' contents, back to back */
+  size_t used;
+  uint32_t num_chunks;
+  uint32_t sizes[SEGMENT_MAX_CHUNKS];
+  struct dust_fingerprint fingerprints[SEGMENT_MAX_CHUNKS];
+  int last;   /* set on the final segment of a file */
+  int failed; /* set (along with last) if the file couldn't be read */
+  unsigned char hash[SHA256_DIGEST_LENGTH]; /* of the whole file; valid if last */
+};
+
+struct pipeline;
+
+/* Each worker reads the files it's handed in order, and queues up their
+ * contents for the writer in segments. Files are dealt out to workers in
+ * turn, so the writer always knows which worker to wait on next. */
+struct worker {
+  pthread_t thread;
+  struct pipeline *pipeline;   /* that it's part of */
+  struct dust_queue *files;    /* archive_entry pointers; NULL to finish */
+  struct dust_queue *segments; /* filled segments, for the writer */
+  struct dust_queue *unused;   /* empty segments, for the worker */
+  struct segment *current;
+  struct dust_prefetch *prefetch; /* if reading with io_uring */
+};
+
+struct pipeline {
+  int num_workers;
+  struct worker *workers;
+  struct dust_queue *entries; /* every archive_entry, in order; NULL at the end */
+  pthread_t reader;
+
+  /* Set once the writer has given up, so that the reader stops walking and
+   * the workers stop reading; see stop_pipeline(). */
+  pthread_mutex_t lock;
+  int stopping;
+};
+
+/* Returns 0 for false, anything else for true. */
+static int pipeline_is_stopping(struct pipeline *pipeline)
+{
+  int stopping = 0;
+
+  assert(0 == pthread_mutex_lock(&pipeline->lock));
+  stopping = pipeline->stopping;
+  assert(0 == pthread_mutex_unlock(&pipeline->lock));
+  return stopping;
+}
+
+static void queue_segment(struct worker *worker, int last)
+{
+  assert(worker);
+  assert(worker->current);
+
+  worker->current->last = last;
+  dust_queue_push(worker->segments, worker->current);
+  worker->current = last ? NULL : dust_queue_pop(worker->unused);
+  if (worker->current) {
+    worker->current->used = 0;
+    worker->current->num_chunks = 0;
+    worker->current->failed = 0;
+  }
+}
+
+static void add_chunk_to_segment(unsigned char *data,
+                                 uint32_t size,
+                                 struct dust_fingerprint fingerprint,
+                                 void *data_out)
+{
+  struct worker *worker = data_out;
+  struct segment *segment = worker->current;
+
+  if (segment->used + size > SEGMENT_SIZE
+      || segment->num_chunks == SEGMENT_MAX_CHUNKS) {
+    queue_segment(worker, 0);
+    segment = worker->current;
+  }
+
+  memcpy(segment->data + segment->used, data, size);
+  segment->sizes[segment->num_chunks] = size;
+  segment->fingerprints[segment->num_chunks] = fingerprint;
+  segment->used += size;
+  segment->num_chunks++;
+}
+
+/* Reads one file, and queues up its contents for the writer. If data is
+ * non-null, it's the file's contents, already read by dust_prefetch. */
+static void read_file_for_writer(struct worker *worker,
+                                 struct archive_entry *entry,
+                                 unsigned char *data)
+{
+  SHA256_CTX context;
+  int rv = !DUST_OK;
+
+  worker->current = dust_queue_pop(worker->unused);
+  worker->current->used = 0;
+  worker->current->num_chunks = 0;
+  worker->current->failed = 0;
+
+  /* Nothing will be stored, so don't bother reading anything. */
+  if (pipeline_is_stopping(worker->pipeline)) {
+    worker->current->failed = 1;
+    queue_segment(worker, 1);
+    return;
+  }
+
+  assert(1 == SHA256_Init(&context));
+  if (data) {
+    struct file_reader reader;
+
+    file_reader_init_memory(&reader, data, entry->sb.st_size);
+    rv = read_chunks_from(&reader, g_chunking, &context, add_chunk_to_segment, worker);
+  } else {
+    FILE *file = fopen(entry->path, "r");
+    if (file != NULL) {
+      rv = read_chunks(file, g_chunking, &context, add_chunk_to_segment, worker);
+      assert(0 == fclose(file));
+    }
   }
 
+  if (rv == DUST_OK) {
+    assert(1 == SHA256_Final(worker->current->hash, &context));
+  } else {
+    worker->current->failed = 1;
+  }
+  queue_segment(worker, 1);
+}
+
+/* Reads files with io_uring: looks ahead in the worker's queue for up to
+ * PREFETCH_DEPTH small files, and has them all being opened and read at
+ * once, while handing them to the writer strictly in order. Anything that
+ * can't be read this way is read as usual. */
+static void prefetch_files(struct worker *worker)
+{
+  struct archive_entry *window[PREFETCH_DEPTH];
+  int ids[PREFETCH_DEPTH];
+  size_t head = 0, count = 0;
+  int done = 0;
+
   while (1) {
-    size_t bytes = fread(block, 1, DUST_DATA_BLOCK_SIZE, file);
+    /* Never wait for more files while we have some in hand; the writer
+     * may be waiting on one of them. */
+    while (!done && count < PREFETCH_DEPTH) {
+      void *item = NULL;
+
+      if (count == 0) {
+        item = dust_queue_pop(worker->files);
+      } else if (!dust_queue_try_pop(worker->files, &item)) {
+        break;
+      }
+      if (item == NULL) {
+        done = 1;
+        break;
+      }
+
+      struct archive_entry *entry = item;
+      size_t slot = (head + count) % PREFETCH_DEPTH;
 
-    if (bytes < DUST_DATA_BLOCK_SIZE) {
-      if (ferror(file)) {
-        /* TODO return an error code, instead of blowing up */
-        fprintf(stderr, "Error encountered while reading from file. Bailing.\n");
-        exit(1);
+      window[slot] = entry;
+      ids[slot] = -1;
+      if (entry->sb.st_size <= PREFETCH_MAX_FILE_SIZE) {
+        ids[slot] = dust_prefetch_start(worker->prefetch,
+                                        entry->path,
+                                        entry->sb.st_size);
       }
+      count++;
     }
 
-    if (hash) {
-      assert(1 == SHA256_Update(&context, block, bytes));
+    if (count == 0) {
+      break;
     }
 
-    struct dust_fingerprint f = dust_put(index, arena, block, bytes, type);
+    struct archive_entry *entry = window[head];
+    int id = ids[head];
+    unsigned char *data = NULL;
 
-    /* If we only needed to write out one data block for the file,
-     * just return the fingerprint of that block. */
-    if (feof(file) && fpcount == 0) {
-      if (hash) {
-        assert(1 == SHA256_Final(hash, &context));
-      }
-      assert(0 == fclose(fplisting));
-      return f;
+    head = (head + 1) % PREFETCH_DEPTH;
+    count--;
+
+    if (id != -1 && dust_prefetch_wait(worker->prefetch, id, &data) != DUST_OK) {
+      data = NULL;
+    }
+    read_file_for_writer(worker, entry, data);
+    if (id != -1) {
+      dust_prefetch_release(worker->prefetch, id);
+    }
+  }
+}
+
+static void *worker_main(void *data)
+{
+  struct worker *worker = data;
+  struct archive_entry *entry = NULL;
+
+  if (worker->prefetch) {
+    prefetch_files(worker);
+    return NULL;
+  }
+
+  while ((entry = dust_queue_pop(worker->files)) != NULL) {
+    read_file_for_writer(worker, entry, NULL);
+  }
+
+  return NULL;
+}
+
+static void *reader_main(void *data)
+{
+  struct pipeline *pipeline = data;
+  struct archive_entry *entry = NULL;
+  int next_worker = 0;
+
+  while ((entry = next_entry()) != NULL) {
+    int failed = entry->failed;
+
+    if (pipeline_is_stopping(pipeline)) {
+      free_entry(entry);
+      break;
     }
 
-    dfwrite(&f, DUST_FINGERPRINT_SIZE, 1, fplisting);
-    fpcount++;
+    /* Hand the file to its worker before telling the writer about it, so
+     * the writer never waits on a worker which is waiting on us. */
+    if (!entry->failed && S_ISREG(entry->sb.st_mode)
+        && !entry->unchanged && !entry->link_target) {
+      entry->worker = next_worker;
+      dust_queue_push(pipeline->workers[next_worker].files, entry);
+      next_worker = (next_worker + 1) % pipeline->num_workers;
+    }
+    dust_queue_push(pipeline->entries, entry);
 
-    if (feof(file)) {
+    /* The writer gives up on the first entry which failed, and the walk
+     * can't be carried on past it anyway. */
+    if (failed) {
       break;
     }
   }
 
-  if (0 != fseek(fplisting, 0, SEEK_SET)) {
-    fprintf(stderr,
-            "Couldn't seek to beginning of fingerprint listing. Bailing.\n");
+  for (int i = 0; i < pipeline->num_workers; i++) {
+    dust_queue_push(pipeline->workers[i].files, NULL);
+  }
+  dust_queue_push(pipeline->entries, NULL);
+
+  return NULL;
+}
+
+static struct pipeline *start_pipeline(int num_workers)
+{
+  struct pipeline *pipeline = dmalloc(sizeof *pipeline);
+
+  assert(num_workers > 0);
+  pipeline->num_workers = num_workers;
+  pipeline->workers = dmalloc(num_workers * sizeof *pipeline->workers);
+  pipeline->entries = dust_queue_new(ENTRY_QUEUE_LENGTH);
+  assert(0 == pthread_mutex_init(&pipeline->lock, NULL));
+  pipeline->stopping = 0;
+
+  for (int i = 0; i < num_workers; i++) {
+    struct worker *worker = &pipeline->workers[i];
+
+    worker->pipeline = pipeline;
+    worker->files = dust_queue_new(ENTRY_QUEUE_LENGTH);
+    worker->segments = dust_queue_new(SEGMENTS_PER_WORKER);
+    worker->unused = dust_queue_new(SEGMENTS_PER_WORKER);
+    worker->current = NULL;
+    worker->prefetch = NULL;
+    if (g_io_uring) {
+      worker->prefetch = dust_prefetch_new(PREFETCH_DEPTH);
+      if (!worker->prefetch && i == 0 && g_verbosity >= 1) {
+        fprintf(stderr, "io_uring isn't available; reading files one at a time.\n");
+      }
+    }
+    for (int j = 0; j < SEGMENTS_PER_WORKER; j++) {
+      struct segment *segment = dmalloc(sizeof *segment);
+      segment->data = dmalloc(SEGMENT_SIZE);
+      dust_queue_push(worker->unused, segment);
+    }
+    if (0 != pthread_create(&worker->thread, NULL, worker_main, worker)) {
+      fprintf(stderr, "Couldn't start worker thread. Bailing.\n");
+      exit(1);
+    }
+  }
+
+  if (0 != pthread_create(&pipeline->reader, NULL, reader_main, pipeline)) {
+    fprintf(stderr, "Couldn't start reader thread. Bailing.\n");
     exit(1);
   }
 
-  struct dust_fingerprint f = add_file(fplisting, index, arena, hash, DUST_TYPE_FINGERPRINTS);
-  assert(0 == fclose(fplisting));
+  return pipeline;
+}
 
-  if (hash) {
-    assert(1 == SHA256_Final(hash, &context));
+/* Has the reader and workers stop early, and consumes whatever entries
+ * and segments they've already queued, so that none of them is left
+ * waiting for room in a queue. Call finish_pipeline() afterwards. */
+static void stop_pipeline(struct pipeline *pipeline)
+{
+  struct archive_entry *entry = NULL;
+
+  assert(pipeline);
+
+  assert(0 == pthread_mutex_lock(&pipeline->lock));
+  pipeline->stopping = 1;
+  assert(0 == pthread_mutex_unlock(&pipeline->lock));
+
+  while ((entry = dust_queue_pop(pipeline->entries)) != NULL) {
+    if (entry->worker != -1) {
+      struct worker *worker = &pipeline->workers[entry->worker];
+      int last = 0;
+
+      while (!last) {
+        struct segment *segment = dust_queue_pop(worker->segments);
+        last = segment->last;
+        dust_queue_push(worker->unused, segment);
+      }
+    }
+    free_entry(entry);
   }
+}
 
-  return f;
+/* Only to be called once the writer has consumed every entry. */
+static void finish_pipeline(struct pipeline **pipeline)
+{
+  assert(pipeline && *pipeline);
+
+  assert(0 == pthread_join((*pipeline)->reader, NULL));
+  for (int i = 0; i < (*pipeline)->num_workers; i++) {
+    struct worker *worker = &(*pipeline)->workers[i];
+
+    assert(0 == pthread_join(worker->thread, NULL));
+    for (int j = 0; j < SEGMENTS_PER_WORKER; j++) {
+      struct segment *segment = dust_queue_pop(worker->unused);
+      free(segment->data);
+      free(segment);
+    }
+    dust_queue_free(&worker->files);
+    dust_queue_free(&worker->segments);
+    dust_queue_free(&worker->unused);
+    if (worker->prefetch) {
+      dust_prefetch_free(&worker->prefetch);
+    }
+  }
+  dust_queue_free(&(*pipeline)->entries);
+  assert(0 == pthread_mutex_destroy(&(*pipeline)->lock));
+  free((*pipeline)->workers);
+  free(*pipeline);
+  *pipeline = NULL;
+}
+
+/* Stores the segments a worker produced for one file, in the same order
+ * add_file() would have stored them.
+ * Returns DUST_OK on success, and some other value if the worker couldn't
+ * read the file. */
+static int add_file_from_worker(struct worker *worker,
+                                dust_index *index,
+                                dust_arena *arena,
+                                unsigned char *hash,
+                                struct dust_fingerprint *result)
+{
+  struct file_builder builder;
+  int rv = DUST_OK;
+
+  file_builder_init(&builder, index, arena);
+
+  while (1) {
+    struct segment *segment = dust_queue_pop(worker->segments);
+    unsigned char *data = segment->data;
+    int last = segment->last;
+
+    for (uint32_t i = 0; i < segment->num_chunks; i++) {
+      dust_put_fingerprinted(index,
+                             arena,
+                             data,
+                             segment->sizes[i],
+                             DUST_TYPE_FILEDATA,
+                             segment->fingerprints[i]);
+      file_builder_add(&builder, segment->fingerprints[i]);
+      data += segment->sizes[i];
+    }
+    if (last) {
+      rv = segment->failed ? !DUST_OK : DUST_OK;
+      memcpy(hash, segment->hash, SHA256_DIGEST_LENGTH);
+    }
+    dust_queue_push(worker->unused, segment);
+
+    if (last) {
+      break;
+    }
+  }
+
+  if (rv != DUST_OK) {
+    file_builder_free(&builder);
+    return rv;
+  }
+
+  *result = file_builder_finish(&builder);
+  return DUST_OK;
+}
+
+/* Cuts the listing into fixed-size blocks as it's written, storing each
+ * block as soon as it fills, so the listing never has to be staged on
+ * disk. The result is the same as writing it to a file and passing that
+ * to add_file() with DUST_CHUNKING_FIXED. */
+struct listing_writer {
+  unsigned char *block;
+  uint32_t used;
+  struct file_builder builder;
+};
+
+static void listing_writer_init(struct listing_writer *writer,
+                                dust_index *index,
+                                dust_arena *arena)
+{
+  assert(writer);
+  writer->block = dmalloc(DUST_DATA_BLOCK_SIZE);
+  writer->used = 0;
+  file_builder_init(&writer->builder, index, arena);
+}
+
+static void listing_write(struct listing_writer *writer, const void *data, size_t size)
+{
+  const unsigned char *bytes = data;
+
+  assert(writer);
+
+  while (size > 0) {
+    size_t len = DUST_DATA_BLOCK_SIZE - writer->used;
+    if (len > size) {
+      len = size;
+    }
+    memcpy(writer->block + writer->used, bytes, len);
+    writer->used += len;
+    bytes += len;
+    size -= len;
+
+    if (writer->used == DUST_DATA_BLOCK_SIZE) {
+      file_builder_add(&writer->builder,
+                       dust_put(writer->builder.index,
+                                writer->builder.arena,
+                                writer->block,
+                                writer->used,
+                                DUST_TYPE_FILEDATA));
+      writer->used = 0;
+    }
+  }
+}
+
+/* Stores the last, short (possibly empty) block of the listing, and
+ * returns the fingerprint which names the whole listing. */
+static struct dust_fingerprint listing_writer_finish(struct listing_writer *writer)
+{
+  assert(writer);
+
+  file_builder_add(&writer->builder,
+                   dust_put(writer->builder.index,
+                            writer->builder.arena,
+                            writer->block,
+                            writer->used,
+                            DUST_TYPE_FILEDATA));
+  free(writer->block);
+  writer->block = NULL;
+  return file_builder_finish(&writer->builder);
+}
+
+static void listing_writer_free(struct listing_writer *writer)
+{
+  assert(writer);
+  free(writer->block);
+  writer->block = NULL;
+  file_builder_free(&writer->builder);
 }
 
 /* Returns DUST_OK on success, and some other value on failure. */
 int archive_files(dust_index *index, dust_arena *arena)
 {
-  FILE *listing = tmpfile();
+  struct listing_writer listing;
+  struct pipeline *pipeline = NULL;
 
   assert(index);
   assert(arena);
 
-  if (listing == NULL) {
-    fprintf(stderr,
-            "Could not open temporary file to hold file listing. Bailing.\n");
-    return !DUST_OK;
-  }
+  listing_writer_init(&listing, index, arena);
+  g_links = dust_link_table_new();
 
   uint32_t magic = htonl(DUST_MAGIC);
-  dfwrite(&magic, sizeof(magic), 1, listing);
+  listing_write(&listing, &magic, sizeof(magic));
 
   uint32_t version = htonl(DUST_VERSION);
-  dfwrite(&version, sizeof(version), 1, listing);
+  listing_write(&listing, &version, sizeof(version));
 
-  while (1) {
-    struct stat sb;
-    char *filename = NULL;
-    size_t linecap = 0;
-    ssize_t linelen = 0;
+  uint32_t chunking = htonl(g_chunking);
+  listing_write(&listing, &chunking, sizeof(chunking));
 
-    linelen = getline(&filename, &linecap, stdin);
-    if (linelen <= 0) break;
+  if (g_threads > 1 || g_io_uring) {
+    pipeline = start_pipeline(g_threads);
+  }
 
-    /* drop the trailing newline */
-    if (filename[linelen-1] == '\n') {
-      filename[linelen-1] = '\0';
-      linelen--;
-    }
+  while (1) {
+    struct archive_entry *entry = pipeline ? dust_queue_pop(pipeline->entries)
+                                           : next_entry();
+    if (!entry) break;
+
+    char *filename = entry->path;
+    size_t linelen = entry->pathlen;
 
-    if (0 != lstat(filename, &sb)) {
-      fprintf(stderr,
-              "Failed to stat file '%s'. Bailing.\n",
-              filename);
-      return !DUST_OK;
+    if (entry->failed) {
+      free_entry(entry);
+      goto fail;
     }
-    uint32_t permissions = htonl(sb.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+    uint32_t permissions = htonl(entry->sb.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
 
-    if (S_ISREG(sb.st_mode)) {
+    if (S_ISREG(entry->sb.st_mode) && entry->link_target) {
       if (g_verbosity >= 1) {
-        fprintf(stderr, "Archiving file: %s\n", filename);
+        fprintf(stderr, "Archiving hardlink: %s\n", filename);
       }
 
-      FILE *file = fopen(filename, "r");
-      if (file == NULL) {
+      uint32_t recordtype = htonl(DUST_LISTING_HARDLINK);
+      uint32_t pathbytes = htonl(linelen+1);
+      size_t targetlen = strlen(entry->link_target);
+      uint32_t targetbytes = htonl(targetlen+1);
+
+      listing_write(&listing, &recordtype, sizeof(recordtype));
+      listing_write(&listing, &pathbytes, sizeof(pathbytes));
+      listing_write(&listing, filename, linelen+1);
+      listing_write(&listing, &targetbytes, sizeof(targetbytes));
+      listing_write(&listing, entry->link_target, targetlen+1);
+      listing_write(&listing, &permissions, sizeof(permissions));
+
+      free_entry(entry);
+      continue;
+    }
+
+    if (S_ISREG(entry->sb.st_mode)) {
+      if (g_verbosity >= 1) {
         fprintf(stderr,
-                "Could not open file '%s' for reading. Bailing.\n",
+                entry->unchanged ? "Archiving unchanged file: %s\n"
+                                 : "Archiving file: %s\n",
                 filename);
-        return !DUST_OK;
       }
 
       uint32_t recordtype = htonl(DUST_LISTING_FILE);
       uint32_t pathbytes = htonl(linelen+1); /* +1 for the trailing \0 */
       unsigned char hash[SHA256_DIGEST_LENGTH];
-      struct dust_fingerprint f = add_file(file, index, arena, hash, DUST_TYPE_FILEDATA);
-
-      dfwrite(&recordtype, sizeof(recordtype), 1, listing);
-      dfwrite(&pathbytes, sizeof(pathbytes), 1, listing);
-      dfwrite(filename, 1, linelen+1, listing);
-      dfwrite(f.bytes, 1, DUST_FINGERPRINT_SIZE, listing);
-      dfwrite(hash, 1, SHA256_DIGEST_LENGTH, listing);
-      dfwrite(&permissions, sizeof(permissions), 1, listing);
+      struct dust_fingerprint f;
+      uint64_t_be size = uint64host_to_be(entry->sb.st_size);
+      uint64_t_be mtime = uint64host_to_be(dust_stat_mtime(&entry->sb));
+      uint64_t_be ctime = uint64host_to_be(dust_stat_ctime(&entry->sb));
+      uint64_t_be inode = uint64host_to_be(entry->sb.st_ino);
+
+      if (entry->unchanged) {
+        f = entry->fingerprint;
+        memcpy(hash, entry->hash, SHA256_DIGEST_LENGTH);
+      } else if (pipeline) {
+        if (add_file_from_worker(&pipeline->workers[entry->worker],
+                                 index, arena, hash, &f) != DUST_OK) {
+          fprintf(stderr,
+                  "Could not read file '%s'. Bailing.\n",
+                  filename);
+          free_entry(entry);
+          goto fail;
+        }
+      } else {
+        FILE *file = fopen(filename, "r");
+        if (file == NULL) {
+          fprintf(stderr,
+                  "Could not open file '%s' for reading. Bailing.\n",
+                  filename);
+          free_entry(entry);
+          goto fail;
+        }
+        f = add_file(file, index, arena, hash, DUST_TYPE_FILEDATA, g_chunking);
+        assert(0 == fclose(file));
+      }
 
-      assert(0 == fclose(file));
+      listing_write(&listing, &recordtype, sizeof(recordtype));
+      listing_write(&listing, &pathbytes, sizeof(pathbytes));
+      listing_write(&listing, filename, linelen+1);
+      listing_write(&listing, f.bytes, DUST_FINGERPRINT_SIZE);
+      listing_write(&listing, hash, SHA256_DIGEST_LENGTH);
+      listing_write(&listing, &size, sizeof(size));
+      listing_write(&listing, &mtime, sizeof(mtime));
+      listing_write(&listing, &ctime, sizeof(ctime));
+      listing_write(&listing, &inode, sizeof(inode));
+      listing_write(&listing, &permissions, sizeof(permissions));
+
+      free_entry(entry);
       continue;
     }
 
-    if (S_ISDIR(sb.st_mode)) {
+    if (S_ISDIR(entry->sb.st_mode)) {
       if (g_verbosity >= 1) {
         fprintf(stderr, "Archiving directory: %s\n", filename);
       }
@@ -183,14 +1182,16 @@ int archive_files(dust_index *index, dust_arena *arena)
       uint32_t recordtype = htonl(DUST_LISTING_DIRECTORY);
       uint32_t pathbytes = htonl(linelen+1);
 
-      dfwrite(&recordtype, sizeof(recordtype), 1, listing);
-      dfwrite(&pathbytes, sizeof(pathbytes), 1, listing);
-      dfwrite(filename, 1, linelen+1, listing);
-      dfwrite(&permissions, sizeof(permissions), 1, listing);
+      listing_write(&listing, &recordtype, sizeof(recordtype));
+      listing_write(&listing, &pathbytes, sizeof(pathbytes));
+      listing_write(&listing, filename, linelen+1);
+      listing_write(&listing, &permissions, sizeof(permissions));
+
+      free_entry(entry);
       continue;
     }
 
-    if (S_ISLNK(sb.st_mode)) {
+    if (S_ISLNK(entry->sb.st_mode)) {
       if (g_verbosity >= 1) {
         fprintf(stderr, "Archiving symlink: %s\n", filename);
       }
@@ -207,41 +1208,48 @@ int archive_files(dust_index *index, dust_arena *arena)
         fprintf(stderr,
                 "Error encountered reading link '%s'. Bailing.\n",
                 filename);
-        return !DUST_OK;
+        free_entry(entry);
+        goto fail;
       }
 
       targetbytes = htonl(targetlen + 1); /* include trailing '\0' */
 
-      dfwrite(&recordtype, sizeof(recordtype), 1, listing);
-      dfwrite(&pathbytes, sizeof(pathbytes), 1, listing);
-      dfwrite(filename, 1, linelen+1, listing);
-      dfwrite(&targetbytes, sizeof(targetbytes), 1, listing);
-      dfwrite(targetpath, 1, targetlen+1, listing);
-      dfwrite(&permissions, sizeof(permissions), 1, listing);
+      listing_write(&listing, &recordtype, sizeof(recordtype));
+      listing_write(&listing, &pathbytes, sizeof(pathbytes));
+      listing_write(&listing, filename, linelen+1);
+      listing_write(&listing, &targetbytes, sizeof(targetbytes));
+      listing_write(&listing, targetpath, targetlen+1);
+      listing_write(&listing, &permissions, sizeof(permissions));
+
+      free_entry(entry);
       continue;
     }
 
     fprintf(stderr, "Couldn't open file or directory '%s' for reading.\n", filename);
-    return !DUST_OK;
-  }
-
-  if (0 != fflush(listing)) {
-    fprintf(stderr, "Couldn't flush listing file to disk. Bailing.\n");
-    return !DUST_OK;
+    free_entry(entry);
+    goto fail;
   }
 
-  if (0 != fseeko(listing, 0, SEEK_SET)) {
-    fprintf(stderr, "Couldn't seek to beginning of listing. Bailing.\n");
-    return !DUST_OK;
+  if (pipeline) {
+    finish_pipeline(&pipeline);
   }
+  dust_link_table_free(&g_links);
 
-  struct dust_fingerprint f = add_file(listing, index, arena, NULL, DUST_TYPE_FILEDATA);
+  struct dust_fingerprint f = listing_writer_finish(&listing);
 
   dfwrite(&magic, sizeof(magic), 1, stdout);
   dfwrite(f.bytes, 1, DUST_FINGERPRINT_SIZE, stdout);
-  assert(0 == fclose(listing));
 
   return DUST_OK;
+
+fail:
+  if (pipeline) {
+    stop_pipeline(pipeline);
+    finish_pipeline(&pipeline);
+  }
+  dust_link_table_free(&g_links);
+  listing_writer_free(&listing);
+  return !DUST_OK;
 }
 
 int parse_options(int argc, char **argv)
@@ -249,12 +1257,54 @@ int parse_options(int argc, char **argv)
   int ch;
   struct option opts[] = {
 #include "shared-options.c"
+    { "chunking", required_argument, NULL, 'c' },
+    { "threads", required_argument, NULL, 't' },
+    { "io-uring", no_argument, &g_io_uring, 1 },
+    { "sampled-index", no_argument, &g_sampled_index, 1 },
+    { "since", required_argument, NULL, 's' },
+    { "compress", required_argument, NULL, 'z' },
+    { "sync-every-mb", required_argument, NULL, 'b' },
+    { "sync-every-ms", required_argument, NULL, 'm' },
+    { NULL, 0, NULL, 0 }
   };
 
   while ((ch = getopt_long(argc, argv, "", opts, NULL)) != -1) {
     switch (ch) {
     case 0:
       break;
+    case 'c':
+      g_chunking = dust_chunking_from_name(optarg);
+      if (g_chunking == -1) {
+        fprintf(stderr, "Unknown chunking mode '%s'.\n", optarg);
+        exit(2);
+      }
+      break;
+    case 's':
+      g_since_path = optarg;
+      break;
+    case 'z':
+      if (strcmp(optarg, "none") == 0) {
+        g_codec = DUST_CODEC_NONE;
+      } else if (strcmp(optarg, "zlib") == 0) {
+        g_codec = DUST_CODEC_ZLIB;
+      } else {
+        fprintf(stderr, "Unknown compression method '%s'.\n", optarg);
+        exit(2);
+      }
+      break;
+    case 'b':
+      g_sync_bytes = strtoull(optarg, NULL, 10) * 1024 * 1024;
+      break;
+    case 'm':
+      g_sync_ms = strtoull(optarg, NULL, 10);
+      break;
+    case 't':
+      g_threads = atoi(optarg);
+      if (g_threads < 1) {
+        fprintf(stderr, "--threads must be at least 1.\n");
+        exit(2);
+      }
+      break;
     default:
       exit(2);
     }
@@ -277,10 +1327,16 @@ int main(int argc, char **argv)
   argc -= offset;
   argv += offset;
 
+  /* Start walking straight away, so the walk overlaps with loading the
+   * index. */
+  if (argc > 0) {
+    g_walk = dust_walk_start(argv, argc, g_threads);
+  }
+
   index = dust_open_index(
     index_path,
     DUST_PERM_RW,
-    DUST_INDEX_FLAG_CREATE,
+    DUST_INDEX_FLAG_CREATE | (g_sampled_index ? DUST_INDEX_FLAG_SAMPLED : 0),
     DUST_DEFAULT_NUM_BUCKETS
   );
   if (!index) {
@@ -297,12 +1353,29 @@ int main(int argc, char **argv)
     fprintf(stderr, "Failed to open arena file at '%s'.\n", arena_path);
     goto fail;
   }
+  dust_arena_set_sync_policy(arena, g_sync_bytes, g_sync_ms);
+  dust_arena_set_codec(arena, g_codec);
+
+  if (g_since_path) {
+    g_since = dust_stat_cache_load(index, arena, g_since_path, g_chunking);
+    if (!g_since) {
+      fprintf(stderr, "Failed to load earlier archive '%s'.\n", g_since_path);
+      goto fail;
+    }
+  }
 
   if (archive_files(index, arena) != DUST_OK) {
     fprintf(stderr, "Errors encountered while archiving files.\n");
     goto fail;
   }
 
+  if (g_walk) {
+    dust_walk_finish(&g_walk);
+  }
+  if (g_since) {
+    dust_stat_cache_free(&g_since);
+  }
+
   if (dust_close_arena(&arena) != DUST_OK) {
     fprintf(
       stderr,
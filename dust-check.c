@@ -17,7 +17,7 @@ int main(void)
   index = dust_open_index(
     index_path,
     DUST_PERM_READ,
-    DUST_INDEX_FLAG_NONE
+    DUST_INDEX_FLAG_MMAP
   );
   if (!index) {
     fprintf(stderr, "Failed to open index file at '%s'.\n", index_path);
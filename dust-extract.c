@@ -39,6 +39,10 @@ int extract_listing_item(dust_index *index, dust_arena *arena, struct listing_it
     extract_file(index, arena, item.data.file.expected_fingerprint, out, &context);
 
     if (!g_dry_run) {
+      if (finish_extracted_file(out) != DUST_OK) {
+        fprintf(stderr, "Failed to finish writing '%s'. Bailing.\n", item.path);
+        exit(1);
+      }
       assert(0 == fclose(out));
     }
     assert(1 == SHA256_Final(hash, &context));
@@ -71,6 +75,19 @@ int extract_listing_item(dust_index *index, dust_arena *arena, struct listing_it
     }
     break;
   }
+  case DUST_LISTING_HARDLINK: {
+    /* The file it links to comes earlier in the listing, so it's already
+     * been extracted, and its contents checked. */
+    if (g_verbosity >= 1) {
+      fprintf(stderr, "Extracting hardlink: %s\n", item.path);
+    }
+    if (!g_dry_run && (0 != link(item.data.hardlink.targetpath, item.path))) {
+      fprintf(stderr,
+              "Failed to create hardlink. Bailing.\n");
+      exit(1);
+    }
+    break;
+  }
   default: {
     fprintf(stderr,
             "Encountered invalid listing record type '%" PRIu32 "'\n",
@@ -152,7 +169,7 @@ int main(int argc, char **argv)
   index = dust_open_index(
     index_path,
     DUST_PERM_READ,
-    DUST_INDEX_FLAG_NONE
+    DUST_INDEX_FLAG_MMAP
   );
   if (!index) {
     fprintf(stderr, "Failed to open index file at '%s'.\n", index_path);
@@ -1,13 +1,18 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <sys/types.h>
+#include <unistd.h>
 
 #include "dust-file-utils.h"
 #include "io.h"
 #include "memory.h"
+#include "types.h"
 
 FILE *extract_archive_listing(dust_index *index, dust_arena *arena, char *archive_infile)
 {
@@ -41,7 +46,8 @@ FILE *extract_archive_listing(dust_index *index, dust_arena *arena, char *archiv
     return NULL;
   }
 
-  if (extract_file(index, arena, f, listing, NULL) != DUST_OK) {
+  if (extract_file(index, arena, f, listing, NULL) != DUST_OK
+      || finish_extracted_file(listing) != DUST_OK) {
     fprintf(stderr,
             "Failed to extract file listing. Bailing.\n");
     assert(0 == fclose(listing));
@@ -52,7 +58,8 @@ FILE *extract_archive_listing(dust_index *index, dust_arena *arena, char *archiv
   dfread(&magic, sizeof(magic), 1, listing);
   dfread(&version, sizeof(version), 1, listing);
   assert(ntohl(magic) == DUST_MAGIC);
-  assert(ntohl(version) == DUST_VERSION);
+  assert(ntohl(version) >= 1 && ntohl(version) <= DUST_VERSION);
+  assert(0 == fseek(listing, 0, SEEK_SET));
 
   return listing;
 }
@@ -63,12 +70,25 @@ int for_item_in_listing(dust_index *index,
                         int callback(dust_index *index, dust_arena *arena, struct listing_item item))
 {
   int rv = DUST_OK;
+  uint32_t magic = 0, version = 0;
+  int chunking = -1;
 
   assert(index);
   assert(arena);
   assert(listing);
   assert(callback);
 
+  dfread(&magic, sizeof(magic), 1, listing);
+  dfread(&version, sizeof(version), 1, listing);
+  assert(ntohl(magic) == DUST_MAGIC);
+  version = ntohl(version);
+  if (version >= 4) {
+    uint32_t mode = 0;
+
+    dfread(&mode, sizeof(mode), 1, listing);
+    chunking = ntohl(mode);
+  }
+
   while (1) {
     struct listing_item item;
     uint32_t pathlen;
@@ -100,6 +120,25 @@ int for_item_in_listing(dust_index *index,
              1,
              SHA256_DIGEST_LENGTH,
              listing);
+
+      item.data.file.has_stat = (version >= 2);
+      item.data.file.size = 0;
+      item.data.file.mtime = 0;
+      item.data.file.ctime = 0;
+      item.data.file.inode = 0;
+      item.data.file.chunking = chunking;
+      if (item.data.file.has_stat) {
+        uint64_t_be size, mtime, ctime, inode;
+
+        dfread(&size, sizeof(size), 1, listing);
+        dfread(&mtime, sizeof(mtime), 1, listing);
+        dfread(&ctime, sizeof(ctime), 1, listing);
+        dfread(&inode, sizeof(inode), 1, listing);
+        item.data.file.size = uint64be_to_host(size);
+        item.data.file.mtime = (int64_t)uint64be_to_host(mtime);
+        item.data.file.ctime = (int64_t)uint64be_to_host(ctime);
+        item.data.file.inode = uint64be_to_host(inode);
+      }
       break;
     }
     case DUST_LISTING_DIRECTORY: {
@@ -119,6 +158,19 @@ int for_item_in_listing(dust_index *index,
              listing);
       break;
     }
+    case DUST_LISTING_HARDLINK: {
+      uint32_t targetlen = 0;
+
+      dfread(&targetlen, sizeof(targetlen), 1, listing);
+      targetlen = ntohl(targetlen);
+
+      item.data.hardlink.targetpath = dmalloc(targetlen);
+      dfread(item.data.hardlink.targetpath,
+             1,
+             targetlen,
+             listing);
+      break;
+    }
     default: {
       assert(0 && "invalid record type in listing");
     }
@@ -135,6 +187,9 @@ int for_item_in_listing(dust_index *index,
     if (item.recordtype == DUST_LISTING_SYMLINK) {
       free(item.data.symlink.targetpath);
     }
+    if (item.recordtype == DUST_LISTING_HARDLINK) {
+      free(item.data.hardlink.targetpath);
+    }
   }
 
   return rv;
@@ -149,6 +204,20 @@ int extract_file(dust_index *index,
   assert(index);
   assert(arena);
 
+  uint32_t zero_size = 0;
+  if (dust_fingerprint_is_zeroes(fingerprint, &zero_size)) {
+    static const unsigned char zeroes[DUST_DATA_BLOCK_SIZE];
+
+    if (hash_context) {
+      assert(1 == SHA256_Update(hash_context, zeroes, zero_size));
+    }
+    if (outfile && 0 != fseeko(outfile, zero_size, SEEK_CUR)) {
+      /* Not seekable; write them out after all. */
+      dfwrite(zeroes, 1, zero_size, outfile);
+    }
+    return DUST_OK;
+  }
+
   struct dust_block *block = dust_get(index, arena, fingerprint);
   assert(block);
 
@@ -196,3 +265,23 @@ int extract_file(dust_index *index,
   assert(0 && "should not be possible to reach here");
 }
 
+
+int finish_extracted_file(FILE *outfile)
+{
+  off_t length = 0;
+
+  assert(outfile);
+
+  if (0 != fflush(outfile)) {
+    return !DUST_OK;
+  }
+  length = ftello(outfile);
+  if (length == -1) {
+    /* Not seekable, so extract_file() won't have skipped anything. */
+    return DUST_OK;
+  }
+  if (0 != ftruncate(fileno(outfile), length)) {
+    return !DUST_OK;
+  }
+  return DUST_OK;
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <inttypes.h>
 #include <stdarg.h>
@@ -8,15 +10,24 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <openssl/sha.h>
+#include <zlib.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
+#include "bloom.h"
 #include "dust-internal.h"
 #include "io.h"
+#include "manifests.h"
 #include "memory.h"
 #include "types.h"
 
@@ -25,11 +36,55 @@
 #define ASSERT_CONCAT(a, b) ASSERT_CONCAT_(a, b)
 #define ct_assert(e) enum { ASSERT_CONCAT(assert_line_, __LINE__) = 1/((e)?1:0) }
 
-#define MAX_ENTRIES_PER_INDEX_BUCKET ((1024 * 4) / (sizeof (struct index_entry)))
-#define DEFAULT_INDEX_VERSION 0
+/* Version 0 indexes had 102 entries per bucket, chosen by folding the whole
+ * fingerprint, and no tags; they're converted the first time they're opened
+ * for writing. See convert_version_0_index(). */
+#define MAX_ENTRIES_PER_INDEX_BUCKET 96
+#define DEFAULT_INDEX_VERSION 1
+
+/* Indexes grow by a bucket at a time once they're this full. */
+#define INDEX_MAX_LOAD_PERCENT 75
+
+/* Indexes reserve room to grow into (in memory, or by extending the file)
+ * by doubling, but by no more than this many buckets at once. */
+#define INDEX_MAX_RESERVE_BUCKETS (1024 * 64)
 
 #define ARENA_HUNK_SIZE (100 * 1000 * 1000)
 
+/* Appends to an arena are collected in a buffer of this size, and
+ * written out when it fills. */
+#define ARENA_WRITE_BUFFER_SIZE (1024 * 1024 * 4)
+
+/* Space for appends is reserved this far ahead, up to the end of the
+ * current hunk. Reserving whole hunks at once would waste up to a hunk's
+ * worth of disk on arenas which aren't going to grow much. */
+#define ARENA_PREALLOCATE_SIZE (1024 * 1024 * 16)
+
+/* Blocks which have been appended to an arena, but not yet synced, are
+ * kept out of the index. Once this many have built up, the arena is synced
+ * whatever its sync policy says, to bound the memory they use. They're
+ * then added to the index all at once, in order of bucket, so more of
+ * them makes for fewer trips over the index. */
+#define ARENA_MAX_PENDING_BLOCKS (1024 * 256)
+#define ARENA_PENDING_TABLE_SIZE (ARENA_MAX_PENDING_BLOCKS * 2) /* a power of 2 */
+
+/* How many hunks' fingerprints are kept in memory at once by puts; see
+ * arena_cache_hunk(). */
+#define ARENA_HUNK_CACHE_SIZE 16
+
+/* Walks over an arena's blocks read it this many bytes at a time, starting
+ * at a multiple of ARENA_SCAN_READ_ALIGN; see arena_window_view().
+ * dust_fill_index_from_arena() lets the threads listing hunks get no more
+ * than ARENA_SCAN_HUNKS_AHEAD hunks each ahead of the blocks being added
+ * to the index. */
+#define ARENA_SCAN_READ_SIZE (1024 * 1024 * 8)
+#define ARENA_SCAN_READ_ALIGN 4096
+#define ARENA_SCAN_HUNKS_AHEAD 2
+
+/* dust_fingerprint_data_and_hash() works through its data in slices of
+ * this many bytes; a multiple of SHA-256's 64-byte block size. */
+#define FINGERPRINT_SLICE_SIZE (1024 * 8)
+
 ct_assert(DUST_FINGERPRINT_SIZE == SHA256_DIGEST_LENGTH);
 
 struct index_entry {
@@ -38,33 +93,69 @@ struct index_entry {
 };
 
 ct_assert(sizeof (struct index_entry) == 40);
-ct_assert(MAX_ENTRIES_PER_INDEX_BUCKET == 102);
+
+/* Each entry has a tag, which is two bytes of its fingerprint, packed
+ * together at the start of the bucket. A lookup compares its tag with all
+ * of them at once, and only looks at the entries whose tags match. Tags
+ * are copies of fingerprint bytes, so they're the same in any byte order. */
+typedef uint16_t index_tag;
+#define INDEX_TAG_OFFSET 8 /* the bytes of the fingerprint used as its tag */
 
 struct index_bucket {
+  index_tag tags[MAX_ENTRIES_PER_INDEX_BUCKET];
+  uint32_t_be num_entries;
+  uint8_t overflowed; /* see add_fingerprint_to_index() */
+  uint8_t unused[59];
   struct index_entry entries[MAX_ENTRIES_PER_INDEX_BUCKET];
+};
+
+/* Whole vectors of tags are compared at a time, so they mustn't straddle
+ * anything else. */
+ct_assert(sizeof (((struct index_bucket *)0)->tags) % 32 == 0);
+
+ct_assert(sizeof (struct index_bucket) == 4096);
+
+#define MAX_ENTRIES_PER_VERSION_0_INDEX_BUCKET 102
+
+struct version_0_index_bucket {
+  struct index_entry entries[MAX_ENTRIES_PER_VERSION_0_INDEX_BUCKET];
   uint32_t_be num_entries;
   uint8_t unused[12];
 };
 
-ct_assert(sizeof (struct index_bucket) == 4096);
+ct_assert(sizeof (struct version_0_index_bucket) == 4096);
 
+/* Every block in the arena before arena_indexed is in the index; blocks
+ * after it may not be, if whatever was adding them crashed before writing
+ * the index back. Indexes made before this was kept have 0 here. */
 struct index_header {
   uint64_t_be num_buckets;
   uint64_t_be version;
-  uint8_t unused[4080];
+  uint64_t_be num_entries;
+  uint64_t_be arena_indexed;
+  uint8_t unused[4064];
 };
 
 ct_assert(sizeof (struct index_header) == 4096);
 
+/* Blocks written before compression was supported have a 32-bit type
+ * field where stored_size and codec now are; since types are small, these
+ * read as 0 and DUST_CODEC_NONE in those blocks. */
 struct arena_block_header {
-  unsigned char fingerprint[DUST_FINGERPRINT_SIZE];
-  uint32_t_be type;
-  uint32_t_be size;
+  unsigned char fingerprint[DUST_FINGERPRINT_SIZE]; /* of the uncompressed data */
+  uint16_t_be stored_size; /* size of the compressed data; 0 if uncompressed */
+  uint8_t codec;           /* DUST_CODEC_* */
+  uint8_t type;
+  uint32_t_be size;        /* size of the uncompressed data */
   uint64_t_be wtime;
 };
 
 ct_assert(sizeof (struct arena_block_header) == 48);
 
+/* Compressed blocks are only kept if they're smaller than the original, so
+ * their size always fits in stored_size. */
+ct_assert(DUST_DATA_BLOCK_SIZE - 1 <= UINT16_MAX);
+
 struct arena_block {
   struct arena_block_header header;
   unsigned char data[DUST_DATA_BLOCK_SIZE];
@@ -72,6 +163,52 @@ struct arena_block {
 
 ct_assert(sizeof (struct arena_block) == sizeof (struct arena_block_header) + DUST_DATA_BLOCK_SIZE);
 
+/* Hunks which have been filled end with a table of contents: an entry for
+ * each block in the hunk, in order, then a footer. Anything which only
+ * needs blocks' headers can read these instead of the whole hunk. At least
+ * a block header's worth of zeroes is left between the last block and the
+ * table, so that walking the blocks still finds where they end. Hunks
+ * filled by older versions, or still being filled, have none. */
+struct hunk_toc_entry {
+  struct arena_block_header header;
+  uint64_t_be address; /* of the block */
+};
+
+ct_assert(sizeof (struct hunk_toc_entry) == 56);
+
+#define HUNK_TOC_MAGIC "dusttoc1"
+
+struct hunk_toc_footer {
+  unsigned char checksum[SHA256_DIGEST_LENGTH]; /* of the entries */
+  uint32_t_be num_entries;
+  uint8_t unused[4];
+  unsigned char magic[8]; /* HUNK_TOC_MAGIC, without its terminator */
+};
+
+ct_assert(sizeof (struct hunk_toc_footer) == 48);
+
+/* The room at the end of a hunk of n blocks taken up by its table of
+ * contents, and the zeroes before it. */
+#define HUNK_TOC_ROOM(n) \
+  (sizeof(struct arena_block_header) \
+   + (uint64_t)(n) * sizeof(struct hunk_toc_entry) \
+   + sizeof(struct hunk_toc_footer))
+
+/* A list of the blocks in a hunk. */
+struct hunk_blocks {
+  struct hunk_toc_entry *entries;
+  uint32_t num_entries;
+  uint32_t capacity;
+};
+
+/* A large piece of an arena, read all at once, which blocks are looked at
+ * in place rather than being copied out of one at a time. */
+struct arena_window {
+  int fd;
+  unsigned char *buf;  /* ARENA_SCAN_READ_SIZE bytes */
+  uint64_t start, end; /* the part of the arena buf holds */
+};
+
 struct dust_log {
   struct dust_index *index;
   FILE *arena;
@@ -82,11 +219,61 @@ struct dust_block {
   struct arena_block ablock;
 };
 
+struct pending_block {
+  unsigned char fingerprint[DUST_FINGERPRINT_SIZE];
+  uint64_t address;
+};
+
+/* The fingerprints of the blocks in one hunk of an arena. */
+struct cached_hunk {
+  uint64_t hunk;      /* one more than its number; 0 in unused slots */
+  uint64_t last_used;
+  uint32_t num_fingerprints;
+  uint32_t capacity;
+  unsigned char (*fingerprints)[DUST_FINGERPRINT_SIZE]; /* sorted */
+};
+
 struct dust_arena {
-  FILE *stream;
+  FILE *stream; /* for reading */
+  int fd;       /* for appending */
+
+  /* The rest is only used if the arena has been appended to. */
+  uint64_t opened_size;   /* size of the arena when it was opened */
+  uint64_t tail;          /* size of the arena, counting buffered data */
+  uint64_t preallocated;  /* space is reserved up to here */
+  unsigned char *buffer;  /* appended data not yet written */
+  size_t buffered;
+
+  /* The blocks in the current hunk so far, for its table of contents, and
+   * whether it'll have room for one; hunks begun by older versions may
+   * not have been left any. */
+  struct hunk_blocks toc;
+  int toc_fits;
+
+  /* Blocks which have been appended since the arena was last synced.
+   * They're added to pending_index once they've been synced; until then,
+   * they're found through pending_table, which holds one more than their
+   * position in pending (or 0, in unused slots), placed by fingerprint. */
+  dust_index *pending_index;
+  struct pending_block *pending;
+  uint32_t num_pending;
+  uint32_t *pending_table;
+
+  int codec;                    /* DUST_CODEC_* to compress new blocks with */
+  unsigned char *compressed;    /* room for one compressed block */
+
+  uint64_t sync_bytes;      /* 0 for no limit */
+  uint64_t sync_ms;         /* 0 for no limit */
+  uint64_t unsynced_bytes;
+  struct timespec first_unsynced; /* time of the first append since the last sync */
+
+  /* Hunks which blocks put were found in; see arena_cache_hunk(). */
+  struct cached_hunk *hunk_cache; /* ARENA_HUNK_CACHE_SIZE of them */
+  uint64_t hunk_clock;
 };
 
 struct dust_index {
+  uint64_t kick_state; /* for add_fingerprint_to_index() */
   int dirtied;
   int mmapped;
   int writable;
@@ -96,8 +283,34 @@ struct dust_index {
   } file_data;
   struct index_header *header;
   struct index_bucket *buckets; /* array of header->num_buckets buckets */
+  uint64_t bucket_capacity;     /* buckets has room for this many */
+
+  /* For indexes not accessed with mmap, a bit for each bucket which has
+   * been changed since the index was opened; only those buckets are
+   * written back when it's closed. */
+  uint64_t *dirty_buckets;
+  /* For indexes not accessed with mmap, what the header in the file says
+   * about how many buckets there are and how much of the arena is in them,
+   * which write_back_index() keeps true of what's on disk. */
+  uint64_t num_buckets_on_disk;
+  uint64_t arena_indexed_on_disk;
+
+  /* For writable indexes, a filter of every fingerprint in the index, kept
+   * in a file beside it; see open_index_bloom(). */
+  struct dust_bloom *bloom;
+  char *bloom_path;
+
+  /* For indexes opened with DUST_INDEX_FLAG_SAMPLED, what decides whether
+   * blocks put are stored already, instead of the index itself. */
+  struct dust_manifests *manifests;
 };
 
+/* Returns the number of uint64_ts needed for a bit per bucket. */
+static size_t dirty_bucket_words(uint64_t num_buckets)
+{
+  return (num_buckets + 63) / 64;
+}
+
 static void fprint_fingerprint(FILE *out, const unsigned char *fingerprint)
 {
   int i;
@@ -109,11 +322,99 @@ static void fprint_fingerprint(FILE *out, const unsigned char *fingerprint)
   }
 }
 
+/* Returns the number of bytes which follow header in the arena. */
+static uint32_t arena_block_stored_size(const struct arena_block_header *header)
+{
+  assert(header);
+  if (header->codec == DUST_CODEC_NONE) {
+    return uint32be_to_host(header->size);
+  }
+  return uint16be_to_host(header->stored_size);
+}
+
+/* Decompresses stored, the zlib-compressed data which follows header in
+ * the arena, into data, which must have room for DUST_DATA_BLOCK_SIZE
+ * bytes.
+ * Returns DUST_OK on success, and some other value, having written an
+ * explanation to stderr, on failure. */
+static int uncompress_arena_block(const struct arena_block_header *header,
+                                  const unsigned char *stored,
+                                  unsigned char *data)
+{
+  uint32_t size = uint32be_to_host(header->size);
+  uLongf decompressed_size = size;
+
+  if (uncompress(data, &decompressed_size, stored, uint16be_to_host(header->stored_size)) != Z_OK
+      || decompressed_size != size) {
+    fprintf(stderr, "Arena block could not be decompressed.\n");
+    return !DUST_OK;
+  }
+  return DUST_OK;
+}
+
+/* Returns the data of the block with the given header, whose stored bytes,
+ * no more than DUST_DATA_BLOCK_SIZE of them, are at stored: stored itself
+ * if they aren't compressed, and otherwise scratch, which must have room
+ * for DUST_DATA_BLOCK_SIZE bytes, once they've been decompressed into it.
+ * Returns NULL, having written an explanation to stderr, if they can't
+ * be. */
+static const unsigned char *arena_block_data_view(const struct arena_block_header *header,
+                                                   const unsigned char *stored,
+                                                   unsigned char *scratch)
+{
+  switch (header->codec) {
+  case DUST_CODEC_NONE:
+    return stored;
+  case DUST_CODEC_ZLIB:
+    return uncompress_arena_block(header, stored, scratch) == DUST_OK ? scratch : NULL;
+  default:
+    fprintf(stderr, "Arena block has unknown codec %d.\n", header->codec);
+    return NULL;
+  }
+}
+
+/* Reads the data which follows header in stream, decompressing it if need
+ * be, into data, which must have room for DUST_DATA_BLOCK_SIZE bytes.
+ * Returns DUST_OK on success, and some other value, having written an
+ * explanation to stderr, if the data can't be decompressed. */
+static int read_arena_block_data(FILE *stream, const struct arena_block_header *header, unsigned char *data)
+{
+  uint32_t size = 0, stored_size = 0;
+
+  assert(stream);
+  assert(header);
+  assert(data);
+
+  size = uint32be_to_host(header->size);
+  stored_size = arena_block_stored_size(header);
+  if (size > DUST_DATA_BLOCK_SIZE || stored_size > DUST_DATA_BLOCK_SIZE) {
+    fprintf(stderr, "Arena block is too large: %" PRIu32 " bytes\n", size);
+    return !DUST_OK;
+  }
+
+  switch (header->codec) {
+  case DUST_CODEC_NONE: {
+    dfread(data, 1, size, stream);
+    return DUST_OK;
+  }
+  case DUST_CODEC_ZLIB: {
+    unsigned char compressed[DUST_DATA_BLOCK_SIZE];
+
+    dfread(compressed, 1, stored_size, stream);
+    return uncompress_arena_block(header, compressed, data);
+  }
+  default: {
+    fprintf(stderr, "Arena block has unknown codec %d.\n", header->codec);
+    return !DUST_OK;
+  }
+  }
+}
+
 /* index must be a valid pointer to a dust_index object.
  * fd must be a rw file descriptor open on an empty file to be used for an index
  * Returns DUST_OK on success, and some other value on failure.
  */
-static int init_and_mmap_index_from_fd(int fd, dust_index *index, int mmap_prot, int num_buckets)
+static int init_and_mmap_index_from_fd(int fd, dust_index *index, int mmap_prot, uint64_t num_buckets)
 {
   uint64_t default_index_size = sizeof(*index->header)
                               + num_buckets * sizeof(*index->buckets);
@@ -156,8 +457,12 @@ static int init_and_mmap_index_from_fd(int fd, dust_index *index, int mmap_prot,
   if (index->buckets == MAP_FAILED) {
     goto fail;
   }
-  memset(index->buckets, 0, num_buckets * sizeof(*index->buckets));
+  /* The buckets are left as they are: the file was empty, so ftruncate()
+   * has made them a hole, which reads as zeroes without any of it being
+   * touched, or taking up any disk, until something is put there. */
 
+  index->bucket_capacity = num_buckets;
+  index->dirty_buckets = NULL;
   index->dirtied = 1;
   index->mmapped = 1;
   index->file_data.mmapped_fd = fd;
@@ -211,7 +516,15 @@ static int mmap_existing_index_from_fd(int fd, dust_index *index, int mmap_prot)
   if (index->buckets == MAP_FAILED) {
     goto fail;
   }
-
+  /* Lookups land on buckets at random, so reading ahead of them would only
+   * bring in pages nothing is going to look at. This is just advice, so
+   * it doesn't matter if it isn't taken. */
+  (void)posix_madvise(index->buckets,
+                      num_buckets * sizeof(*index->buckets),
+                      POSIX_MADV_RANDOM);
+
+  index->bucket_capacity = num_buckets;
+  index->dirty_buckets = NULL;
   index->dirtied = 0;
   index->mmapped = 1;
   index->file_data.mmapped_fd = fd;
@@ -254,6 +567,14 @@ static int load_existing_index_from_stream(FILE *stream, dust_index *index)
   }
   dfread(index->buckets, sizeof *index->buckets, num_buckets, stream);
 
+  index->dirty_buckets = calloc(dirty_bucket_words(num_buckets), sizeof *index->dirty_buckets);
+  if (!index->dirty_buckets) {
+    goto fail;
+  }
+
+  index->num_buckets_on_disk = num_buckets;
+  index->arena_indexed_on_disk = uint64be_to_host(index->header->arena_indexed);
+  index->bucket_capacity = num_buckets;
   index->dirtied = 0;
   index->mmapped = 0;
 
@@ -269,7 +590,7 @@ fail:
   return !DUST_OK;
 }
 
-static void init_new_index(struct dust_index *index, int num_buckets)
+static void init_new_index(struct dust_index *index, uint64_t num_buckets)
 {
   assert(index);
 
@@ -278,42 +599,205 @@ static void init_new_index(struct dust_index *index, int num_buckets)
   index->header->num_buckets = uint64host_to_be(num_buckets);
   index->header->version = uint64host_to_be(DEFAULT_INDEX_VERSION);
 
+  /* calloc() can hand out fresh pages, known to be zeroes, for this
+   * without touching them. */
   index->buckets = calloc(num_buckets, sizeof(struct index_bucket));
   assert(index->buckets);
-  memset(index->buckets, 0, num_buckets * sizeof(struct index_bucket));
 
+  /* The file is only extended when the index is written back, which gives
+   * zeroes for any buckets which haven't been touched by then. */
+  index->dirty_buckets = calloc(dirty_bucket_words(num_buckets), sizeof *index->dirty_buckets);
+  assert(index->dirty_buckets);
+
+  index->num_buckets_on_disk = 0;
+  index->arena_indexed_on_disk = 0;
+  index->bucket_capacity = num_buckets;
   index->dirtied = 1;
   index->mmapped = 0;
 }
 
-static uint64_t index_bucket_expected_to_contain_fingerprint(struct dust_index *index, unsigned char *fingerprint)
+/* Each fingerprint has two buckets it may be stored in; see
+ * add_fingerprint_to_index(). */
+#define INDEX_PRIMARY_HASH_OFFSET   0
+#define INDEX_SECONDARY_HASH_OFFSET 16
+
+/* How many entries add_fingerprint_to_index() may move to make room for a
+ * new one before it gives up. */
+#define INDEX_MAX_KICKS 128
+
+/* Returns the largest power of two <= num_buckets. */
+static uint64_t index_low_mask(uint64_t num_buckets)
+{
+  uint64_t low_mask = 1;
+
+  while (low_mask <= num_buckets / 2) {
+    low_mask <<= 1;
+  }
+  return low_mask;
+}
+
+/* Fingerprints are uniformly distributed, so 64 of their bits serve as a
+ * hash as they are: the first 64 for a fingerprint's primary bucket, and
+ * another 64 for its secondary one. The bucket is the low bits of that; if
+ * the number of buckets isn't a power of two, the buckets in the lower part
+ * of the range take one more bit, as in linear hashing, so there's no
+ * division, and adding a bucket only moves entries out of one other; see
+ * split_index_bucket(). */
+static uint64_t index_bucket_for_fingerprint(struct dust_index *index,
+                                             const unsigned char *fingerprint,
+                                             int secondary)
 {
-  uint64_t bucket = 0;
+  uint64_t num_buckets = uint64be_to_host(index->header->num_buckets);
+  uint64_t hash = 0, low_mask = index_low_mask(num_buckets), bucket = 0;
+  const unsigned char *bytes = fingerprint + (secondary ? INDEX_SECONDARY_HASH_OFFSET
+                                                        : INDEX_PRIMARY_HASH_OFFSET);
+
+  for (size_t i = 0; i < sizeof(hash); i++) {
+    hash = (hash << 8) | bytes[i];
+  }
 
-  for (size_t i = 0; i < DUST_FINGERPRINT_SIZE; i++) {
-    bucket ^= (fingerprint[i] << ((i % 8) * 8));
+  bucket = hash & (low_mask - 1);
+  if (bucket < num_buckets - low_mask) {
+    bucket = hash & (2 * low_mask - 1);
   }
-  bucket %= uint64be_to_host(index->header->num_buckets);
 
   return bucket;
 }
 
+static index_tag fingerprint_tag(const unsigned char *fingerprint)
+{
+  index_tag tag;
+  memcpy(&tag, fingerprint + INDEX_TAG_OFFSET, sizeof(tag));
+  return tag;
+}
+
+#if defined(__AVX2__) || defined(__SSE2__)
+/* movemask gives two bits per 16-bit lane, both the same; this keeps one
+ * of each pair, packed together. */
+static uint32_t one_bit_per_lane(uint32_t mask)
+{
+  mask &= 0x55555555;
+  mask = (mask | (mask >> 1)) & 0x33333333;
+  mask = (mask | (mask >> 2)) & 0x0f0f0f0f;
+  mask = (mask | (mask >> 4)) & 0x00ff00ff;
+  mask = (mask | (mask >> 8)) & 0x0000ffff;
+  return mask;
+}
+#endif
+
+/* Returns a bitmap with bit i set if the tag of entry base + i in b matches
+ * tag, for i from 0 up to 15. Bits for entries past the end of the bucket
+ * may be set too. */
+static uint32_t match_index_tags(const struct index_bucket *b, size_t base, index_tag tag)
+{
+#if defined(__AVX2__)
+  __m256i tags = _mm256_loadu_si256((const __m256i *)(b->tags + base));
+  __m256i eq = _mm256_cmpeq_epi16(tags, _mm256_set1_epi16((short)tag));
+  return one_bit_per_lane(_mm256_movemask_epi8(eq));
+#elif defined(__SSE2__)
+  __m128i needle = _mm_set1_epi16((short)tag);
+  uint32_t lo = _mm_movemask_epi8(
+    _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(b->tags + base)), needle));
+  uint32_t hi = _mm_movemask_epi8(
+    _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(b->tags + base + 8)), needle));
+  return one_bit_per_lane(lo) | (one_bit_per_lane(hi) << 8);
+#else
+  uint32_t matches = 0;
+
+  for (int i = 0; i < 16; i++) {
+    matches |= (uint32_t)(b->tags[base + i] == tag) << i;
+  }
+  return matches;
+#endif
+}
+
+/* Returns the position of fingerprint in b, or -1 if it isn't there. */
+static int find_in_index_bucket(const struct index_bucket *b, const unsigned char *fingerprint)
+{
+  uint32_t num_entries = uint32be_to_host(b->num_entries);
+  index_tag tag = fingerprint_tag(fingerprint);
+
+  assert(num_entries <= MAX_ENTRIES_PER_INDEX_BUCKET);
+  for (size_t base = 0; base < num_entries; base += 16) {
+    uint32_t matches = match_index_tags(b, base, tag);
+
+    while (matches) {
+      size_t i = base + __builtin_ctz(matches);
+
+      matches &= matches - 1;
+      if (i >= num_entries) {
+        break;
+      }
+      if (memcmp(fingerprint, b->entries[i].fingerprint, DUST_FINGERPRINT_SIZE) == 0) {
+        return i;
+      }
+    }
+  }
+  return -1;
+}
+
+/* Replaces the index's filter with a new one, made from what's in the
+ * index, with room for as many fingerprints as the index has room for
+ * before it next grows. */
+static void rebuild_index_bloom(struct dust_index *index)
+{
+  uint64_t num_buckets = uint64be_to_host(index->header->num_buckets);
+
+  if (index->bloom) {
+    dust_bloom_free(&index->bloom);
+  }
+  index->bloom = dust_bloom_new(num_buckets * MAX_ENTRIES_PER_INDEX_BUCKET
+                                * INDEX_MAX_LOAD_PERCENT / 100);
+  for (uint64_t i = 0; i < num_buckets; i++) {
+    const struct index_bucket *b = &index->buckets[i];
+    uint32_t num_entries = uint32be_to_host(b->num_entries);
+
+    for (uint32_t j = 0; j < num_entries; j++) {
+      dust_bloom_add(index->bloom, b->entries[j].fingerprint);
+    }
+  }
+}
+
+/* Loads the filter saved beside the index, or makes a new one if there
+ * isn't one. A filter which doesn't hold as many fingerprints as the index
+ * does has missed some changes, perhaps because whatever was writing the
+ * index crashed before saving it, so is replaced too. */
+static void open_index_bloom(struct dust_index *index, const char *index_path)
+{
+  index->bloom_path = dmalloc(strlen(index_path) + sizeof(".bloom"));
+  strcpy(index->bloom_path, index_path);
+  strcat(index->bloom_path, ".bloom");
+
+  index->bloom = dust_bloom_load(index->bloom_path);
+  if (!index->bloom
+      || dust_bloom_count(index->bloom) != uint64be_to_host(index->header->num_entries)) {
+    rebuild_index_bloom(index);
+    index->dirtied = 1;
+  }
+}
+
 /* Returns (uint64_t)-1 if fingerprint is not found in the index. */
 static uint64_t get_address_of_fingerprint(struct dust_index *index, unsigned char *fingerprint)
 {
   assert(fingerprint);
 
-  uint64_t bucket = index_bucket_expected_to_contain_fingerprint(index, fingerprint);
+  /* Most lookups of new data end here, without touching the buckets. */
+  if (index->bloom && !dust_bloom_may_contain(index->bloom, fingerprint)) {
+    return (uint64_t)-1;
+  }
+
+  uint64_t bucket = index_bucket_for_fingerprint(index, fingerprint, 0);
   struct index_bucket *b = &index->buckets[bucket];
-  uint32_t num_entries = uint32be_to_host(b->num_entries);
+  int i = find_in_index_bucket(b, fingerprint);
 
-  assert(num_entries <= MAX_ENTRIES_PER_INDEX_BUCKET);
-  for (size_t i = 0; i < num_entries; i++) {
-    if (memcmp(fingerprint, b->entries[i].fingerprint, DUST_FINGERPRINT_SIZE) == 0) {
-      return uint64be_to_host(b->entries[i].address);
-    }
+  if (i == -1 && b->overflowed) {
+    b = &index->buckets[index_bucket_for_fingerprint(index, fingerprint, 1)];
+    i = find_in_index_bucket(b, fingerprint);
+  }
+  if (i == -1) {
+    return (uint64_t)-1;
   }
-  return (uint64_t)-1;
+  return uint64be_to_host(b->entries[i].address);
 }
 
 /* Returns 0 for false, anything else for true. */
@@ -325,208 +809,1433 @@ static int index_contains(struct dust_index *index, unsigned char *fingerprint)
   return address != (uint64_t)-1;
 }
 
-static void add_fingerprint_to_index(struct dust_index *index, unsigned char *fingerprint, uint64_t offset)
+static int index_bucket_is_full(const struct index_bucket *b)
 {
-  assert(fingerprint);
+  return uint32be_to_host(b->num_entries) == MAX_ENTRIES_PER_INDEX_BUCKET;
+}
 
-  uint64_t bucket = index_bucket_expected_to_contain_fingerprint(index, fingerprint);
-  struct index_bucket *b = &index->buckets[bucket];
+/* Returns bucket, for changing, and notes that it's been changed. */
+static struct index_bucket *index_bucket_for_writing(struct dust_index *index, uint64_t bucket)
+{
+  if (index->dirty_buckets) {
+    index->dirty_buckets[bucket / 64] |= (uint64_t)1 << (bucket % 64);
+  }
+  return &index->buckets[bucket];
+}
+
+/* Puts entry in bucket, which must have room, and which must be one of the
+ * entry's two buckets. */
+static void put_in_index_bucket(struct dust_index *index,
+                                uint64_t bucket,
+                                const struct index_entry *entry)
+{
+  struct index_bucket *b = index_bucket_for_writing(index, bucket);
   uint32_t num_entries = uint32be_to_host(b->num_entries);
+  uint64_t primary = index_bucket_for_fingerprint(index, entry->fingerprint, 0);
 
-  /* If we've overflowed the index, we want to know that asap. It's
-   * too big to resize on the fly; might be able to do it as a separate
-   * command at some point. */
   assert(num_entries < MAX_ENTRIES_PER_INDEX_BUCKET);
-
-  memcpy(b->entries[num_entries].fingerprint, fingerprint, DUST_FINGERPRINT_SIZE);
-  b->entries[num_entries].address = uint64host_to_be(offset);
+  b->tags[num_entries] = fingerprint_tag(entry->fingerprint);
+  b->entries[num_entries] = *entry;
   b->num_entries = uint32host_to_be(num_entries + 1);
 
-  index->dirtied = 1;
+  if (bucket != primary) {
+    index_bucket_for_writing(index, primary)->overflowed = 1;
+  }
 }
 
-static void add_block_to_arena(dust_index *index, dust_arena *arena, struct arena_block *block)
+/* Swaps entry with the one at position i in bucket. */
+static void swap_index_entry(struct dust_index *index,
+                             uint64_t bucket,
+                             uint32_t i,
+                             struct index_entry *entry)
 {
-  assert(index);
-  assert(arena);
-  assert(block);
+  struct index_bucket *b = index_bucket_for_writing(index, bucket);
+  struct index_entry displaced = b->entries[i];
+  uint64_t primary = index_bucket_for_fingerprint(index, entry->fingerprint, 0);
 
-  if (!index_contains(index, block->header.fingerprint)) {
-    off_t foff = 0;
-    uint32_t size = uint32be_to_host(block->header.size);
-    uint64_t address = 0;
-
-    assert(fseek(arena->stream, 0, SEEK_END) == 0);
-    foff = ftello(arena->stream);
-    assert(foff >= 0);
-    address = foff;
-    int64_t current_offset = address % ARENA_HUNK_SIZE;
-    int64_t next_offset = current_offset + sizeof(block->header) + size;
-    if (next_offset >= ARENA_HUNK_SIZE) {
-      /* Zero out the remainder of our current hunk. */
-      for ((void)current_offset; current_offset < ARENA_HUNK_SIZE; current_offset++) {
-        assert(0 == putc(0, arena->stream));
-      }
-    }
+  b->tags[i] = fingerprint_tag(entry->fingerprint);
+  b->entries[i] = *entry;
+  *entry = displaced;
 
-    assert(fseek(arena->stream, 0, SEEK_END) == 0);
-    foff = ftello(arena->stream);
-    assert(foff >= 0);
-    address = foff;
-
-    dfwrite(&block->header, sizeof(block->header), 1, arena->stream);
-    dfwrite(block->data, 1, size, arena->stream);
-    assert(0 == fflush(arena->stream));
-    add_fingerprint_to_index(index, block->header.fingerprint, address);
+  if (bucket != primary) {
+    index_bucket_for_writing(index, primary)->overflowed = 1;
   }
 }
 
-static void fast_sanity_check_arena(FILE *arena)
+/* Each entry goes in its primary bucket if that has room, and in its
+ * secondary bucket otherwise, so lookups never look at more than two
+ * buckets. A bucket's overflowed flag is set once any entry whose primary
+ * bucket it is has gone elsewhere; until then, lookups which miss in it
+ * needn't look any further.
+ * If both buckets are full, room is made cuckoo-style: an entry is moved
+ * out of one of them to its other bucket, which may mean moving an entry
+ * out of that one in turn, and so on.
+ * Returns DUST_OK on success, and some other value if no room could be
+ * found, in which case the index is left as it was, apart from perhaps
+ * some overflowed flags. */
+static int place_index_entry(struct dust_index *index, struct index_entry entry)
 {
-  int fd = -1;
-  uint64_t hunks_in_arena = 0;
-  struct stat sb;
+  uint64_t path_buckets[INDEX_MAX_KICKS];
+  uint32_t path_slots[INDEX_MAX_KICKS];
+  int kicks = 0;
 
-  assert(arena);
-  fd = fileno(arena);
-  assert(0 == fstat(fd, &sb));
-  hunks_in_arena = sb.st_size / ARENA_HUNK_SIZE;
-  assert(0 == fseeko(arena, hunks_in_arena * ARENA_HUNK_SIZE, SEEK_SET));
+  uint64_t primary = index_bucket_for_fingerprint(index, entry.fingerprint, 0);
+  uint64_t secondary = index_bucket_for_fingerprint(index, entry.fingerprint, 1);
 
-  while (1) {
-    /* Starting from the beginning of our current arena hunk,
-     * read each data block in turn, confirm it's the right size,
-     * and confirm its fingerprint matches its contents.
-     * This gives us a limited form of self-synchronization -- we
-     * don't need to re-parse the entire arena in order to confirm
-     * the most recent write wasn't cut off somehow. */
-    struct arena_block block;
-    uint32_t size = 0;
-    unsigned char calculated_hash[SHA256_DIGEST_LENGTH];
-    int c;
+  if (!index_bucket_is_full(&index->buckets[primary])) {
+    put_in_index_bucket(index, primary, &entry);
+    return DUST_OK;
+  }
+  if (!index_bucket_is_full(&index->buckets[secondary])) {
+    put_in_index_bucket(index, secondary, &entry);
+    return DUST_OK;
+  }
 
-    if (sb.st_size % ARENA_HUNK_SIZE == 0) break;
-    c = getc(arena);
-    if (c == EOF) {
-      break;
-    } else {
-      assert(c == ungetc(c, arena));
+  uint64_t bucket = primary;
+  while (kicks < INDEX_MAX_KICKS) {
+    /* xorshift; the walk only needs to avoid going round in circles, and
+     * being repeatable keeps rebuilt indexes identical. */
+    index->kick_state ^= index->kick_state << 13;
+    index->kick_state ^= index->kick_state >> 7;
+    index->kick_state ^= index->kick_state << 17;
+
+    uint32_t i = index->kick_state % MAX_ENTRIES_PER_INDEX_BUCKET;
+    swap_index_entry(index, bucket, i, &entry);
+    path_buckets[kicks] = bucket;
+    path_slots[kicks] = i;
+    kicks++;
+
+    /* entry is now the one we displaced; try its other bucket. */
+    uint64_t first = index_bucket_for_fingerprint(index, entry.fingerprint, 0);
+    uint64_t other = (bucket == first)
+                   ? index_bucket_for_fingerprint(index, entry.fingerprint, 1)
+                   : first;
+    if (!index_bucket_is_full(&index->buckets[other])) {
+      put_in_index_bucket(index, other, &entry);
+      return DUST_OK;
     }
+    bucket = other;
+  }
 
-    dfread(&block.header, sizeof(block.header), 1, arena);
-    size = uint32be_to_host(block.header.size);
-    dfread(block.data, 1, size, arena);
-
-    assert(SHA256_DIGEST_LENGTH == DUST_FINGERPRINT_SIZE);
-    SHA256(block.data, size, calculated_hash);
-    assert(0 == memcmp(block.header.fingerprint, calculated_hash, DUST_FINGERPRINT_SIZE));
+  /* Put everything back where it was. */
+  while (kicks > 0) {
+    kicks--;
+    swap_index_entry(index, path_buckets[kicks], path_slots[kicks], &entry);
   }
+  return !DUST_OK;
 }
 
-dust_arena *dust_open_arena(const char *arena_path, int permissions, int flags)
+/* Makes sure index->buckets has room for at least one more bucket than
+ * the index has, filled with zeroes.
+ * Returns DUST_OK on success, and some other value on failure. */
+static int reserve_index_bucket(struct dust_index *index)
 {
-  dust_arena *arena = NULL;
-  int open_flags = 0;
-  char *fopen_flags = NULL;
-  FILE *stream = NULL;
-  int fd = -1;
+  uint64_t num_buckets = uint64be_to_host(index->header->num_buckets);
+  uint64_t capacity = index->bucket_capacity;
 
-  assert(arena_path);
-  assert(*arena_path);
+  if (num_buckets < capacity) {
+    return DUST_OK;
+  }
+  capacity += (capacity < INDEX_MAX_RESERVE_BUCKETS) ? capacity : INDEX_MAX_RESERVE_BUCKETS;
 
-  if (permissions == DUST_PERM_READ) {
-    open_flags = O_RDONLY;
-    fopen_flags = "r";
-  } else if (permissions == DUST_PERM_RW) {
-    open_flags = O_RDWR | O_APPEND;
-    fopen_flags = "a+";
+  if (index->mmapped) {
+    int fd = index->file_data.mmapped_fd;
+    struct index_bucket *buckets = NULL;
+
+    /* The file is extended with a hole, so reads of it give zeroes. */
+    if (ftruncate(fd, sizeof *index->header + capacity * sizeof *index->buckets) != 0) {
+      return !DUST_OK;
+    }
+    buckets = mmap(
+      NULL,
+      capacity * sizeof *index->buckets,
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED,
+      fd,
+      sizeof *index->header
+    );
+    if (buckets == MAP_FAILED) {
+      return !DUST_OK;
+    }
+    assert(munmap(index->buckets, index->bucket_capacity * sizeof *index->buckets) == 0);
+    index->buckets = buckets;
   } else {
-    /* Invalid permissions. */
-    goto fail;
-  }
+    struct index_bucket *buckets = realloc(index->buckets, capacity * sizeof *index->buckets);
 
-  if (flags & DUST_ARENA_FLAG_CREATE) {
-    open_flags = open_flags | O_CREAT;
+    if (!buckets) {
+      return !DUST_OK;
+    }
+    memset(buckets + index->bucket_capacity,
+           0,
+           (capacity - index->bucket_capacity) * sizeof *buckets);
+    index->buckets = buckets;
 
-    /* CREATE requires us to have the write permission set. Failing to
-     * do so is a programming error. */
-    if (permissions != DUST_PERM_RW) {
-      goto fail;
+    size_t old_words = dirty_bucket_words(index->bucket_capacity);
+    size_t new_words = dirty_bucket_words(capacity);
+    uint64_t *dirty_buckets = realloc(index->dirty_buckets, new_words * sizeof *dirty_buckets);
+
+    if (!dirty_buckets) {
+      return !DUST_OK;
     }
+    memset(dirty_buckets + old_words, 0, (new_words - old_words) * sizeof *dirty_buckets);
+    index->dirty_buckets = dirty_buckets;
   }
 
-  fd = open(arena_path, open_flags, 0755);
-  if (fd == -1) {
-    goto fail;
-  }
+  index->bucket_capacity = capacity;
+  return DUST_OK;
+}
 
-  stream = fdopen(fd, fopen_flags);
-  if (!stream) {
-    goto fail;
+/* Adds a bucket to the end of the index. As in linear hashing, the
+ * fingerprints which index_bucket_for_fingerprint() sends to the new bucket
+ * all went to one other bucket, the one which gets split, before; each of
+ * that bucket's entries either stays put, or moves to the new bucket.
+ * Other entries stay where they are.
+ * Returns DUST_OK on success, and some other value if the index couldn't
+ * be made bigger, in which case it's left as it was. */
+static int split_index_bucket(struct dust_index *index)
+{
+  uint64_t num_buckets = uint64be_to_host(index->header->num_buckets);
+  uint64_t split = num_buckets - index_low_mask(num_buckets);
+  uint32_t num_entries = 0, kept = 0;
+
+  if (reserve_index_bucket(index) != DUST_OK) {
+    return !DUST_OK;
   }
 
-  fast_sanity_check_arena(stream);
+  struct index_bucket *from = index_bucket_for_writing(index, split);
+  struct index_bucket *to = index_bucket_for_writing(index, num_buckets);
 
-  arena = malloc(sizeof *arena);
-  if (!arena) {
-    goto fail;
-  }
+  index->header->num_buckets = uint64host_to_be(num_buckets + 1);
+  index->dirtied = 1;
 
-  arena->stream = stream;
-  return arena;
+  /* Entries elsewhere whose primary bucket was the split one may now have
+   * the new one as their primary bucket instead. */
+  to->overflowed = from->overflowed;
 
-fail:
-  if (stream) {
-    fclose(stream);
-  } else if (fd != -1) {
-    close(fd);
-  }
-  if (arena) {
-    free(arena);
+  num_entries = uint32be_to_host(from->num_entries);
+  for (uint32_t i = 0; i < num_entries; i++) {
+    struct index_entry entry = from->entries[i];
+    uint64_t primary = index_bucket_for_fingerprint(index, entry.fingerprint, 0);
+    uint64_t bucket = primary;
+
+    if (primary != split && primary != num_buckets) {
+      bucket = index_bucket_for_fingerprint(index, entry.fingerprint, 1);
+      assert(bucket == split || bucket == num_buckets);
+    }
+
+    if (bucket == num_buckets) {
+      put_in_index_bucket(index, bucket, &entry);
+      continue;
+    }
+    from->tags[kept] = from->tags[i];
+    from->entries[kept] = entry;
+    kept++;
+    if (bucket != primary) {
+      index_bucket_for_writing(index, primary)->overflowed = 1;
+    }
   }
-  return NULL;
+
+  /* Clear out what's left, so that indexes built the same way are the
+   * same byte for byte. */
+  memset(from->tags + kept, 0, (num_entries - kept) * sizeof *from->tags);
+  memset(from->entries + kept, 0, (num_entries - kept) * sizeof *from->entries);
+  from->num_entries = uint32host_to_be(kept);
+
+  return DUST_OK;
 }
 
-dust_index *dust_open_index(const char *index_path, int permissions, int flags, ...)
+static int index_is_overloaded(struct dust_index *index, uint64_t num_entries)
 {
-  dust_index *index = NULL;
-  int open_flags = 0, mmap_prot = PROT_NONE;
-  FILE *stream = NULL;
-  int fd = -1, fstat_rv = -1;
-  struct stat sb;
-  va_list ap;
-  uint64_t num_buckets = DUST_DEFAULT_NUM_BUCKETS;
+  uint64_t num_buckets = uint64be_to_host(index->header->num_buckets);
 
-  assert(index_path);
-  assert(*index_path);
+  return num_entries * 100 > num_buckets * MAX_ENTRIES_PER_INDEX_BUCKET * INDEX_MAX_LOAD_PERCENT;
+}
 
-  va_start(ap, flags);
-  if (flags & DUST_INDEX_FLAG_CREATE) {
-    num_buckets = va_arg(ap, uint64_t);
-  }
-  va_end(ap);
+/* Adds fingerprint to the index, growing the index to make room for it
+ * if need be.
+ * Returns DUST_OK on success, and some other value if there was no room
+ * and the index couldn't be grown. */
+static int add_fingerprint_to_index(struct dust_index *index, unsigned char *fingerprint, uint64_t offset)
+{
+  struct index_entry entry;
+  uint64_t num_entries = uint64be_to_host(index->header->num_entries) + 1;
 
-  if (permissions == DUST_PERM_READ) {
-    open_flags = O_RDONLY;
-    mmap_prot = PROT_READ;
-  } else if (permissions == DUST_PERM_RW) {
-    open_flags = O_RDWR;
-    mmap_prot = PROT_READ | PROT_WRITE;
-  } else {
-    /* Invalid permissions. */
-    goto fail;
-  }
+  assert(fingerprint);
 
-  if (flags & DUST_INDEX_FLAG_CREATE) {
-    open_flags = open_flags | O_CREAT;
+  memcpy(entry.fingerprint, fingerprint, DUST_FINGERPRINT_SIZE);
+  entry.address = uint64host_to_be(offset);
+  index->dirtied = 1;
 
-    /* CREATE requires us to have the write permission set. Failing to
-     * do so is a programming error. */
-    if (permissions != DUST_PERM_RW) {
-      goto fail;
+  while (index_is_overloaded(index, num_entries)) {
+    if (split_index_bucket(index) != DUST_OK) {
+      return !DUST_OK;
+    }
+  }
+  /* Placing an entry can fail well short of the load limit if it happens
+   * to be unlucky in its buckets; more buckets give it other choices. */
+  while (place_index_entry(index, entry) != DUST_OK) {
+    if (split_index_bucket(index) != DUST_OK) {
+      return !DUST_OK;
     }
   }
 
+  index->header->num_entries = uint64host_to_be(num_entries);
+
+  if (index->bloom) {
+    dust_bloom_add(index->bloom, fingerprint);
+    if (dust_bloom_count(index->bloom) > dust_bloom_capacity(index->bloom)) {
+      /* The index has grown past what the filter was made for. */
+      rebuild_index_bloom(index);
+    }
+  }
+  return DUST_OK;
+}
+
+/* Where one of a batch of fingerprints goes in the index. */
+struct index_insert {
+  uint64_t bucket;
+  uint32_t i; /* its position in the batch */
+};
+
+static int compare_index_inserts(const void *a, const void *b)
+{
+  const struct index_insert *x = a, *y = b;
+
+  if (x->bucket != y->bucket) {
+    return x->bucket < y->bucket ? -1 : 1;
+  }
+  /* Otherwise keep them in the order they came in, so that each bucket's
+   * entries are too. */
+  return x->i < y->i ? -1 : (x->i > y->i);
+}
+
+/* One of a batch of fingerprints, for finding the same one twice. */
+struct batch_fingerprint {
+  const unsigned char *fingerprint;
+  uint32_t i; /* its position in the batch */
+};
+
+static int compare_batch_fingerprints(const void *a, const void *b)
+{
+  const struct batch_fingerprint *x = a, *y = b;
+  int c = memcmp(x->fingerprint, y->fingerprint, DUST_FINGERPRINT_SIZE);
+
+  if (c != 0) {
+    return c;
+  }
+  return x->i < y->i ? -1 : (x->i > y->i);
+}
+
+/* Adds a batch of n blocks to the index. Adding them one at a time, in the
+ * order they were put into the arena, would visit buckets all over the
+ * index; instead they're added in order of bucket, so the index is gone
+ * through once, from start to end.
+ * If skip_indexed is set, blocks whose fingerprints are in the index
+ * already, or earlier in the batch, are left out. Arenas appended to with
+ * a sampled index hold some blocks more than once, and only the first
+ * copy of each is indexed.
+ * Returns DUST_OK on success, and some other value if there was no room
+ * for one of them, and the index couldn't be grown. */
+static int add_blocks_to_index(struct dust_index *index,
+                               const struct pending_block *blocks,
+                               uint32_t n,
+                               int skip_indexed)
+{
+  struct index_insert *order = NULL;
+  uint32_t num_inserts = 0;
+  int rv = DUST_OK;
+
+  if (n == 0) {
+    return DUST_OK;
+  }
+
+  order = dmalloc(n * sizeof *order);
+  if (skip_indexed) {
+    struct batch_fingerprint *sorted = dmalloc(n * sizeof *sorted);
+    uint32_t num_sorted = 0;
+
+    for (uint32_t i = 0; i < n; i++) {
+      if (!index_contains(index, (unsigned char *)blocks[i].fingerprint)) {
+        sorted[num_sorted].fingerprint = blocks[i].fingerprint;
+        sorted[num_sorted].i = i;
+        num_sorted++;
+      }
+    }
+    qsort(sorted, num_sorted, sizeof *sorted, compare_batch_fingerprints);
+    for (uint32_t i = 0; i < num_sorted; i++) {
+      if (i == 0 || memcmp(sorted[i].fingerprint, sorted[i - 1].fingerprint, DUST_FINGERPRINT_SIZE) != 0) {
+        order[num_inserts++].i = sorted[i].i;
+      }
+    }
+    free(sorted);
+  } else {
+    for (uint32_t i = 0; i < n; i++) {
+      order[num_inserts++].i = i;
+    }
+  }
+
+  /* Grow the index to fit them all first; growing as they went in would
+   * leave the buckets near the start, which are split first, overfull by
+   * the time they were. */
+  while (index_is_overloaded(index, uint64be_to_host(index->header->num_entries) + num_inserts)) {
+    if (split_index_bucket(index) != DUST_OK) {
+      free(order);
+      return !DUST_OK;
+    }
+  }
+
+  for (uint32_t i = 0; i < num_inserts; i++) {
+    order[i].bucket = index_bucket_for_fingerprint(index, blocks[order[i].i].fingerprint, 0);
+  }
+  qsort(order, num_inserts, sizeof *order, compare_index_inserts);
+
+  for (uint32_t i = 0; i < num_inserts && rv == DUST_OK; i++) {
+    const struct pending_block *p = &blocks[order[i].i];
+    rv = add_fingerprint_to_index(index, (unsigned char *)p->fingerprint, p->address);
+  }
+
+  free(order);
+  return rv;
+}
+
+static uint32_t pending_table_slot(const unsigned char *fingerprint)
+{
+  uint64_t bits = 0;
+
+  /* Fingerprints are uniformly distributed, so any of their bits will do. */
+  memcpy(&bits, fingerprint, sizeof(bits));
+  return bits & (ARENA_PENDING_TABLE_SIZE - 1);
+}
+
+/* Returns 0 for false, anything else for true. */
+static int arena_pending_contains(dust_arena *arena, const unsigned char *fingerprint)
+{
+  uint32_t slot = 0;
+
+  assert(arena);
+  assert(fingerprint);
+
+  if (arena->num_pending == 0) {
+    return 0;
+  }
+
+  for (slot = pending_table_slot(fingerprint);
+       arena->pending_table[slot] != 0;
+       slot = (slot + 1) & (ARENA_PENDING_TABLE_SIZE - 1)) {
+    struct pending_block *p = &arena->pending[arena->pending_table[slot] - 1];
+    if (memcmp(p->fingerprint, fingerprint, DUST_FINGERPRINT_SIZE) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void arena_add_pending(dust_arena *arena, const unsigned char *fingerprint, uint64_t address)
+{
+  uint32_t slot = 0;
+  struct pending_block *p = NULL;
+
+  assert(arena);
+  assert(arena->num_pending < ARENA_MAX_PENDING_BLOCKS);
+
+  p = &arena->pending[arena->num_pending++];
+  memcpy(p->fingerprint, fingerprint, DUST_FINGERPRINT_SIZE);
+  p->address = address;
+
+  slot = pending_table_slot(fingerprint);
+  while (arena->pending_table[slot] != 0) {
+    slot = (slot + 1) & (ARENA_PENDING_TABLE_SIZE - 1);
+  }
+  arena->pending_table[slot] = arena->num_pending;
+}
+
+/* Writes out any buffered appends. */
+static void arena_write_buffer(dust_arena *arena)
+{
+  struct iovec iov;
+
+  assert(arena);
+
+  if (arena->buffered > 0) {
+    iov.iov_base = arena->buffer;
+    iov.iov_len = arena->buffered;
+    dwritev(arena->fd, &iov, 1);
+    arena->buffered = 0;
+  }
+}
+
+/* Appends len bytes from data to the arena. */
+static void arena_append(dust_arena *arena, const void *data, size_t len)
+{
+  const unsigned char *cdata = data;
+
+  assert(arena);
+  assert(arena->buffer);
+  assert(data);
+
+  arena->tail += len;
+  arena->unsynced_bytes += len;
+  while (len > 0) {
+    size_t n = ARENA_WRITE_BUFFER_SIZE - arena->buffered;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(arena->buffer + arena->buffered, cdata, n);
+    cdata += n;
+    arena->buffered += n;
+    len -= n;
+
+    if (arena->buffered == ARENA_WRITE_BUFFER_SIZE) {
+      arena_write_buffer(arena);
+    }
+  }
+}
+
+/* Writes the buckets of a stdio index from first up to end which have
+ * been changed back to fd, each run of neighbouring ones in one go. */
+static void write_dirty_buckets(int fd, struct dust_index *index, uint64_t first, uint64_t end)
+{
+  uint64_t run_start = 0;
+  int in_run = 0;
+
+  for (uint64_t i = first; i <= end; i++) {
+    int dirty = 0;
+
+    if (i < end) {
+      if (!in_run && i % 64 == 0 && i + 64 <= end && index->dirty_buckets[i / 64] == 0) {
+        i += 63; /* nothing to do in this word */
+        continue;
+      }
+      dirty = (index->dirty_buckets[i / 64] >> (i % 64)) & 1;
+    }
+    if (dirty && !in_run) {
+      run_start = i;
+      in_run = 1;
+    } else if (!dirty && in_run) {
+      dpwrite(fd,
+              index->buckets + run_start,
+              (i - run_start) * sizeof(struct index_bucket),
+              sizeof(struct index_header) + run_start * sizeof(struct index_bucket));
+      in_run = 0;
+    }
+  }
+}
+
+static int sync_index_file(int fd)
+{
+  if (fsync(fd) != 0) {
+    fprintf(stderr, "%s:%d: failed to sync index: %s\n",
+            __FILE__, __LINE__, strerror(errno));
+    return !DUST_OK;
+  }
+  return DUST_OK;
+}
+
+/* Writes the buckets of a stdio index which have been changed back to fd,
+ * along with the header, leaving the rest of the file as it is, so writing
+ * back after a few changes costs a few writes.
+ *
+ * The file on disk is a usable index at every point, whatever is cut short
+ * by a failure or a crash. Splitting a bucket moves some of its entries into
+ * one past the end, so buckets past the end of the file are written and
+ * synced first, before a header which counts them but claims no more of
+ * the arena than before, and only then are the buckets already on disk
+ * overwritten; the entries moved are in both places until they are. The
+ * header with how much of the arena is indexed goes last, once every bucket
+ * is on disk, as what it claims is only true of them all.
+ * Returns DUST_OK on success, and some other value if syncing fails; the
+ * buckets are left marked as changed unless it succeeds. */
+static int write_back_index(int fd, struct dust_index *index)
+{
+  uint64_t num_buckets = 0;
+
+  assert(index);
+  assert(index->header);
+  assert(index->buckets);
+  assert(index->dirty_buckets);
+
+  num_buckets = uint64be_to_host(index->header->num_buckets);
+  assert(num_buckets >= index->num_buckets_on_disk);
+
+  if (num_buckets > index->num_buckets_on_disk) {
+    struct index_header header = *index->header;
+
+    /* New buckets which never had anything put in them are left as
+     * holes, which read as zeroes. */
+    assert(ftruncate(fd, sizeof(struct index_header)
+                         + num_buckets * sizeof(struct index_bucket)) == 0);
+    write_dirty_buckets(fd, index, index->num_buckets_on_disk, num_buckets);
+    if (sync_index_file(fd) != DUST_OK) {
+      return !DUST_OK;
+    }
+
+    header.arena_indexed = uint64host_to_be(index->arena_indexed_on_disk);
+    dpwrite(fd, &header, sizeof header, 0);
+    if (sync_index_file(fd) != DUST_OK) {
+      return !DUST_OK;
+    }
+    index->num_buckets_on_disk = num_buckets;
+  }
+
+  write_dirty_buckets(fd, index, 0, index->num_buckets_on_disk);
+  if (sync_index_file(fd) != DUST_OK) {
+    return !DUST_OK;
+  }
+  dpwrite(fd, index->header, sizeof(struct index_header), 0);
+  if (sync_index_file(fd) != DUST_OK) {
+    return !DUST_OK;
+  }
+  index->arena_indexed_on_disk = uint64be_to_host(index->header->arena_indexed);
+
+  memset(index->dirty_buckets, 0,
+         dirty_bucket_words(index->bucket_capacity) * sizeof *index->dirty_buckets);
+  index->dirtied = 0;
+  return DUST_OK;
+}
+
+/* Writes what's been changed in index to disk, as dust_close_index() does,
+ * but leaves it open, so that a crash later on doesn't lose it.
+ * Returns DUST_OK on success, and some other value on failure. */
+static int checkpoint_index(struct dust_index *index)
+{
+  int fd = -1, rv = DUST_OK;
+
+  assert(index);
+
+  if (!index->writable || !index->dirtied) {
+    return DUST_OK;
+  }
+
+  if (index->mmapped) {
+    uint64_t num_buckets = uint64be_to_host(index->header->num_buckets);
+
+    if (msync(index->buckets, num_buckets * sizeof *index->buckets, MS_SYNC) != 0
+        || msync(index->header, sizeof *index->header, MS_SYNC) != 0) {
+      fprintf(stderr, "%s:%d: failed to sync index: %s\n",
+              __FILE__, __LINE__, strerror(errno));
+      return !DUST_OK;
+    }
+    index->dirtied = 0;
+    return DUST_OK;
+  }
+
+  fd = open(index->file_data.stdio_pathname, O_WRONLY);
+  if (fd == -1) {
+    fprintf(stderr, "%s:%d: failed to open index: %s\n",
+            __FILE__, __LINE__, strerror(errno));
+    return !DUST_OK;
+  }
+  rv = write_back_index(fd, index);
+  assert(close(fd) == 0);
+  return rv;
+}
+
+/* Writes out and syncs everything appended to the arena, and only then
+ * adds the blocks appended to the index.
+ * Returns DUST_OK on success, and some other value if syncing fails. */
+static int arena_sync(dust_arena *arena)
+{
+  assert(arena);
+
+  if (!arena->buffer) {
+    return DUST_OK;
+  }
+
+  arena_write_buffer(arena);
+  if (arena->unsynced_bytes > 0) {
+    if (fsync(arena->fd) != 0) {
+      fprintf(stderr, "%s:%d: failed to sync arena: %s\n",
+              __FILE__, __LINE__, strerror(errno));
+      return !DUST_OK;
+    }
+    arena->unsynced_bytes = 0;
+  }
+
+  if (add_blocks_to_index(arena->pending_index, arena->pending, arena->num_pending,
+                          arena->pending_index->manifests != NULL) != DUST_OK) {
+    fprintf(stderr, "%s:%d: index is full, and could not be grown\n", __FILE__, __LINE__);
+    return !DUST_OK;
+  }
+  /* Only if the index had everything before this session's blocks; if it
+   * didn't, it still doesn't. */
+  if (uint64be_to_host(arena->pending_index->header->arena_indexed) >= arena->opened_size) {
+    arena->pending_index->header->arena_indexed = uint64host_to_be(arena->tail);
+    arena->pending_index->dirtied = 1;
+  }
+  for (uint32_t i = 0; i < arena->num_pending; i++) {
+    uint32_t slot = pending_table_slot(arena->pending[i].fingerprint);
+
+    if (arena->pending_index->manifests) {
+      dust_manifests_add(arena->pending_index->manifests, arena->pending[i].fingerprint);
+    }
+
+    while (arena->pending_table[slot] != i + 1) {
+      slot = (slot + 1) & (ARENA_PENDING_TABLE_SIZE - 1);
+    }
+    arena->pending_table[slot] = 0;
+  }
+  arena->num_pending = 0;
+
+  return DUST_OK;
+}
+
+static void hunk_blocks_reserve(struct hunk_blocks *blocks, uint32_t n)
+{
+  if (n > blocks->capacity) {
+    blocks->capacity = n > 4096 ? n : 4096;
+    blocks->entries = realloc(blocks->entries, blocks->capacity * sizeof *blocks->entries);
+    assert(blocks->entries);
+  }
+}
+
+static void hunk_blocks_add(struct hunk_blocks *blocks, const struct arena_block_header *header, uint64_t address)
+{
+  if (blocks->num_entries == blocks->capacity) {
+    hunk_blocks_reserve(blocks, blocks->capacity * 2 + 1);
+  }
+  blocks->entries[blocks->num_entries].header = *header;
+  blocks->entries[blocks->num_entries].address = uint64host_to_be(address);
+  blocks->num_entries++;
+}
+
+/* Reads the table of contents of the given hunk of the arena read through
+ * fd, which is arena_size bytes long, into blocks.
+ * Returns DUST_OK if it has one, and it's intact, and some other value
+ * otherwise; *damaged is set if it seems to have one which isn't. */
+static int read_hunk_toc(int fd, uint64_t arena_size, uint64_t hunk, struct hunk_blocks *blocks, int *damaged)
+{
+  struct hunk_toc_footer footer;
+  unsigned char checksum[SHA256_DIGEST_LENGTH];
+  uint64_t hunk_end = (hunk + 1) * ARENA_HUNK_SIZE;
+  uint64_t toc_start = 0, blocks_end = hunk * ARENA_HUNK_SIZE;
+  uint32_t n = 0;
+  size_t len = 0;
+
+  blocks->num_entries = 0;
+  *damaged = 0;
+
+  if (arena_size < hunk_end
+      || dpread(fd, &footer, sizeof(footer), hunk_end - sizeof(footer)) != sizeof(footer)
+      || memcmp(footer.magic, HUNK_TOC_MAGIC, sizeof(footer.magic)) != 0) {
+    return !DUST_OK;
+  }
+
+  *damaged = 1;
+  n = uint32be_to_host(footer.num_entries);
+  if (HUNK_TOC_ROOM(n) > ARENA_HUNK_SIZE) {
+    return !DUST_OK;
+  }
+  toc_start = hunk_end - HUNK_TOC_ROOM(n) + sizeof(struct arena_block_header);
+  len = n * sizeof(struct hunk_toc_entry);
+  hunk_blocks_reserve(blocks, n);
+  if (dpread(fd, blocks->entries, len, toc_start) != len) {
+    return !DUST_OK;
+  }
+  SHA256((unsigned char *)blocks->entries, len, checksum);
+  if (memcmp(checksum, footer.checksum, sizeof(checksum)) != 0) {
+    return !DUST_OK;
+  }
+
+  /* The entries must describe blocks laid end to end, before the table. */
+  for (uint32_t i = 0; i < n; i++) {
+    const struct hunk_toc_entry *e = &blocks->entries[i];
+    uint64_t address = uint64be_to_host(e->address);
+
+    if (address != blocks_end
+        || arena_block_stored_size(&e->header) > DUST_DATA_BLOCK_SIZE) {
+      return !DUST_OK;
+    }
+    blocks_end = address + sizeof(e->header) + arena_block_stored_size(&e->header);
+  }
+  if (blocks_end + sizeof(struct arena_block_header) > toc_start) {
+    return !DUST_OK;
+  }
+
+  blocks->num_entries = n;
+  *damaged = 0;
+  return DUST_OK;
+}
+
+static void arena_window_init(struct arena_window *window, int fd)
+{
+  void *buf = NULL;
+
+  assert(0 == posix_memalign(&buf, ARENA_SCAN_READ_ALIGN, ARENA_SCAN_READ_SIZE));
+  window->fd = fd;
+  window->buf = buf;
+  window->start = 0;
+  window->end = 0;
+}
+
+static void arena_window_free(struct arena_window *window)
+{
+  free(window->buf);
+  window->buf = NULL;
+}
+
+/* Returns a pointer to the len bytes of the arena at offset, moving the
+ * window on to them if it doesn't hold them all already, or NULL if the
+ * arena ends before they do. The pointer is good until the window is
+ * next moved. len must be no more than DUST_DATA_BLOCK_SIZE plus a block
+ * header, or so, which every block is. */
+static const unsigned char *arena_window_view(struct arena_window *window, uint64_t offset, size_t len)
+{
+  assert(len <= ARENA_SCAN_READ_SIZE - ARENA_SCAN_READ_ALIGN);
+
+  if (offset < window->start || offset + len > window->end) {
+    window->start = offset - offset % ARENA_SCAN_READ_ALIGN;
+    window->end = window->start + dpread(window->fd, window->buf, ARENA_SCAN_READ_SIZE, window->start);
+    if (offset + len > window->end) {
+      return NULL;
+    }
+  }
+  return window->buf + (offset - window->start);
+}
+
+/* Lists the blocks in the given hunk of the arena by reading their headers
+ * through window, stopping at end if the hunk doesn't end first.
+ * Returns DUST_OK on success, and some other value, having written an
+ * explanation to stderr, if the hunk isn't laid out as it should be. */
+static int walk_hunk_headers(struct arena_window *window, uint64_t hunk, uint64_t end, struct hunk_blocks *blocks)
+{
+  struct arena_block_header zero_header;
+  uint64_t offset = hunk * ARENA_HUNK_SIZE;
+  int rv = DUST_OK;
+
+  if (end > offset + ARENA_HUNK_SIZE) {
+    end = offset + ARENA_HUNK_SIZE;
+  }
+  memset(&zero_header, 0, sizeof(zero_header));
+  blocks->num_entries = 0;
+
+  while (offset < end && offset % ARENA_HUNK_SIZE + sizeof(struct arena_block_header) <= ARENA_HUNK_SIZE) {
+    const struct arena_block_header *header = NULL;
+    uint32_t stored_size = 0;
+
+    if (offset + sizeof(*header) > end
+        || !(header = (const void *)arena_window_view(window, offset, sizeof(*header)))) {
+      fprintf(stderr, "Arena ends part-way through the block at offset %" PRIu64 "\n", offset);
+      rv = !DUST_OK;
+      break;
+    }
+
+    if (memcmp(header, &zero_header, sizeof(*header)) == 0) {
+      break; /* the padding at the end of the hunk */
+    }
+
+    stored_size = arena_block_stored_size(header);
+    if (uint32be_to_host(header->size) > DUST_DATA_BLOCK_SIZE || stored_size > DUST_DATA_BLOCK_SIZE) {
+      fprintf(stderr, "Arena block at offset %" PRIu64 " is too large: %" PRIu32 " bytes\n",
+              offset, uint32be_to_host(header->size));
+      rv = !DUST_OK;
+      break;
+    }
+    if (offset + sizeof(*header) + stored_size > end) {
+      fprintf(stderr, "Arena ends part-way through the block at offset %" PRIu64 "\n", offset);
+      rv = !DUST_OK;
+      break;
+    }
+
+    hunk_blocks_add(blocks, header, offset);
+    offset += sizeof(*header) + stored_size;
+  }
+
+  return rv;
+}
+
+/* Lists the blocks in the given hunk of the arena read through window,
+ * looking at no more than its first end bytes, from its table of contents
+ * if it has an intact one, and by reading their headers otherwise.
+ * Returns as walk_hunk_headers() does. */
+static int list_hunk_blocks(struct arena_window *window, uint64_t hunk, uint64_t end, struct hunk_blocks *blocks)
+{
+  int damaged = 0;
+
+  if (read_hunk_toc(window->fd, end, hunk, blocks, &damaged) == DUST_OK) {
+    return DUST_OK;
+  }
+  return walk_hunk_headers(window, hunk, end, blocks);
+}
+
+/* Writes the table of contents of the arena's current hunk, which ends
+ * room bytes after the arena's tail, preceded by zeroes. */
+static void arena_write_toc(dust_arena *arena, uint64_t room)
+{
+  static const unsigned char zeroes[1024 * 64];
+  struct hunk_toc_footer footer;
+  struct iovec *iov = NULL;
+  uint64_t gap = room - (HUNK_TOC_ROOM(arena->toc.num_entries) - sizeof(struct arena_block_header));
+  size_t len = arena->toc.num_entries * sizeof(struct hunk_toc_entry);
+  int iovcnt = 0;
+
+  memset(&footer, 0, sizeof(footer));
+  SHA256((unsigned char *)arena->toc.entries, len, footer.checksum);
+  footer.num_entries = uint32host_to_be(arena->toc.num_entries);
+  memcpy(footer.magic, HUNK_TOC_MAGIC, sizeof(footer.magic));
+
+  /* All in one write, so the hunk is never seen to end part-way through
+   * its padding. */
+  iov = dmalloc((gap / sizeof(zeroes) + 3) * sizeof *iov);
+  while (gap > 0) {
+    iov[iovcnt].iov_base = (void *)zeroes;
+    iov[iovcnt].iov_len = gap < sizeof(zeroes) ? gap : sizeof(zeroes);
+    gap -= iov[iovcnt].iov_len;
+    iovcnt++;
+  }
+  iov[iovcnt].iov_base = arena->toc.entries;
+  iov[iovcnt].iov_len = len;
+  iovcnt++;
+  iov[iovcnt].iov_base = &footer;
+  iov[iovcnt].iov_len = sizeof(footer);
+  iovcnt++;
+
+  dwritev(arena->fd, iov, iovcnt);
+  free(iov);
+}
+
+/* Ends the arena's current hunk with its table of contents, if it has room
+ * for one, and pads the rest of it with zeroes. Without a table, they're
+ * left as a hole in the file, rather than written out, where the
+ * filesystem allows. */
+static void arena_end_hunk(dust_arena *arena)
+{
+  uint64_t padding_start = 0, hunk_end = 0;
+
+  assert(arena);
+
+  arena_write_buffer(arena);
+  padding_start = arena->tail;
+  hunk_end = padding_start + (ARENA_HUNK_SIZE - padding_start % ARENA_HUNK_SIZE);
+
+  if (arena->toc_fits) {
+    assert(hunk_end - padding_start >= HUNK_TOC_ROOM(arena->toc.num_entries));
+    arena_write_toc(arena, hunk_end - padding_start);
+    arena->unsynced_bytes += hunk_end - padding_start;
+  } else {
+    if (ftruncate(arena->fd, hunk_end) != 0) {
+      fprintf(stderr, "%s:%d: failed to pad arena hunk: %s\nTerminating.\n",
+              __FILE__, __LINE__, strerror(errno));
+      exit(1);
+    }
+#ifdef FALLOC_FL_PUNCH_HOLE
+    /* Give back whatever arena_preallocate() reserved for the padding.
+     * It reads as zeroes either way, so failure doesn't matter. */
+    (void)fallocate(arena->fd,
+                    FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    padding_start,
+                    hunk_end - padding_start);
+#endif
+  }
+  arena->tail = hunk_end;
+  arena->toc.num_entries = 0;
+  arena->toc_fits = 1;
+}
+
+/* Asks the filesystem to reserve the next ARENA_PREALLOCATE_SIZE bytes of
+ * the arena's current hunk, so that hunks are laid out contiguously. The
+ * arena's size is left alone, and it's not an error if this can't be done. */
+static void arena_preallocate(dust_arena *arena)
+{
+  uint64_t hunk_end = 0;
+
+  assert(arena);
+
+  hunk_end = arena->tail + (ARENA_HUNK_SIZE - arena->tail % ARENA_HUNK_SIZE);
+  arena->preallocated = arena->tail + ARENA_PREALLOCATE_SIZE;
+  if (arena->preallocated > hunk_end) {
+    arena->preallocated = hunk_end;
+  }
+
+#ifdef FALLOC_FL_KEEP_SIZE
+  (void)fallocate(arena->fd,
+                  FALLOC_FL_KEEP_SIZE,
+                  arena->tail,
+                  arena->preallocated - arena->tail);
+#endif
+}
+
+static uint64_t ms_since(const struct timespec *then)
+{
+  struct timespec now;
+
+  assert(0 == clock_gettime(CLOCK_MONOTONIC, &now));
+  return (uint64_t)(now.tv_sec - then->tv_sec) * 1000
+       + (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+static int compare_fingerprints(const void *a, const void *b)
+{
+  return memcmp(a, b, DUST_FINGERPRINT_SIZE);
+}
+
+/* Returns 0 for false, anything else for true. */
+static int arena_hunk_cache_contains(dust_arena *arena, const unsigned char *fingerprint)
+{
+  if (!arena->hunk_cache) {
+    return 0;
+  }
+
+  for (int i = 0; i < ARENA_HUNK_CACHE_SIZE; i++) {
+    struct cached_hunk *c = &arena->hunk_cache[i];
+
+    if (c->hunk != 0
+        && bsearch(fingerprint, c->fingerprints, c->num_fingerprints,
+                   DUST_FINGERPRINT_SIZE, compare_fingerprints)) {
+      c->last_used = ++arena->hunk_clock;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Returns 0 for false, anything else for true. */
+static int hunk_is_cached(dust_arena *arena, uint64_t hunk)
+{
+  for (int i = 0; i < ARENA_HUNK_CACHE_SIZE; i++) {
+    if (arena->hunk_cache[i].hunk == hunk + 1) {
+      arena->hunk_cache[i].last_used = ++arena->hunk_clock;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Reads the fingerprints of the blocks in the given hunk of the arena into
+ * the cache, in place of the hunk least recently found to hold a block.
+ * Data put is mostly put again in much the same order, so once one block
+ * turns out to be stored already, those stored alongside it are likely to
+ * come next, and can be found without looking at the index.
+ * Only hunks whose blocks can be listed cheaply are cached: those with an
+ * intact table of contents, and the hunk being appended to, whose blocks
+ * are kept in memory. Reading through a whole hunk which has no table
+ * would cost more than the index lookups it saves, so blocks in those are
+ * still looked up one at a time.
+ * Only blocks known to be in the index are read: a block written before a
+ * crash which kept it out of the index would otherwise be taken as stored,
+ * and then couldn't be found by anything reading it back. */
+static void arena_cache_hunk(dust_arena *arena, dust_index *index, uint64_t hunk)
+{
+  struct cached_hunk *c = NULL;
+  struct hunk_blocks read_blocks = { NULL, 0, 0 };
+  const struct hunk_blocks *blocks = NULL;
+  uint64_t indexed = uint64be_to_host(index->header->arena_indexed);
+  int damaged = 0;
+
+  if (!arena->hunk_cache) {
+    arena->hunk_cache = calloc(ARENA_HUNK_CACHE_SIZE, sizeof *arena->hunk_cache);
+    assert(arena->hunk_cache);
+  }
+  if (hunk_is_cached(arena, hunk)) {
+    return;
+  }
+
+  if (hunk == arena->tail / ARENA_HUNK_SIZE) {
+    /* Its blocks are only known once something has been appended. */
+    if (!arena->buffer) {
+      return;
+    }
+    blocks = &arena->toc;
+  } else if (read_hunk_toc(arena->fd, arena->tail, hunk, &read_blocks, &damaged) == DUST_OK) {
+    blocks = &read_blocks;
+  } else {
+    free(read_blocks.entries);
+    return;
+  }
+
+  c = &arena->hunk_cache[0];
+  for (int i = 1; i < ARENA_HUNK_CACHE_SIZE && c->hunk != 0; i++) {
+    if (arena->hunk_cache[i].hunk == 0 || arena->hunk_cache[i].last_used < c->last_used) {
+      c = &arena->hunk_cache[i];
+    }
+  }
+  c->hunk = hunk + 1;
+  c->last_used = ++arena->hunk_clock;
+  c->num_fingerprints = 0;
+
+  if (blocks->num_entries > c->capacity) {
+    c->capacity = blocks->num_entries;
+    c->fingerprints = realloc(c->fingerprints, c->capacity * sizeof *c->fingerprints);
+    assert(c->fingerprints);
+  }
+  for (uint32_t i = 0; i < blocks->num_entries; i++) {
+    uint64_t address = uint64be_to_host(blocks->entries[i].address);
+
+    /* Blocks added this session are in the index, or waiting to be. */
+    if (address < indexed || address >= arena->opened_size) {
+      memcpy(c->fingerprints[c->num_fingerprints++],
+             blocks->entries[i].header.fingerprint,
+             DUST_FINGERPRINT_SIZE);
+    }
+  }
+  free(read_blocks.entries);
+
+  qsort(c->fingerprints, c->num_fingerprints, DUST_FINGERPRINT_SIZE, compare_fingerprints);
+}
+
+/* Appends a block to the arena, unless one with the same fingerprint is
+ * already there. The block is added to the index once the arena is next
+ * synced, as directed by its sync policy.
+ * With a sampled index, "already there" means found in the manifests;
+ * blocks found there are recorded in them again straight away, and blocks
+ * stored are recorded once they've been synced. */
+static void add_block_to_arena(dust_index *index,
+                               dust_arena *arena,
+                               struct arena_block_header *header,
+                               unsigned char *data)
+{
+  assert(index);
+  assert(arena);
+  assert(header);
+  assert(data);
+
+  if (arena_pending_contains(arena, header->fingerprint)) {
+    return;
+  }
+  if (index->manifests) {
+    if (dust_manifests_contains(index->manifests, header->fingerprint)) {
+      dust_manifests_add(index->manifests, header->fingerprint);
+      return;
+    }
+  } else if (arena_hunk_cache_contains(arena, header->fingerprint)) {
+    return;
+  } else {
+    uint64_t address = get_address_of_fingerprint(index, header->fingerprint);
+
+    if (address != (uint64_t)-1) {
+      arena_cache_hunk(arena, index, address / ARENA_HUNK_SIZE);
+      return;
+    }
+  }
+
+  if (!arena->buffer) {
+    arena->buffer = dmalloc(ARENA_WRITE_BUFFER_SIZE);
+    arena->pending = dmalloc(ARENA_MAX_PENDING_BLOCKS * sizeof(*arena->pending));
+    arena->pending_table = calloc(ARENA_PENDING_TABLE_SIZE, sizeof(*arena->pending_table));
+    assert(arena->pending_table);
+
+    /* Carrying on with a hunk begun earlier, its table of contents needs
+     * the blocks already in it. */
+    if (arena->tail % ARENA_HUNK_SIZE != 0) {
+      struct arena_window window;
+
+      arena_window_init(&window, arena->fd);
+      if (walk_hunk_headers(&window, arena->tail / ARENA_HUNK_SIZE, arena->tail, &arena->toc) != DUST_OK) {
+        fprintf(stderr, "Terminating.\n");
+        exit(1);
+      }
+      arena_window_free(&window);
+      arena->toc_fits = (arena->tail % ARENA_HUNK_SIZE + HUNK_TOC_ROOM(arena->toc.num_entries)
+                         < ARENA_HUNK_SIZE);
+    }
+  }
+  assert(arena->pending_index == NULL || arena->pending_index == index);
+  arena->pending_index = index;
+
+  uint32_t size = uint32be_to_host(header->size);
+
+  if (arena->codec == DUST_CODEC_ZLIB) {
+    /* Leaving the destination a byte short of the original means blocks
+     * which don't shrink fail to compress, and are stored as they are. */
+    uLongf compressed_size = size - 1;
+
+    if (size > 1
+        && compress2(arena->compressed, &compressed_size, data, size, Z_BEST_SPEED) == Z_OK) {
+      header->codec = DUST_CODEC_ZLIB;
+      header->stored_size = uint16host_to_be(compressed_size);
+      data = arena->compressed;
+      size = compressed_size;
+    }
+  }
+
+  uint64_t address = arena->tail;
+  int64_t current_offset = address % ARENA_HUNK_SIZE;
+  int64_t next_offset = current_offset + sizeof(*header) + size;
+  int checkpoint = 0;
+
+  if (arena->unsynced_bytes == 0) {
+    assert(0 == clock_gettime(CLOCK_MONOTONIC, &arena->first_unsynced));
+  }
+
+  /* Leave room for the hunk's table of contents, counting this block. */
+  if (arena->toc_fits) {
+    next_offset += HUNK_TOC_ROOM(arena->toc.num_entries + 1);
+  }
+  if (next_offset >= ARENA_HUNK_SIZE) {
+    arena_end_hunk(arena);
+    address = arena->tail;
+  }
+  if (address + sizeof(*header) + size > arena->preallocated) {
+    arena_preallocate(arena);
+  }
+
+  arena_append(arena, header, sizeof(*header));
+  arena_append(arena, data, size);
+  arena_add_pending(arena, header->fingerprint, address);
+  hunk_blocks_add(&arena->toc, header, address);
+
+  checkpoint = (arena->sync_bytes && arena->unsynced_bytes >= arena->sync_bytes)
+               || (arena->sync_ms && ms_since(&arena->first_unsynced) >= arena->sync_ms);
+  if (checkpoint || arena->num_pending == ARENA_MAX_PENDING_BLOCKS) {
+    if (arena_sync(arena) != DUST_OK) {
+      fprintf(stderr, "Terminating.\n");
+      exit(1);
+    }
+  }
+  /* Only when asked to sync, as writing the index back can be much more
+   * work than syncing the arena. */
+  if (checkpoint && checkpoint_index(arena->pending_index) != DUST_OK) {
+    fprintf(stderr, "Terminating.\n");
+    exit(1);
+  }
+}
+
+static void fast_sanity_check_arena(int fd)
+{
+  struct arena_window window;
+  unsigned char *scratch = NULL;
+  uint64_t offset = 0;
+  struct stat sb;
+
+  assert(0 == fstat(fd, &sb));
+  if (sb.st_size % ARENA_HUNK_SIZE == 0) {
+    return;
+  }
+  arena_window_init(&window, fd);
+  scratch = dmalloc(DUST_DATA_BLOCK_SIZE);
+
+  /* Starting from the beginning of our current arena hunk,
+   * read each data block in turn, confirm it's the right size,
+   * and confirm its fingerprint matches its contents.
+   * This gives us a limited form of self-synchronization -- we
+   * don't need to re-parse the entire arena in order to confirm
+   * the most recent write wasn't cut off somehow. */
+  offset = sb.st_size - sb.st_size % ARENA_HUNK_SIZE;
+  while (offset < (uint64_t)sb.st_size) {
+    const struct arena_block_header *header = NULL;
+    const unsigned char *data = NULL;
+    unsigned char calculated_hash[SHA256_DIGEST_LENGTH];
+    uint32_t stored_size = 0;
+
+    header = (const void *)arena_window_view(&window, offset, sizeof(*header));
+    assert(header);
+    stored_size = arena_block_stored_size(header);
+    assert(uint32be_to_host(header->size) <= DUST_DATA_BLOCK_SIZE);
+    assert(stored_size <= DUST_DATA_BLOCK_SIZE);
+
+    header = (const void *)arena_window_view(&window, offset, sizeof(*header) + stored_size);
+    assert(header);
+    data = arena_block_data_view(header, (const unsigned char *)(header + 1), scratch);
+    assert(data);
+
+    assert(SHA256_DIGEST_LENGTH == DUST_FINGERPRINT_SIZE);
+    SHA256(data, uint32be_to_host(header->size), calculated_hash);
+    assert(0 == memcmp(header->fingerprint, calculated_hash, DUST_FINGERPRINT_SIZE));
+
+    offset += sizeof(*header) + stored_size;
+  }
+
+  free(scratch);
+  arena_window_free(&window);
+}
+
+dust_arena *dust_open_arena(const char *arena_path, int permissions, int flags)
+{
+  dust_arena *arena = NULL;
+  int open_flags = 0;
+  char *fopen_flags = NULL;
+  FILE *stream = NULL;
+  int fd = -1;
+
+  assert(arena_path);
+  assert(*arena_path);
+
+  if (permissions == DUST_PERM_READ) {
+    open_flags = O_RDONLY;
+    fopen_flags = "r";
+  } else if (permissions == DUST_PERM_RW) {
+    open_flags = O_RDWR | O_APPEND;
+    fopen_flags = "a+";
+  } else {
+    /* Invalid permissions. */
+    goto fail;
+  }
+
+  if (flags & DUST_ARENA_FLAG_CREATE) {
+    open_flags = open_flags | O_CREAT;
+
+    /* CREATE requires us to have the write permission set. Failing to
+     * do so is a programming error. */
+    if (permissions != DUST_PERM_RW) {
+      goto fail;
+    }
+  }
+
+  fd = open(arena_path, open_flags, 0755);
+  if (fd == -1) {
+    goto fail;
+  }
+
+  stream = fdopen(fd, fopen_flags);
+  if (!stream) {
+    goto fail;
+  }
+
+  fast_sanity_check_arena(fd);
+
+  arena = malloc(sizeof *arena);
+  if (!arena) {
+    goto fail;
+  }
+
+  arena->stream = stream;
+  arena->fd = fd;
+  arena->opened_size = 0;
+  arena->tail = 0;
+  arena->preallocated = 0;
+  arena->buffer = NULL;
+  arena->buffered = 0;
+  arena->pending_index = NULL;
+  arena->pending = NULL;
+  arena->num_pending = 0;
+  arena->pending_table = NULL;
+  arena->codec = DUST_CODEC_NONE;
+  arena->compressed = NULL;
+  arena->sync_bytes = 0;
+  arena->sync_ms = 0;
+  arena->unsynced_bytes = 0;
+  arena->hunk_cache = NULL;
+  arena->hunk_clock = 0;
+  arena->toc.entries = NULL;
+  arena->toc.num_entries = 0;
+  arena->toc.capacity = 0;
+  arena->toc_fits = 1;
+
+  if (permissions == DUST_PERM_RW) {
+    struct stat sb;
+    if (fstat(fd, &sb) != 0) {
+      goto fail;
+    }
+    arena->tail = sb.st_size;
+    arena->opened_size = sb.st_size;
+  }
+
+  return arena;
+
+fail:
+  if (stream) {
+    fclose(stream);
+  } else if (fd != -1) {
+    close(fd);
+  }
+  if (arena) {
+    free(arena);
+  }
+  return NULL;
+}
+
+static void write_whole_index(FILE *stream, void *data)
+{
+  struct dust_index *index = data;
+
+  dfwrite(index->header, sizeof *index->header, 1, stream);
+  dfwrite(index->buckets,
+          sizeof *index->buckets,
+          uint64be_to_host(index->header->num_buckets),
+          stream);
+}
+
+/* Replaces the version 0 index at index_path, whose header and buckets are
+ * given, with one holding the same entries in the current format. Its
+ * buckets are laid out quite differently, so every entry is put into a new
+ * index, which is written beside the old one and renamed over it; a crash
+ * part-way through leaves the old one as it was.
+ * Returns DUST_OK on success, and some other value on failure. */
+static int convert_version_0_index(const char *index_path,
+                                   const struct index_header *header,
+                                   const void *buckets)
+{
+  const struct version_0_index_bucket *old_buckets = buckets;
+  uint64_t old_num_buckets = uint64be_to_host(header->num_buckets);
+  struct dust_index index;
+  int rv = DUST_OK;
+
+  memset(&index, 0, sizeof index);
+  index.kick_state = 0x9e3779b97f4a7c15ULL;
+  index.writable = 1;
+  init_new_index(&index, DUST_DEFAULT_NUM_BUCKETS);
+
+  for (uint64_t i = 0; i < old_num_buckets && rv == DUST_OK; i++) {
+    const struct version_0_index_bucket *b = &old_buckets[i];
+    uint32_t num_entries = uint32be_to_host(b->num_entries);
+
+    if (num_entries > MAX_ENTRIES_PER_VERSION_0_INDEX_BUCKET) {
+      fprintf(stderr, "Bucket %" PRIu64 " of index at '%s' claims %" PRIu32 " entries.\n",
+              i, index_path, num_entries);
+      rv = !DUST_OK;
+      break;
+    }
+    for (uint32_t j = 0; j < num_entries && rv == DUST_OK; j++) {
+      rv = add_fingerprint_to_index(&index,
+                                    (unsigned char *)b->entries[j].fingerprint,
+                                    uint64be_to_host(b->entries[j].address));
+    }
+  }
+
+  if (rv == DUST_OK && replace_file(index_path, write_whole_index, &index) != 0) {
+    fprintf(stderr, "Failed to write converted index to '%s'.\n", index_path);
+    rv = !DUST_OK;
+  }
+
+  free(index.header);
+  free(index.buckets);
+  free(index.dirty_buckets);
+  return rv;
+}
+
+dust_index *dust_open_index(const char *index_path, int permissions, int flags, ...)
+{
+  dust_index *index = NULL;
+  int open_flags = 0, mmap_prot = PROT_NONE;
+  FILE *stream = NULL;
+  int fd = -1, fstat_rv = -1;
+  struct stat sb;
+  va_list ap;
+  uint64_t num_buckets = DUST_DEFAULT_NUM_BUCKETS;
+
+  assert(index_path);
+  assert(*index_path);
+
+  va_start(ap, flags);
+  if (flags & DUST_INDEX_FLAG_CREATE) {
+    num_buckets = va_arg(ap, uint64_t);
+  }
+  va_end(ap);
+
+  if (permissions == DUST_PERM_READ) {
+    open_flags = O_RDONLY;
+    mmap_prot = PROT_READ;
+  } else if (permissions == DUST_PERM_RW) {
+    open_flags = O_RDWR;
+    mmap_prot = PROT_READ | PROT_WRITE;
+  } else {
+    /* Invalid permissions. */
+    goto fail;
+  }
+
+  if (flags & DUST_INDEX_FLAG_CREATE) {
+    open_flags = open_flags | O_CREAT;
+
+    /* CREATE requires us to have the write permission set. Failing to
+     * do so is a programming error. */
+    if (permissions != DUST_PERM_RW) {
+      goto fail;
+    }
+  }
+  if ((flags & DUST_INDEX_FLAG_SAMPLED) && permissions != DUST_PERM_RW) {
+    /* Likewise, as the manifests are written to. */
+    goto fail;
+  }
+
   fd = open(index_path, open_flags, 0755);
   if (fd == -1) {
     goto fail;
@@ -542,6 +2251,10 @@ dust_index *dust_open_index(const char *index_path, int permissions, int flags,
     goto fail;
   }
   index->writable = (permissions == DUST_PERM_RW);
+  index->kick_state = 0x9e3779b97f4a7c15ULL;
+  index->bloom = NULL;
+  index->bloom_path = NULL;
+  index->manifests = NULL;
 
   if (!(flags & DUST_INDEX_FLAG_MMAP)) {
     index->file_data.stdio_pathname = strdup(index_path);
@@ -590,10 +2303,45 @@ dust_index *dust_open_index(const char *index_path, int permissions, int flags,
     }
   }
 
-  if (uint64be_to_host(index->header->version) > DEFAULT_INDEX_VERSION) {
+  if (uint64be_to_host(index->header->version) == 0) {
+    int rv = !DUST_OK;
+
+    if (!index->writable) {
+      fprintf(stderr,
+              "Index at '%s' is in an old format (version 0); it's converted to "
+              "the current one, once, the next time dust-archive opens it.\n",
+              index_path);
+    } else {
+      fprintf(stderr, "Converting index at '%s' to the current format.\n", index_path);
+      rv = convert_version_0_index(index_path, index->header, index->buckets);
+    }
+    dust_close_index(&index);
+    if (rv != DUST_OK) {
+      return NULL;
+    }
+    return dust_open_index(index_path, permissions, flags & ~DUST_INDEX_FLAG_CREATE);
+  }
+  if (uint64be_to_host(index->header->version) != DEFAULT_INDEX_VERSION) {
+    fprintf(stderr,
+            "Index at '%s' is in an unsupported format (version %" PRIu64 "); "
+            "dust-rebuild-index can build a new one.\n",
+            index_path,
+            uint64be_to_host(index->header->version));
     goto fail;
   }
 
+  if (index->writable) {
+    open_index_bloom(index, index_path);
+  }
+  if (flags & DUST_INDEX_FLAG_SAMPLED) {
+    index->manifests = dust_manifests_open(index_path);
+    if (!index->manifests) {
+      fprintf(stderr, "Failed to open manifests beside '%s'.\n", index_path);
+      dust_close_index(&index);
+      return NULL;
+    }
+  }
+
   return index;
 
 fail:
@@ -608,119 +2356,247 @@ fail:
   return NULL;
 }
 
-static void fwrite_index(FILE *stream, struct dust_index *index)
+void dust_arena_set_codec(dust_arena *arena, int codec)
 {
-  uint64_t num_buckets = 0;
+  assert(arena);
+  assert(codec == DUST_CODEC_NONE || codec == DUST_CODEC_ZLIB);
 
-  assert(index);
-  assert(index->header);
-  assert(index->buckets);
-  assert(stream);
+  arena->codec = codec;
+  if (codec != DUST_CODEC_NONE && !arena->compressed) {
+    arena->compressed = dmalloc(DUST_DATA_BLOCK_SIZE);
+  }
+}
 
-  num_buckets = uint64be_to_host(index->header->num_buckets);
-  dfwrite(index->header, sizeof(struct index_header), 1, stream);
-  dfwrite(index->buckets, sizeof(struct index_bucket), num_buckets, stream);
+void dust_arena_set_sync_policy(dust_arena *arena, uint64_t sync_bytes, uint64_t sync_ms)
+{
+  assert(arena);
+  arena->sync_bytes = sync_bytes;
+  arena->sync_ms = sync_ms;
 }
 
 int dust_close_arena(dust_arena **arena)
 {
+  int rv = DUST_OK;
+
   assert(arena && *arena);
   assert((*arena)->stream);
 
+  if (arena_sync(*arena) != DUST_OK) {
+    rv = !DUST_OK;
+  }
   if (fclose((*arena)->stream) != 0) {
-    goto fail;
+    rv = !DUST_OK;
   }
   (*arena)->stream = NULL;
+  free((*arena)->buffer);
+  free((*arena)->pending);
+  free((*arena)->pending_table);
+  free((*arena)->compressed);
+  free((*arena)->toc.entries);
+  if ((*arena)->hunk_cache) {
+    for (int i = 0; i < ARENA_HUNK_CACHE_SIZE; i++) {
+      free((*arena)->hunk_cache[i].fingerprints);
+    }
+    free((*arena)->hunk_cache);
+  }
   free(*arena);
   *arena = NULL;
 
-  return DUST_OK;
-
-fail:
-  return !DUST_OK;
+  return rv;
 }
 
 int dust_close_index(dust_index **index)
 {
+  int write_back = 0, rv = DUST_OK;
+
   assert(index && *index);
-  if ((*index)->writable) {
-    if ((*index)->dirtied) {
-      if ((*index)->mmapped) {
-        uint64_t num_buckets = uint64be_to_host((*index)->header->num_buckets);
-        assert(msync((*index)->header,
-                     sizeof *(*index)->header,
-                     MS_SYNC) == 0);
-        assert(msync((*index)->buckets,
-                     num_buckets * sizeof(*(*index)->buckets),
-                     MS_SYNC) == 0);
-        assert(munmap((*index)->header,
-                      sizeof *(*index)->header) == 0);
-        assert(munmap((*index)->buckets,
-                      num_buckets * sizeof(*(*index)->buckets)) == 0);
-        assert(close((*index)->file_data.mmapped_fd) == 0);
-      } else {
-        FILE *index_file = fopen((*index)->file_data.stdio_pathname, "w");
-        assert(index_file);
-        fwrite_index(index_file, *index);
-        assert(fclose(index_file) == 0);
-
-        free((*index)->header);
-        free((*index)->buckets);
-        memset((*index), 0, sizeof **index); /* make programming errors more likely to crash */
+  write_back = (*index)->writable && (*index)->dirtied;
+
+  if ((*index)->mmapped) {
+    uint64_t num_buckets = uint64be_to_host((*index)->header->num_buckets);
+
+    if (write_back) {
+      assert(msync((*index)->header,
+                   sizeof *(*index)->header,
+                   MS_SYNC) == 0);
+      assert(msync((*index)->buckets,
+                   num_buckets * sizeof(*(*index)->buckets),
+                   MS_SYNC) == 0);
+    }
+    assert(munmap((*index)->header,
+                  sizeof *(*index)->header) == 0);
+    assert(munmap((*index)->buckets,
+                  (*index)->bucket_capacity * sizeof(*(*index)->buckets)) == 0);
+    if (write_back && (*index)->bucket_capacity != num_buckets) {
+      /* Give back the room reserved for growing into. */
+      assert(ftruncate((*index)->file_data.mmapped_fd,
+                       sizeof *(*index)->header
+                       + num_buckets * sizeof(*(*index)->buckets)) == 0);
+    }
+    assert(close((*index)->file_data.mmapped_fd) == 0);
+  } else {
+    if (write_back) {
+      int fd = open((*index)->file_data.stdio_pathname, O_WRONLY);
+      assert(fd != -1);
+      if (write_back_index(fd, *index) != DUST_OK) {
+        write_back = 0; /* leave the filter to be rebuilt */
+        rv = !DUST_OK;
       }
+      assert(close(fd) == 0);
+    }
+
+    free((*index)->header);
+    free((*index)->buckets);
+    free((*index)->dirty_buckets);
+    free((*index)->file_data.stdio_pathname);
+  }
+
+  if ((*index)->bloom) {
+    /* Saved after the index, so that if that fails, the filter won't
+     * match it, and will be replaced next time. */
+    if (write_back && dust_bloom_save((*index)->bloom, (*index)->bloom_path) != DUST_OK) {
+      fprintf(stderr,
+              "Failed to save index filter to '%s'; it'll be rebuilt next time.\n",
+              (*index)->bloom_path);
     }
+    dust_bloom_free(&(*index)->bloom);
   }
+  free((*index)->bloom_path);
 
+  /* Written after the index, which must have every block they name. */
+  if ((*index)->manifests && dust_manifests_close(&(*index)->manifests) != DUST_OK) {
+    rv = !DUST_OK;
+  }
+
+  memset((*index), 0, sizeof **index); /* make programming errors more likely to crash */
   free(*index);
   *index = NULL;
-  return DUST_OK;
+  return rv;
+}
+
+/* Reads the padding at the end of an arena hunk, from arena_offset to
+ * padding_end, through window, and confirms that it's all zeroes.
+ * Returns DUST_OK if it is, and some other value if it isn't. */
+static int check_hunk_padding(struct arena_window *window, uint64_t arena_offset, uint64_t padding_end)
+{
+  static const unsigned char zeroes[1024 * 64];
+  int rv = DUST_OK;
+
+  while (arena_offset < padding_end) {
+    const unsigned char *padding = NULL;
+    size_t n = padding_end - arena_offset;
+    if (n > sizeof(zeroes)) {
+      n = sizeof(zeroes);
+    }
+    padding = arena_window_view(window, arena_offset, n);
+    if (!padding) {
+      fprintf(stderr, "Arena ends part-way through the padding at offset %" PRIu64 "\n",
+              arena_offset);
+      return !DUST_OK;
+    }
+    if (memcmp(padding, zeroes, n) != 0) {
+      for (size_t i = 0; i < n; i++) {
+        if (padding[i] != 0) {
+          fprintf(stderr,
+                  "Arena hunk trailer byte at location %" PRIu64 " == %d; expected 0.\n",
+                  arena_offset + i,
+                  padding[i]);
+        }
+      }
+      rv = !DUST_OK;
+    }
+    arena_offset += n;
+  }
+
+  return rv;
 }
 
-/* Returns DUST_OK if iteration was completed successfully.
+/* Calls callback with each block in the arena read through fd, in order.
+ * Returns DUST_OK if iteration was completed successfully.
  * Callback must return DUST_OK if it successfully processed its block,
  * and !DUST_OK if it failed for some reason.
- * "offset" is the byte position of the block in the arena.
+ * The arena is read a large piece at a time, and blocks are handed to
+ * callback where they lie in it: "header" points into it, as does "data"
+ * unless the block was compressed, in which case it points to the block
+ * decompressed. Neither is good once callback returns.
+ * "address" is the byte position of the block in the arena.
+ * The padding at the end of each hunk is read and confirmed to be all
+ * zeroes, and the hunk's table of contents, if it has one, is confirmed
+ * to match its blocks.
  */
-static int for_block_in_arena(FILE *arena,
-                              int callback(struct arena_block block, off_t offset, void *data),
-                              void *data)
+static int for_block_in_arena(int fd,
+                              int callback(const struct arena_block_header *header,
+                                           const unsigned char *data,
+                                           uint64_t address,
+                                           void *arg),
+                              void *arg)
 {
   struct arena_block_header zero_header;
-  uint64_t arena_offset = 0;
+  struct arena_window window;
+  struct hunk_blocks toc = { NULL, 0, 0 };
+  unsigned char *scratch = NULL;
+  int has_toc = 0;
+  uint32_t block_in_hunk = 0;
+  uint64_t padding_end = 0; /* 0 if the padding can't be told from the table */
+  uint64_t arena_offset = 0, arena_size = 0;
   int rv = DUST_OK;
+  struct stat sb;
 
-  assert(arena);
-  assert(0 == fseeko(arena, 0, SEEK_SET));
+  assert(0 == fstat(fd, &sb));
+  arena_size = sb.st_size;
   memset(&zero_header, 0, sizeof(zero_header));
+  arena_window_init(&window, fd);
+  scratch = dmalloc(DUST_DATA_BLOCK_SIZE);
 
-  while (1) {
-    struct arena_block block;
+  while (arena_offset < arena_size) {
+    const struct arena_block_header *header = NULL;
+    const unsigned char *data = NULL;
+    uint64_t offset_in_hunk = arena_offset % ARENA_HUNK_SIZE;
     uint32_t block_size = 0;
     int end_of_hunk = 0;
-    int ch;
 
-    ch = getc(arena);
-    if (ch == EOF) {
-      return rv;
-    } else {
-      assert(ch == ungetc(ch, arena));
+    if (offset_in_hunk == 0) {
+      uint64_t hunk = arena_offset / ARENA_HUNK_SIZE;
+      int damaged = 0;
+
+      has_toc = (read_hunk_toc(fd, arena_size, hunk, &toc, &damaged) == DUST_OK);
+      padding_end = arena_offset + ARENA_HUNK_SIZE;
+      if (has_toc) {
+        padding_end -= HUNK_TOC_ROOM(toc.num_entries) - sizeof(struct arena_block_header);
+      } else if (damaged) {
+        fprintf(stderr,
+                "Arena hunk at offset %" PRIu64 " has a damaged table of contents\n",
+                arena_offset);
+        rv = !DUST_OK;
+        padding_end = 0;
+      }
+      block_in_hunk = 0;
     }
 
-    if ((arena_offset % ARENA_HUNK_SIZE) + sizeof(block.header) > ARENA_HUNK_SIZE) {
+    if (offset_in_hunk + sizeof(*header) > ARENA_HUNK_SIZE) {
       end_of_hunk = 1;
-    }
-
-    if (!end_of_hunk) {
-      dfread(&block.header, sizeof(block.header), 1, arena);
+    } else {
+      header = (const void *)arena_window_view(&window, arena_offset, sizeof(*header));
+      if (!header) {
+        fprintf(stderr, "Arena ends part-way through the block at offset %" PRIu64 "\n",
+                arena_offset);
+        rv = !DUST_OK;
+        break;
+      }
 
       /* if it looks like the next header is all zeroes, we're at the
        * end of the current arena hunk; do a sanity check to make sure
-       * this looks right, then confirm all remaining bytes in the hunk
-       * are zero, and finally move on to processing the next hunk */
-      if (memcmp(&block.header, &zero_header, sizeof(block.header)) == 0) {
-        uint32_t offset_in_hunk = arena_offset % ARENA_HUNK_SIZE;
-
-        if (offset_in_hunk + sizeof(struct arena_block) < ARENA_HUNK_SIZE) {
+       * this looks right, then skip (or check) the remaining bytes in
+       * the hunk, and finally move on to processing the next hunk */
+      if (memcmp(header, &zero_header, sizeof(*header)) == 0) {
+        uint64_t room_needed = offset_in_hunk + sizeof(struct arena_block);
+
+        /* Hunks with a table of contents were ended once the next block
+         * wouldn't fit along with it. */
+        if (has_toc) {
+          room_needed += HUNK_TOC_ROOM(toc.num_entries + 1);
+        }
+        if (room_needed < ARENA_HUNK_SIZE) {
           fprintf(stderr,
                   "Arena hunk end encountered too soon: offset %" PRIu64 "\n",
                   arena_offset);
@@ -728,52 +2604,90 @@ static int for_block_in_arena(FILE *arena,
         }
         end_of_hunk = 1;
       }
-      arena_offset += sizeof(block.header);
     }
 
     if (end_of_hunk) {
-      for ((void)arena_offset; (arena_offset % ARENA_HUNK_SIZE) != 0; arena_offset++) {
-        int byte = getc(arena);
-        if (byte != 0) {
-          fprintf(stderr,
-                  "Arena hunk trailer byte at location %" PRIu64 " == %d; expected 0.\n",
-                  arena_offset,
-                  byte);
-          rv = !DUST_OK;
-        }
+      uint64_t next_hunk = arena_offset - offset_in_hunk + ARENA_HUNK_SIZE;
+
+      if (has_toc && block_in_hunk != toc.num_entries) {
+        fprintf(stderr,
+                "Arena hunk's table of contents lists %" PRIu32 " blocks, but it holds %" PRIu32 "\n",
+                toc.num_entries,
+                block_in_hunk);
+        rv = !DUST_OK;
+      }
+      if (check_hunk_padding(&window, arena_offset, padding_end) != DUST_OK) {
+        rv = !DUST_OK;
       }
+      arena_offset = next_hunk;
 
       /* We've hit the end of the current arena hunk; move onto processing the next
        * data block. */
       continue;
     }
 
-    block_size = uint32be_to_host(block.header.size);
-    dfread(block.data, 1, block_size, arena);
-    arena_offset += block_size;
+    block_size = arena_block_stored_size(header);
+    if (uint32be_to_host(header->size) > DUST_DATA_BLOCK_SIZE || block_size > DUST_DATA_BLOCK_SIZE) {
+      fprintf(stderr, "Arena block at offset %" PRIu64 " is too large: %" PRIu32 " bytes\n",
+              arena_offset, uint32be_to_host(header->size));
+      rv = !DUST_OK;
+      break;
+    }
+
+    if (has_toc) {
+      if (block_in_hunk >= toc.num_entries
+          || uint64be_to_host(toc.entries[block_in_hunk].address) != arena_offset
+          || memcmp(&toc.entries[block_in_hunk].header, header, sizeof(*header)) != 0) {
+        fprintf(stderr,
+                "Arena hunk's table of contents doesn't match the block at offset %" PRIu64 "\n",
+                arena_offset);
+        rv = !DUST_OK;
+      }
+      block_in_hunk++;
+    }
 
-    off_t block_start_offset = arena_offset - block_size - sizeof(block.header);
-    rv = (callback(block, block_start_offset, data) == DUST_OK ? rv : !DUST_OK);
+    /* The whole block, this time, which may move the window on. */
+    header = (const void *)arena_window_view(&window, arena_offset, sizeof(*header) + block_size);
+    if (!header) {
+      fprintf(stderr, "Arena ends part-way through the block at offset %" PRIu64 "\n",
+              arena_offset);
+      rv = !DUST_OK;
+      break;
+    }
+    data = arena_block_data_view(header, (const unsigned char *)(header + 1), scratch);
+    if (!data) {
+      fprintf(stderr, "Couldn't read arena block at offset %" PRIu64 "\n", arena_offset);
+      rv = !DUST_OK;
+    } else if (callback(header, data, arena_offset, arg) != DUST_OK) {
+      rv = !DUST_OK;
+    }
+    arena_offset += sizeof(*header) + block_size;
   }
 
+  free(scratch);
+  free(toc.entries);
+  arena_window_free(&window);
   return rv;
 }
 
-static int arena_block_fingerprint_matches_contents(struct arena_block block, off_t offset, void *data)
+static int arena_block_fingerprint_matches_contents(const struct arena_block_header *header,
+                                                    const unsigned char *data,
+                                                    uint64_t address,
+                                                    void *arg)
 {
   unsigned char calculated_hash[SHA256_DIGEST_LENGTH];
   uint32_t size = 0;
 
-  (void)offset;
-  (void)data;
+  (void)address;
+  (void)arg;
 
   assert(SHA256_DIGEST_LENGTH == DUST_FINGERPRINT_SIZE);
-  size = uint32be_to_host(block.header.size);
-  SHA256(block.data, size, calculated_hash);
+  size = uint32be_to_host(header->size);
+  SHA256(data, size, calculated_hash);
 
-  if (memcmp(block.header.fingerprint, calculated_hash, DUST_FINGERPRINT_SIZE) != 0) {
+  if (memcmp(header->fingerprint, calculated_hash, DUST_FINGERPRINT_SIZE) != 0) {
     fprintf(stderr, "%s:%d: Block fingerprint is ", __FILE__, __LINE__);
-    fprint_fingerprint(stderr, block.header.fingerprint);
+    fprint_fingerprint(stderr, header->fingerprint);
     fprintf(stderr, " but contents hash to ");
     fprint_fingerprint(stderr, calculated_hash);
     fprintf(stderr, "\n");
@@ -783,23 +2697,176 @@ static int arena_block_fingerprint_matches_contents(struct arena_block block, of
   return DUST_OK;
 }
 
-static int add_block_fingerprint_to_index(struct arena_block block, off_t offset, void *data)
+/* Blocks found while filling an index, collected so they can be added in
+ * batches, as arena_sync() does. */
+struct index_filler {
+  struct dust_index *index;
+  struct pending_block *blocks;
+  uint32_t num_blocks;
+};
+
+static int flush_index_filler(struct index_filler *filler)
 {
-  struct dust_index *index = data;
+  /* The arena may have been appended to with a sampled index. */
+  int rv = add_blocks_to_index(filler->index, filler->blocks, filler->num_blocks, 1);
 
-  /* add_fingerprint_to_index asserts on failure */
-  add_fingerprint_to_index(index, block.header.fingerprint, offset);
+  filler->num_blocks = 0;
+  if (rv != DUST_OK) {
+    fprintf(stderr, "%s:%d: index is full, and could not be grown\n", __FILE__, __LINE__);
+  }
+  return rv;
+}
+
+static int index_filler_add(struct index_filler *filler, const unsigned char *fingerprint, uint64_t address)
+{
+  struct pending_block *p = &filler->blocks[filler->num_blocks++];
+
+  memcpy(p->fingerprint, fingerprint, DUST_FINGERPRINT_SIZE);
+  p->address = address;
+  if (filler->num_blocks == ARENA_MAX_PENDING_BLOCKS) {
+    return flush_index_filler(filler);
+  }
   return DUST_OK;
 }
 
-int dust_fill_index_from_arena(dust_index *index, dust_arena *arena)
+/* The blocks found in one hunk of an arena being scanned. */
+struct scanned_hunk {
+  struct hunk_blocks blocks;
+  int done;
+  int rv;
+};
+
+/* Hunks are claimed by the threads reading them in order, and handed back
+ * in order, through a ring of slots; hunk n goes in slot n % num_slots. */
+struct arena_scan {
+  int fd;
+  uint64_t size; /* of the arena */
+  uint64_t num_hunks;
+
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  uint64_t next_claimed;
+  uint64_t next_consumed;
+  struct scanned_hunk *slots;
+  uint64_t num_slots;
+};
+
+static void *arena_scan_main(void *data)
+{
+  struct arena_scan *scan = data;
+  struct arena_window window;
+
+  arena_window_init(&window, scan->fd);
+  while (1) {
+    uint64_t hunk = 0;
+    struct scanned_hunk *slot = NULL;
+
+    assert(0 == pthread_mutex_lock(&scan->lock));
+    while (scan->next_claimed < scan->num_hunks
+           && scan->next_claimed >= scan->next_consumed + scan->num_slots) {
+      assert(0 == pthread_cond_wait(&scan->changed, &scan->lock));
+    }
+    if (scan->next_claimed == scan->num_hunks) {
+      assert(0 == pthread_mutex_unlock(&scan->lock));
+      break;
+    }
+    hunk = scan->next_claimed++;
+    assert(0 == pthread_mutex_unlock(&scan->lock));
+
+    slot = &scan->slots[hunk % scan->num_slots];
+    slot->rv = list_hunk_blocks(&window, hunk, scan->size, &slot->blocks);
+
+    assert(0 == pthread_mutex_lock(&scan->lock));
+    slot->done = 1;
+    assert(0 == pthread_cond_broadcast(&scan->changed));
+    assert(0 == pthread_mutex_unlock(&scan->lock));
+  }
+
+  arena_window_free(&window);
+  return NULL;
+}
+
+int dust_fill_index_from_arena(dust_index *index, dust_arena *arena, int threads)
 {
+  struct index_filler filler;
+  struct arena_scan scan;
+  pthread_t *scanners = NULL;
+  struct stat sb;
+  int rv = DUST_OK;
+
   assert(index);
   assert(arena);
-  if (for_block_in_arena(arena->stream, add_block_fingerprint_to_index, index) != DUST_OK) {
-    return !DUST_OK;
+  assert(threads >= 1);
+
+  assert(0 == fstat(arena->fd, &sb));
+  scan.fd = arena->fd;
+  scan.size = sb.st_size;
+  scan.num_hunks = (scan.size + ARENA_HUNK_SIZE - 1) / ARENA_HUNK_SIZE;
+  assert(0 == pthread_mutex_init(&scan.lock, NULL));
+  assert(0 == pthread_cond_init(&scan.changed, NULL));
+  scan.next_claimed = 0;
+  scan.next_consumed = 0;
+  scan.num_slots = (uint64_t)threads * ARENA_SCAN_HUNKS_AHEAD;
+  scan.slots = calloc(scan.num_slots, sizeof *scan.slots);
+  assert(scan.slots);
+
+  scanners = dmalloc(threads * sizeof *scanners);
+  for (int i = 0; i < threads; i++) {
+    assert(0 == pthread_create(&scanners[i], NULL, arena_scan_main, &scan));
   }
-  return DUST_OK;
+
+  filler.index = index;
+  filler.blocks = dmalloc(ARENA_MAX_PENDING_BLOCKS * sizeof *filler.blocks);
+  filler.num_blocks = 0;
+
+  /* The hunks are read in parallel, but their blocks are added in the
+   * order they're in the arena, just as puts added them, so the index
+   * comes out the same however many threads there are. */
+  for (uint64_t hunk = 0; hunk < scan.num_hunks; hunk++) {
+    struct scanned_hunk *slot = &scan.slots[hunk % scan.num_slots];
+
+    assert(0 == pthread_mutex_lock(&scan.lock));
+    while (!slot->done) {
+      assert(0 == pthread_cond_wait(&scan.changed, &scan.lock));
+    }
+    assert(0 == pthread_mutex_unlock(&scan.lock));
+
+    if (slot->rv != DUST_OK) {
+      rv = !DUST_OK;
+    }
+    for (uint32_t i = 0; i < slot->blocks.num_entries && rv == DUST_OK; i++) {
+      const struct hunk_toc_entry *e = &slot->blocks.entries[i];
+      rv = index_filler_add(&filler, e->header.fingerprint, uint64be_to_host(e->address));
+    }
+
+    assert(0 == pthread_mutex_lock(&scan.lock));
+    slot->done = 0;
+    scan.next_consumed++;
+    assert(0 == pthread_cond_broadcast(&scan.changed));
+    assert(0 == pthread_mutex_unlock(&scan.lock));
+  }
+
+  for (int i = 0; i < threads; i++) {
+    assert(0 == pthread_join(scanners[i], NULL));
+  }
+
+  if (rv == DUST_OK && flush_index_filler(&filler) != DUST_OK) {
+    rv = !DUST_OK;
+  }
+  if (rv == DUST_OK) {
+    index->header->arena_indexed = uint64host_to_be(scan.size);
+    index->dirtied = 1;
+  }
+
+  for (uint64_t i = 0; i < scan.num_slots; i++) {
+    free(scan.slots[i].blocks.entries);
+  }
+  free(scan.slots);
+  free(scanners);
+  free(filler.blocks);
+  assert(0 == pthread_mutex_destroy(&scan.lock));
+  assert(0 == pthread_cond_destroy(&scan.changed));
+  return rv;
 }
 
 int dust_check(dust_index *index, dust_arena *arena)
@@ -809,7 +2876,7 @@ int dust_check(dust_index *index, dust_arena *arena)
   assert(index);
   assert(arena);
 
-  rv = for_block_in_arena(arena->stream, arena_block_fingerprint_matches_contents, NULL);
+  rv = for_block_in_arena(arena->fd, arena_block_fingerprint_matches_contents, NULL);
 
   if (rv != DUST_OK) {
     fprintf(stderr, "Errors encountered during check.\n");
@@ -819,14 +2886,112 @@ int dust_check(dust_index *index, dust_arena *arena)
   return DUST_OK;
 }
 
-struct dust_fingerprint dust_put(dust_index *index, dust_arena *arena, unsigned char *data, uint32_t size, uint32_t type)
+/* Returns 0 for false, anything else for true. */
+static int is_all_zeroes(const unsigned char *data, uint32_t size)
+{
+  /* If the first byte is zero, and every byte equals the one before it,
+   * they're all zero. */
+  return size > 0 && data[0] == 0 && memcmp(data, data + 1, size - 1) == 0;
+}
+
+struct dust_fingerprint dust_zero_fingerprint(uint32_t size)
+{
+  struct dust_fingerprint result;
+  uint32_t_be size_be = uint32host_to_be(size);
+
+  assert(size > 0 && size <= DUST_DATA_BLOCK_SIZE);
+  memset(result.bytes, 0, DUST_FINGERPRINT_SIZE);
+  memcpy(result.bytes + DUST_FINGERPRINT_SIZE - sizeof(size_be), &size_be, sizeof(size_be));
+
+  return result;
+}
+
+int dust_fingerprint_is_zeroes(struct dust_fingerprint fingerprint, uint32_t *size)
+{
+  static const unsigned char zeroes[DUST_FINGERPRINT_SIZE];
+  uint32_t_be size_be;
+  uint32_t zero_size = 0;
+
+  if (memcmp(fingerprint.bytes, zeroes, DUST_FINGERPRINT_SIZE - sizeof(size_be)) != 0) {
+    return 0;
+  }
+  memcpy(&size_be, fingerprint.bytes + DUST_FINGERPRINT_SIZE - sizeof(size_be), sizeof(size_be));
+  zero_size = uint32be_to_host(size_be);
+  if (zero_size == 0 || zero_size > DUST_DATA_BLOCK_SIZE) {
+    return 0;
+  }
+
+  if (size) {
+    *size = zero_size;
+  }
+  return 1;
+}
+
+struct dust_fingerprint dust_fingerprint_data(unsigned char *data, uint32_t size)
+{
+  struct dust_fingerprint result;
+
+  assert(data);
+  if (is_all_zeroes(data, size)) {
+    return dust_zero_fingerprint(size);
+  }
+
+  assert(SHA256_DIGEST_LENGTH == DUST_FINGERPRINT_SIZE);
+  SHA256(data, size, result.bytes);
+
+  return result;
+}
+
+struct dust_fingerprint dust_fingerprint_data_and_hash(unsigned char *data,
+                                                       uint32_t size,
+                                                       SHA256_CTX *file_context)
+{
+  struct dust_fingerprint result;
+  SHA256_CTX context;
+
+  assert(data);
+  if (!file_context) {
+    return dust_fingerprint_data(data, size);
+  }
+  if (is_all_zeroes(data, size)) {
+    assert(1 == SHA256_Update(file_context, data, size));
+    return dust_zero_fingerprint(size);
+  }
+
+  /* Feed both hashes a slice at a time, so each slice is only brought
+   * into cache once. */
+  assert(1 == SHA256_Init(&context));
+  for (uint32_t offset = 0; offset < size; offset += FINGERPRINT_SLICE_SIZE) {
+    uint32_t n = size - offset;
+    if (n > FINGERPRINT_SLICE_SIZE) {
+      n = FINGERPRINT_SLICE_SIZE;
+    }
+    assert(1 == SHA256_Update(&context, data + offset, n));
+    assert(1 == SHA256_Update(file_context, data + offset, n));
+  }
+  assert(1 == SHA256_Final(result.bytes, &context));
+
+  return result;
+}
+
+void dust_put_fingerprinted(dust_index *index,
+                            dust_arena *arena,
+                            unsigned char *data,
+                            uint32_t size,
+                            uint32_t type,
+                            struct dust_fingerprint fingerprint)
 {
-  struct arena_block block;
+  struct arena_block_header header;
 
   assert(index);
   assert(arena);
   assert(data);
-  assert(size <= sizeof(block.data));
+  assert(size <= DUST_DATA_BLOCK_SIZE);
+
+  /* Runs of zeroes are named entirely by their fingerprints. */
+  if (dust_fingerprint_is_zeroes(fingerprint, NULL)) {
+    return;
+  }
 
   const char *fake_curtime = getenv("DUST_FAKE_TIMESTAMP");
   time_t curtime = (time_t)-1;
@@ -838,17 +3003,22 @@ struct dust_fingerprint dust_put(dust_index *index, dust_arena *arena, unsigned
   }
   assert(curtime != (time_t)-1);
 
-  SHA256(data, size, block.header.fingerprint);
-  block.header.type = uint32host_to_be(type);
-  block.header.size = uint32host_to_be(size);
-  block.header.wtime = uint64host_to_be(curtime);
-  memset(block.data, 0, sizeof(block.data));
-  memcpy(block.data, data, size);
+  memcpy(header.fingerprint, fingerprint.bytes, DUST_FINGERPRINT_SIZE);
+  assert(type <= UINT8_MAX);
+  header.stored_size = uint16host_to_be(0);
+  header.codec = DUST_CODEC_NONE;
+  header.type = type;
+  header.size = uint32host_to_be(size);
+  header.wtime = uint64host_to_be(curtime);
 
-  struct dust_fingerprint result;
-  memcpy(result.bytes, block.header.fingerprint, DUST_FINGERPRINT_SIZE);
+  add_block_to_arena(index, arena, &header, data);
+}
+
+struct dust_fingerprint dust_put(dust_index *index, dust_arena *arena, unsigned char *data, uint32_t size, uint32_t type)
+{
+  struct dust_fingerprint result = dust_fingerprint_data(data, size);
 
-  add_block_to_arena(index, arena, &block);
+  dust_put_fingerprinted(index, arena, data, size, type, result);
 
   return result;
 }
@@ -858,6 +3028,26 @@ struct dust_block *dust_get(dust_index *index, dust_arena *arena, struct dust_fi
   assert(index);
   assert(arena);
 
+  uint32_t zero_size = 0;
+  if (dust_fingerprint_is_zeroes(fingerprint, &zero_size)) {
+    struct dust_block *zero_block = dmalloc(sizeof *zero_block);
+
+    memcpy(zero_block->ablock.header.fingerprint, fingerprint.bytes, DUST_FINGERPRINT_SIZE);
+    zero_block->ablock.header.stored_size = uint16host_to_be(0);
+    zero_block->ablock.header.codec = DUST_CODEC_NONE;
+    zero_block->ablock.header.type = 0; /* DUST_TYPE_FILEDATA */
+    zero_block->ablock.header.size = uint32host_to_be(zero_size);
+    zero_block->ablock.header.wtime = uint64host_to_be(0);
+    memset(zero_block->ablock.data, 0, zero_size);
+    return zero_block;
+  }
+
+  /* The block may not have been written out or indexed yet. */
+  if (arena->num_pending > 0 && arena_sync(arena) != DUST_OK) {
+    fprintf(stderr, "Terminating.\n");
+    exit(1);
+  }
+
   uint64_t address = get_address_of_fingerprint(index, fingerprint.bytes);
   uint32_t size = 0;
 
@@ -870,7 +3060,7 @@ struct dust_block *dust_get(dust_index *index, dust_arena *arena, struct dust_fi
   dfread(&result->ablock.header, sizeof(result->ablock.header), 1, arena->stream);
 
   size = uint32be_to_host(result->ablock.header.size);
-  dfread(result->ablock.data, 1, size, arena->stream);
+  assert(read_arena_block_data(arena->stream, &result->ablock.header, result->ablock.data) == DUST_OK);
 
   assert(0 == memcmp(fingerprint.bytes, result->ablock.header.fingerprint, DUST_FINGERPRINT_SIZE));
 
@@ -894,7 +3084,7 @@ void dust_release(struct dust_block **block)
 uint32_t dust_block_type(struct dust_block *block)
 {
   assert(block);
-  return uint32be_to_host(block->ablock.header.type);
+  return block->ablock.header.type;
 }
 
 uint32_t dust_block_size(struct dust_block *block)
@@ -65,6 +65,12 @@ int display_listing_item(dust_index *index, dust_arena *arena, struct listing_it
     printf(" %s => %s\n", item.path, item.data.symlink.targetpath);
     break;
   }
+  case DUST_LISTING_HARDLINK: {
+    printf("H ");
+    fprint_permissions(stdout, item.permissions);
+    printf(" %s == %s\n", item.path, item.data.hardlink.targetpath);
+    break;
+  }
   default: {
     /* Don't know how to process this. */
     return !DUST_OK;
@@ -108,7 +114,7 @@ int main(int argc, char **argv)
   index = dust_open_index(
     index_path,
     DUST_PERM_READ,
-    DUST_INDEX_FLAG_NONE
+    DUST_INDEX_FLAG_MMAP
   );
   if (!index) {
     fprintf(stderr, "Failed to open index file at '%s'.\n", index_path);
@@ -1,9 +1,38 @@
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "dust-internal.h"
 
+/* How many threads read the arena. */
+int g_threads = 1;
+
+int parse_options(int argc, char **argv)
+{
+  int ch;
+  struct option opts[] = {
+    { "threads", required_argument, NULL, 't' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  while ((ch = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+    switch (ch) {
+    case 't':
+      g_threads = atoi(optarg);
+      if (g_threads < 1) {
+        fprintf(stderr, "--threads must be at least 1.\n");
+        exit(2);
+      }
+      break;
+    default:
+      exit(2);
+    }
+  }
+
+  return optind;
+}
+
 int main(int argc, char **argv)
 {
   char *new_index_path = NULL;
@@ -12,12 +41,16 @@ int main(int argc, char **argv)
   dust_index *index = NULL;
   dust_arena *arena = NULL;
 
-  if (argc != 2) {
-    fprintf(stderr, "Usage: dust-rebuild-index <new-index-file>\n");
+  int offset = parse_options(argc, argv);
+  argc -= offset;
+  argv += offset;
+
+  if (argc != 1) {
+    fprintf(stderr, "Usage: dust-rebuild-index [--threads=N] <new-index-file>\n");
     exit(2);
   }
 
-  new_index_path = argv[1];
+  new_index_path = argv[0];
   if (index_path && (strcmp(index_path, new_index_path) == 0)) {
     fprintf(stderr, "Path of new index must not match that in DUST_INDEX.\n");
     goto fail;
@@ -44,7 +77,7 @@ int main(int argc, char **argv)
     goto fail;
   }
 
-  if (dust_fill_index_from_arena(index, arena) != DUST_OK) {
+  if (dust_fill_index_from_arena(index, arena, g_threads) != DUST_OK) {
     fprintf(stderr, "Errors encountered while rebuilding index.\n");
     goto fail;
   }
@@ -0,0 +1,112 @@
+#include "hardlinks.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+
+struct link {
+  dev_t dev;
+  ino_t ino;
+  char *path; /* NULL if this slot is empty */
+};
+
+/* An open-addressed hash table, kept at most half full. */
+struct dust_link_table {
+  struct link *links;
+  size_t capacity; /* always a power of two */
+  size_t count;
+};
+
+#define INITIAL_CAPACITY 1024
+
+static size_t link_slot(const struct dust_link_table *table, dev_t dev, ino_t ino)
+{
+  uint64_t h = ((uint64_t)ino * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)dev;
+  h ^= h >> 29;
+  return h & (table->capacity - 1);
+}
+
+static struct link *find_link(const struct dust_link_table *table, dev_t dev, ino_t ino)
+{
+  size_t slot = link_slot(table, dev, ino);
+
+  while (table->links[slot].path != NULL) {
+    if (table->links[slot].dev == dev && table->links[slot].ino == ino) {
+      break;
+    }
+    slot = (slot + 1) & (table->capacity - 1);
+  }
+  return &table->links[slot];
+}
+
+static void allocate_links(struct dust_link_table *table, size_t capacity)
+{
+  table->capacity = capacity;
+  table->links = dmalloc(capacity * sizeof *table->links);
+  memset(table->links, 0, capacity * sizeof *table->links);
+}
+
+static void grow_table(struct dust_link_table *table)
+{
+  struct link *old = table->links;
+  size_t old_capacity = table->capacity;
+
+  allocate_links(table, old_capacity * 2);
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].path != NULL) {
+      *find_link(table, old[i].dev, old[i].ino) = old[i];
+    }
+  }
+  free(old);
+}
+
+struct dust_link_table *dust_link_table_new(void)
+{
+  struct dust_link_table *table = dmalloc(sizeof *table);
+
+  allocate_links(table, INITIAL_CAPACITY);
+  table->count = 0;
+  return table;
+}
+
+const char *dust_link_table_find_or_add(struct dust_link_table *table,
+                                        const struct stat *sb,
+                                        const char *path)
+{
+  struct link *link = NULL;
+
+  assert(table);
+  assert(sb);
+  assert(path);
+
+  link = find_link(table, sb->st_dev, sb->st_ino);
+  if (link->path != NULL) {
+    return link->path;
+  }
+
+  if (2 * (table->count + 1) > table->capacity) {
+    grow_table(table);
+    link = find_link(table, sb->st_dev, sb->st_ino);
+  }
+  link->dev = sb->st_dev;
+  link->ino = sb->st_ino;
+  link->path = dstrdup(path);
+  table->count++;
+
+  return NULL;
+}
+
+void dust_link_table_free(struct dust_link_table **table)
+{
+  assert(table && *table);
+
+  for (size_t i = 0; i < (*table)->capacity; i++) {
+    free((*table)->links[i].path);
+  }
+  free((*table)->links);
+  free(*table);
+  *table = NULL;
+}
@@ -0,0 +1,40 @@
+#ifndef DUST_BLOOM_H
+#define DUST_BLOOM_H
+
+#include <inttypes.h>
+
+/* A Bloom filter of fingerprints, so that looking up fingerprints which
+ * were never added can mostly be answered without looking at the index.
+ * It never says that a fingerprint which was added wasn't; it says that
+ * one which wasn't might have been about 1% of the time, as long as it
+ * holds no more than it was made for.
+ * Not safe to share between threads. */
+struct dust_bloom;
+
+/* Returns an empty filter with room for at least num_entries fingerprints. */
+struct dust_bloom *dust_bloom_new(uint64_t num_entries);
+
+/* Returns how many fingerprints the filter has room for. More may be
+ * added, but it'll be wrong more often. */
+uint64_t dust_bloom_capacity(const struct dust_bloom *bloom);
+
+/* Returns how many times dust_bloom_add() has been called on the filter,
+ * including before it was saved and loaded again. */
+uint64_t dust_bloom_count(const struct dust_bloom *bloom);
+
+void dust_bloom_add(struct dust_bloom *bloom, const unsigned char *fingerprint);
+
+/* Returns 0 if fingerprint hasn't been added, and 1 if it may have been. */
+int dust_bloom_may_contain(const struct dust_bloom *bloom, const unsigned char *fingerprint);
+
+/* Returns NULL if there's no filter saved at path, or it can't be read. */
+struct dust_bloom *dust_bloom_load(const char *path);
+
+/* Saves the filter to a new file beside path, and renames that over path,
+ * so that a failure part-way through leaves any earlier one as it was.
+ * Returns DUST_OK on success, and some other value on failure. */
+int dust_bloom_save(const struct dust_bloom *bloom, const char *path);
+
+void dust_bloom_free(struct dust_bloom **bloom);
+
+#endif /* DUST_BLOOM_H */
@@ -0,0 +1,29 @@
+#ifndef DUST_CHUNKING_H
+#define DUST_CHUNKING_H
+
+#include <stddef.h>
+
+#include "dust-internal.h"
+
+#define DUST_CHUNKING_FIXED   0 /* cut every DUST_DATA_BLOCK_SIZE bytes */
+#define DUST_CHUNKING_CONTENT 1 /* cut where a rolling hash of the data says to */
+
+/* Bounds on the size of content-defined chunks. Chunks are never larger
+ * than a data block, so an arena never needs to know how its blocks were
+ * cut. */
+#define DUST_CDC_MIN_SIZE (1024 * 8)
+#define DUST_CDC_AVG_SIZE (1024 * 16)
+#define DUST_CDC_MAX_SIZE DUST_DATA_BLOCK_SIZE
+
+/* Returns the length of the chunk which begins at buf.
+ * "chunking" is one of the DUST_CHUNKING_* values.
+ * buf must hold at least DUST_DATA_BLOCK_SIZE bytes, unless "eof" is set,
+ * in which case the len bytes in buf are all that remain of the input.
+ * The result is never more than len, and is only 0 if len is 0.
+ */
+size_t dust_chunk_length(int chunking, const unsigned char *buf, size_t len, int eof);
+
+/* Returns the DUST_CHUNKING_* value named by "name", or -1 if there is none. */
+int dust_chunking_from_name(const char *name);
+
+#endif /* DUST_CHUNKING_H */
@@ -7,7 +7,10 @@
 #include <openssl/sha.h>
 
 #define DUST_MAGIC ((uint32_t)0xa7842a73ULL)
-#define DUST_VERSION 1
+/* Version 1 listings lack file stat information, listings before version 3
+ * have no hardlink records, and listings before version 4 don't say how
+ * their files were cut into blocks. */
+#define DUST_VERSION 4
 
 #define DUST_OK 0
 
@@ -17,6 +20,7 @@
 #define DUST_LISTING_FILE      0
 #define DUST_LISTING_DIRECTORY 1
 #define DUST_LISTING_SYMLINK   2
+#define DUST_LISTING_HARDLINK  3 /* another name for an earlier file */
 
 struct listing_item {
   uint32_t recordtype; /* DUST_LISTING_... */
@@ -26,6 +30,18 @@ struct listing_item {
     struct {
       struct dust_fingerprint expected_fingerprint;
       unsigned char expected_hash[SHA256_DIGEST_LENGTH];
+      /* What lstat() said about the file when it was archived, so a
+       * later archive can tell whether it's changed. Only set if has_stat
+       * is, since older listings don't record it. Times are in
+       * nanoseconds since the epoch. */
+      int has_stat;
+      uint64_t size;
+      int64_t mtime;
+      int64_t ctime;
+      uint64_t inode;
+      /* The DUST_CHUNKING_* mode the file was cut into blocks with, or -1
+       * if the listing doesn't say. */
+      int chunking;
     } file;
     struct {
 
@@ -33,10 +49,14 @@ struct listing_item {
     struct {
       char *targetpath;
     } symlink;
+    struct {
+      char *targetpath; /* as recorded for the file it's a link to */
+    } hardlink;
   } data;
 };
 
-/* Returns non-null on success. */
+/* Returns non-null on success. The result is positioned at the start of
+ * the listing, ready to be passed to for_item_in_listing(). */
 FILE *extract_archive_listing(dust_index *index, dust_arena *arena, char *archive_infile);
 
 /* Returns DUST_OK if all items in the listing were processed successfully.
@@ -51,12 +71,20 @@ int for_item_in_listing(dust_index *index,
                         FILE *listing,
                         int callback(dust_index *index, dust_arena *arena, struct listing_item item));
 
-/* Returns DUST_OK on success. */
+/* Returns DUST_OK on success.
+ * Runs of zeroes are skipped over with fseeko(), where outfile allows, to
+ * leave holes in it; call finish_extracted_file() once done with outfile,
+ * in case it ends with one. */
 int extract_file(dust_index *index,
                  dust_arena *arena,
                  struct dust_fingerprint fingerprint,
                  FILE *outfile,
                  SHA256_CTX *hash_context);
 
+/* Extends outfile to its current position, so that any zeroes skipped over
+ * at its end by extract_file() are part of it.
+ * Returns DUST_OK on success. */
+int finish_extracted_file(FILE *outfile);
+
 #endif /* DUST_UTILS_H */
 
@@ -3,6 +3,8 @@
 
 #include <inttypes.h>
 
+#include <openssl/sha.h>
+
 #define DUST_DATA_BLOCK_SIZE (1024 * 64)
 #define DUST_FINGERPRINT_SIZE 32
 
@@ -17,7 +19,7 @@ struct dust_fingerprint {
   unsigned char bytes[DUST_FINGERPRINT_SIZE];
 };
 
-#define DUST_DEFAULT_NUM_BUCKETS (1024 * 1024) /* 4kB per index bucket; 4GB index by default */
+#define DUST_DEFAULT_NUM_BUCKETS ((uint64_t)1024) /* 4kB per index bucket; indexes start at 4MB, and grow as needed */
 
 #define DUST_PERM_READ 0 /* makes arena or index readable */
 #define DUST_PERM_RW   1 /* makes arena or index read+writable; does not truncate */
@@ -25,9 +27,13 @@ struct dust_fingerprint {
 #define DUST_ARENA_FLAG_NONE   0 /* default behaviour */
 #define DUST_ARENA_FLAG_CREATE 1 /* create a new arena if one does not already exist; requires write permissions */
 
-#define DUST_INDEX_FLAG_NONE   0 /* default behaviour */
-#define DUST_INDEX_FLAG_CREATE 1 /* create a new index if one does not already exist; requires write permissions */
-#define DUST_INDEX_FLAG_MMAP   2 /* index will be accessed with mmap, instead with stdio */
+#define DUST_CODEC_NONE 0 /* blocks are stored as they are */
+#define DUST_CODEC_ZLIB 1 /* blocks are compressed with zlib, where that makes them smaller */
+
+#define DUST_INDEX_FLAG_NONE    0 /* default behaviour */
+#define DUST_INDEX_FLAG_CREATE  1 /* create a new index if one does not already exist; requires write permissions */
+#define DUST_INDEX_FLAG_MMAP    2 /* index will be accessed with mmap, instead with stdio */
+#define DUST_INDEX_FLAG_SAMPLED 4 /* puts dedupe against manifests of recent blocks, instead of the whole index; requires write permissions */
 
 /* Returns a non-null value on success, and null on failure.
  * "permissions" is one of the DUST_PERM_* values.
@@ -39,10 +45,34 @@ dust_arena *dust_open_arena(const char *arena_path, int permissions, int flags);
  * "flags" is an or-ed combination of DUST_INDEX_FLAG_* values.
  * If DUST_INDEX_FLAG_CREATE is specified, an additional uint64_t argument must be provided,
  *   specifying the number of buckets the newly-created index should have. Use
- *   DUST_DEFAULT_NUM_BUCKETS unless you have a concrete reason to do otherwise. */
+ *   DUST_DEFAULT_NUM_BUCKETS unless you have a concrete reason to do otherwise.
+ * Without DUST_INDEX_FLAG_MMAP, the whole index is read into memory when it's
+ *   opened; with it, only the parts that lookups touch are read, as they're
+ *   needed, which is much quicker for anything only making a few lookups.
+ * With DUST_INDEX_FLAG_SAMPLED, puts only look for blocks already stored in
+ *   manifests of recently put blocks (see manifests.h), kept beside the
+ *   index, so that the index itself is only ever added to. Some blocks are
+ *   stored more than once as a result. */
 dust_index *dust_open_index(const char *index_path, int permissions, int flags, ...);
 
-/* Returns DUST_OK on success; some other value on failure. */
+/* Sets how blocks subsequently put into the arena are compressed.
+ * "codec" is one of the DUST_CODEC_* values; the default is DUST_CODEC_NONE.
+ * Blocks which don't get any smaller are stored uncompressed regardless.
+ * Reading is unaffected: blocks are always decompressed as need be. */
+void dust_arena_set_codec(dust_arena *arena, int codec);
+
+/* Blocks put into an arena are written out in batches, and are only added
+ * to the index once the arena has been synced to disk, so that the index
+ * never refers to data which a crash could lose. By default, an arena is
+ * only synced when it's closed (or when a great many blocks are waiting to
+ * be indexed); this asks for it to also be synced once "sync_bytes" bytes
+ * have been appended since it was last synced, or at the first append
+ * "sync_ms" milliseconds after the first unsynced one. 0 means no limit. */
+void dust_arena_set_sync_policy(dust_arena *arena, uint64_t sync_bytes, uint64_t sync_ms);
+
+/* Returns DUST_OK on success; some other value on failure.
+ * An arena which has been put into must be closed before the index it
+ * was used with, since closing it adds its remaining blocks to the index. */
 int dust_close_arena(dust_arena **arena);
 
 /* Returns DUST_OK on success; some other value on failure. */
@@ -58,11 +88,43 @@ int dust_check(dust_index *index, dust_arena *arena);
 /* Scans the specified arena, and adds each block in it to the specified index.
  * Useful for building a fresh index from an existing arena, and perhaps for
  * other things.
+ * The arena's hunks are read by "threads" threads at once; the blocks are
+ * added in the same order whatever it is, so the index is the same too.
  * Returns DUST_OK on success, and some other value on failure.
  */
-int dust_fill_index_from_arena(dust_index *index, dust_arena *arena);
+int dust_fill_index_from_arena(dust_index *index, dust_arena *arena, int threads);
 
 struct dust_fingerprint dust_put(dust_index *index, dust_arena *arena, unsigned char *data, uint32_t size, uint32_t type);
+
+/* dust_put() is equivalent to calling these two in turn. They're split up
+ * so that fingerprints can be calculated on other threads; the arena and
+ * index may only be used from one thread at a time, but
+ * dust_fingerprint_data() is safe to call from any number of threads.
+ * "fingerprint" must be the value dust_fingerprint_data() returned for
+ * the same data. */
+struct dust_fingerprint dust_fingerprint_data(unsigned char *data, uint32_t size);
+
+/* Data which is nothing but zeroes is never stored. Instead, it gets a
+ * reserved fingerprint which records its size, and which dust_put() and
+ * dust_get() recognise: dust_put() doesn't touch the arena or index for it,
+ * and dust_get() returns a block of zeroes of that size. Fingerprinting
+ * zeroes gives one of these. dust_fingerprint_is_zeroes() returns nonzero
+ * for them, also storing the size in *size if size is non-null. */
+struct dust_fingerprint dust_zero_fingerprint(uint32_t size);
+int dust_fingerprint_is_zeroes(struct dust_fingerprint fingerprint, uint32_t *size);
+
+/* As dust_fingerprint_data(), but also adds data to file_context (if it's
+ * non-null) in the same pass over it, for callers which are hashing a
+ * whole file as well as its blocks. Safe to call from any thread. */
+struct dust_fingerprint dust_fingerprint_data_and_hash(unsigned char *data,
+                                                       uint32_t size,
+                                                       SHA256_CTX *file_context);
+void dust_put_fingerprinted(dust_index *index,
+                            dust_arena *arena,
+                            unsigned char *data,
+                            uint32_t size,
+                            uint32_t type,
+                            struct dust_fingerprint fingerprint);
 struct dust_block *dust_get(dust_index *index, dust_arena *arena, struct dust_fingerprint fingerprint);
 void dust_release(struct dust_block **block);
 
@@ -0,0 +1,24 @@
+#ifndef DUST_HARDLINKS_H
+#define DUST_HARDLINKS_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Remembers the first path archived for each file with more than one
+ * link, so later links to it can be recorded as such, instead of being
+ * read all over again. */
+struct dust_link_table;
+
+struct dust_link_table *dust_link_table_new(void);
+
+/* If a file with the same device and inode number as sb has been seen
+ * already, returns the path it was seen at. Otherwise remembers path for
+ * it, and returns NULL. The result remains valid until the table is
+ * freed. Not safe to call from more than one thread at once. */
+const char *dust_link_table_find_or_add(struct dust_link_table *table,
+                                        const struct stat *sb,
+                                        const char *path);
+
+void dust_link_table_free(struct dust_link_table **table);
+
+#endif /* DUST_HARDLINKS_H */
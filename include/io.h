@@ -3,6 +3,8 @@
 
 #include <stddef.h>
 #include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 /* As fwrite(), but writes an error message to stderr and terminates
  * the process if the write fails.
@@ -29,5 +31,55 @@ void dfread_func(void *ptr,
                  const char *file,
                  int line);
 
+/* As writev(), but carries on after short writes until everything has been
+ * written, and writes an error message to stderr and terminates the
+ * process if the write fails. The contents of iov may be modified.
+ */
+#define dwritev(fd, iov, iovcnt) \
+  dwritev_func((fd), (iov), (iovcnt), __FILE__, __LINE__)
+void dwritev_func(int fd,
+                  struct iovec *iov,
+                  int iovcnt,
+                  const char *file,
+                  int line);
+
+/* As pwrite(), but carries on after short writes until everything has been
+ * written, and writes an error message to stderr and terminates the
+ * process if the write fails.
+ */
+#define dpwrite(fd, buf, count, offset) \
+  dpwrite_func((fd), (buf), (count), (offset), __FILE__, __LINE__)
+void dpwrite_func(int fd,
+                  const void *buf,
+                  size_t count,
+                  off_t offset,
+                  const char *file,
+                  int line);
+
+/* As pread(), but carries on after short reads until count bytes have been
+ * read or the end of the file is reached, and writes an error message to
+ * stderr and terminates the process if the read fails.
+ * Returns how many bytes were read, which is fewer than count only if the
+ * end of the file was reached.
+ */
+#define dpread(fd, buf, count, offset) \
+  dpread_func((fd), (buf), (count), (offset), __FILE__, __LINE__)
+size_t dpread_func(int fd,
+                   void *buf,
+                   size_t count,
+                   off_t offset,
+                   const char *file,
+                   int line);
+
+/* Replaces the file at path with one whose contents are written to stream
+ * by write_contents. They're written to a new file beside path, which is
+ * synced to disk before being renamed over path, so that a failure or a
+ * crash part-way through leaves whatever was at path as it was.
+ * Returns 0 on success, and -1, having removed the new file, on failure.
+ */
+int replace_file(const char *path,
+                 void write_contents(FILE *stream, void *data),
+                 void *data);
+
 #endif /* DUST_IO_H */
 
@@ -0,0 +1,45 @@
+#ifndef DUST_MANIFESTS_H
+#define DUST_MANIFESTS_H
+
+/* Decides whether blocks are already stored using only a small sample of
+ * fingerprints held in memory, instead of looking every one of them up in
+ * the index, as in sparse indexing.
+ *
+ * Blocks put are recorded, in the order they're put, in manifests of a few
+ * hundred blocks each, which are appended to a file. About one fingerprint
+ * in 64, chosen by its bits, is a hook; a table in memory maps each hook
+ * to the last manifest it appeared in. When a hook is put again, that
+ * manifest is read back, and the blocks which followed it last time are
+ * recognised without looking at the index, as are those which preceded it
+ * in the manifest.
+ *
+ * Blocks which are stored already, but which don't turn up in any manifest
+ * read back, are taken to be new, and stored again; that's the price paid
+ * for keeping only the hooks in memory.
+ *
+ * Not safe to share between threads. */
+struct dust_manifests;
+
+/* Opens the manifests and hooks kept beside the index at index_path,
+ * creating them if there aren't any yet. Returns NULL on failure. */
+struct dust_manifests *dust_manifests_open(const char *index_path);
+
+/* Returns 1 if fingerprint is in a manifest read back so far, and 0
+ * otherwise. If fingerprint is a hook, the last manifest it appeared in is
+ * read back first. */
+int dust_manifests_contains(struct dust_manifests *manifests, const unsigned char *fingerprint);
+
+/* Records that the block with the given fingerprint was put, whether it
+ * was stored or was there already. Manifests are trusted without looking
+ * at the index, so a block mustn't be added until it has been synced to
+ * the arena. */
+void dust_manifests_add(struct dust_manifests *manifests, const unsigned char *fingerprint);
+
+/* Writes out the manifests recorded since they were opened, which are
+ * kept in memory until now, and frees everything. Call this only once
+ * the index has been written back, so that no manifest on disk names a
+ * block the index doesn't have.
+ * Returns DUST_OK on success, and some other value on failure. */
+int dust_manifests_close(struct dust_manifests **manifests);
+
+#endif /* DUST_MANIFESTS_H */
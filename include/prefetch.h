@@ -0,0 +1,36 @@
+#ifndef DUST_PREFETCH_H
+#define DUST_PREFETCH_H
+
+#include <stddef.h>
+
+/* Reads small files whole, with many opens, reads and closes in flight at
+ * once through io_uring, so that reading lots of small files is limited by
+ * the device rather than by the round trip of each system call.
+ * Not safe to share between threads; each thread wants its own. */
+struct dust_prefetch;
+
+/* Returns NULL if io_uring isn't available, either because this system
+ * doesn't have it or because it isn't allowed; callers should then read
+ * files the usual way. At most "depth" files may be being read at once. */
+struct dust_prefetch *dust_prefetch_new(unsigned depth);
+
+/* Starts reading the file at path, expected to be "size" bytes long.
+ * path must stay valid until dust_prefetch_wait() is called for it.
+ * Returns an id to pass to dust_prefetch_wait(), or -1 if "depth" files are
+ * already being read. */
+int dust_prefetch_start(struct dust_prefetch *prefetch, const char *path, size_t size);
+
+/* Waits for the file with the given id to be read. Returns DUST_OK, and
+ * points *data at its contents, if exactly the expected number of bytes
+ * was read; the data stays valid until dust_prefetch_release(). Otherwise
+ * (the file couldn't be opened or read, or has changed size) returns some
+ * other value, and the caller should read the file the usual way. */
+int dust_prefetch_wait(struct dust_prefetch *prefetch, int id, unsigned char **data);
+
+/* Frees what was read for id, so id can be reused. */
+void dust_prefetch_release(struct dust_prefetch *prefetch, int id);
+
+/* Waits for anything still in flight, and frees everything. */
+void dust_prefetch_free(struct dust_prefetch **prefetch);
+
+#endif /* DUST_PREFETCH_H */
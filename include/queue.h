@@ -0,0 +1,21 @@
+#ifndef DUST_QUEUE_H
+#define DUST_QUEUE_H
+
+#include <stddef.h>
+
+/* A bounded, thread-safe FIFO of pointers, for handing work between
+ * threads. Pushing to a full queue, or popping from an empty one, blocks
+ * until another thread makes room or provides an item. */
+struct dust_queue;
+
+struct dust_queue *dust_queue_new(size_t capacity);
+void dust_queue_free(struct dust_queue **queue);
+
+void dust_queue_push(struct dust_queue *queue, void *item);
+void *dust_queue_pop(struct dust_queue *queue);
+
+/* Like dust_queue_pop(), but never blocks. Returns 1, having stored the
+ * item in *item, if there was one to pop, and 0 otherwise. */
+int dust_queue_try_pop(struct dust_queue *queue, void **item);
+
+#endif /* DUST_QUEUE_H */
@@ -0,0 +1,43 @@
+#ifndef DUST_STAT_CACHE_H
+#define DUST_STAT_CACHE_H
+
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <openssl/sha.h>
+
+#include "dust-internal.h"
+
+/* Remembers what lstat() said about each file in an earlier archive, so
+ * that files which haven't changed since then can be archived again
+ * without being read. */
+struct dust_stat_cache;
+
+/* Loads the listing of the archive at archive_path, which must be stored
+ * in the given arena. Only files cut into blocks with the DUST_CHUNKING_*
+ * mode "chunking" are remembered, as the fingerprints of the rest aren't
+ * what archiving them now would give. Returns NULL, having written an
+ * explanation to stderr, on failure. */
+struct dust_stat_cache *dust_stat_cache_load(dust_index *index,
+                                             dust_arena *arena,
+                                             char *archive_path,
+                                             int chunking);
+
+/* Returns 1 if "path" was archived with the same size, mtime, ctime and
+ * inode number as sb now gives it, and copies the fingerprint and hash it
+ * was archived with into *fingerprint and hash. Otherwise returns 0.
+ * Safe to call from any number of threads at once. */
+int dust_stat_cache_lookup(const struct dust_stat_cache *cache,
+                           const char *path,
+                           const struct stat *sb,
+                           struct dust_fingerprint *fingerprint,
+                           unsigned char *hash);
+
+void dust_stat_cache_free(struct dust_stat_cache **cache);
+
+/* The modification and change times in sb, in nanoseconds since the epoch. */
+int64_t dust_stat_mtime(const struct stat *sb);
+int64_t dust_stat_ctime(const struct stat *sb);
+
+#endif /* DUST_STAT_CACHE_H */
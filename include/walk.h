@@ -0,0 +1,27 @@
+#ifndef DUST_WALK_H
+#define DUST_WALK_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Walks directory trees on a pool of threads, reading directories with
+ * openat()/fstatat() relative to their parents' descriptors. The walk is
+ * returned in a fixed order no matter how many threads take part: each
+ * root, then (if it's a directory) everything beneath it, depth-first,
+ * with the entries of each directory sorted by name. Symlinks are
+ * reported, not followed. */
+struct dust_walk;
+
+/* Starts walking each of the num_roots paths in roots, in turn. */
+struct dust_walk *dust_walk_start(char **roots, int num_roots, int num_threads);
+
+/* Returns 1 and sets *path (which the caller must free) and *sb to the
+ * next entry in the walk; returns 0 once the walk is over. Returns -1,
+ * having written an explanation to stderr, if part of the tree couldn't
+ * be read; the walk can't be continued after that. */
+int dust_walk_next(struct dust_walk *walk, char **path, struct stat *sb);
+
+/* Stops any threads still walking, and frees walk. */
+void dust_walk_finish(struct dust_walk **walk);
+
+#endif /* DUST_WALK_H */
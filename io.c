@@ -1,9 +1,14 @@
+#define _GNU_SOURCE
+
 #include "io.h"
 
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include "memory.h"
 
 static void die(void)
 {
@@ -66,3 +71,115 @@ void dfread_func(void *ptr, size_t size, size_t nmemb, FILE *stream, const char
   }
 }
 
+
+void dwritev_func(int fd, struct iovec *iov, int iovcnt, const char *file, int line)
+{
+  while (iovcnt > 0) {
+    ssize_t rv = writev(fd, iov, iovcnt);
+    if (rv == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr,
+              "%s:%d: failed to complete write: %s\n",
+              file,
+              line,
+              strerror(errno));
+      die();
+    }
+
+    /* Skip past whatever was written, which may end part-way through
+     * one of the buffers. */
+    while (iovcnt > 0 && (size_t)rv >= iov->iov_len) {
+      rv -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + rv;
+      iov->iov_len -= rv;
+    }
+  }
+}
+
+void dpwrite_func(int fd, const void *buf, size_t count, off_t offset, const char *file, int line)
+{
+  const char *cptr = buf;
+
+  while (count > 0) {
+    ssize_t rv = pwrite(fd, cptr, count, offset);
+    if (rv == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr,
+              "%s:%d: failed to complete write: %s\n",
+              file,
+              line,
+              strerror(errno));
+      die();
+    }
+    cptr += rv;
+    count -= rv;
+    offset += rv;
+  }
+}
+
+size_t dpread_func(int fd, void *buf, size_t count, off_t offset, const char *file, int line)
+{
+  char *cptr = buf;
+  size_t done = 0;
+
+  while (done < count) {
+    ssize_t rv = pread(fd, cptr + done, count - done, offset + done);
+    if (rv == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr,
+              "%s:%d: failed to complete read: %s\n",
+              file,
+              line,
+              strerror(errno));
+      die();
+    }
+    if (rv == 0) {
+      break;
+    }
+    done += rv;
+  }
+  return done;
+}
+
+int replace_file(const char *path, void write_contents(FILE *stream, void *data), void *data)
+{
+  char *tmp_path = dmalloc(strlen(path) + sizeof(".tmp"));
+  FILE *stream = NULL;
+  int rv = 0;
+
+  strcpy(tmp_path, path);
+  strcat(tmp_path, ".tmp");
+
+  stream = fopen(tmp_path, "w");
+  if (!stream) {
+    free(tmp_path);
+    return -1;
+  }
+
+  write_contents(stream, data);
+
+  if (fflush(stream) != 0 || fsync(fileno(stream)) != 0) {
+    rv = -1;
+  }
+  if (fclose(stream) != 0) {
+    rv = -1;
+  }
+  if (rv == 0 && rename(tmp_path, path) != 0) {
+    rv = -1;
+  }
+  if (rv != 0) {
+    remove(tmp_path);
+  }
+  free(tmp_path);
+  return rv;
+}
@@ -0,0 +1,459 @@
+#define _GNU_SOURCE
+
+#include "manifests.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dust-internal.h"
+#include "io.h"
+#include "memory.h"
+#include "types.h"
+
+/* A fingerprint is a hook if these bits of this byte of it are all zero.
+ * Fingerprints are uniformly distributed, so one in 64 is a hook; the byte
+ * is one the index and its filter don't otherwise use. */
+#define HOOK_BYTE 10
+#define HOOK_MASK 0x3f
+
+/* How many blocks each manifest records, and how many manifests which have
+ * been read back are kept in memory at once. */
+#define MANIFEST_BLOCKS 256
+#define MANIFEST_CACHE_SIZE 64
+
+#define HOOKS_VERSION 1
+#define HOOKS_INITIAL_CAPACITY 1024
+
+/* The manifests file is a series of manifests, each a count followed by
+ * that many fingerprints, in the order their blocks were put. A manifest
+ * is named by its offset in the file. */
+struct manifest_header {
+  uint32_t_be num_fingerprints;
+};
+
+struct hooks_header {
+  uint64_t_be version;
+  uint64_t_be num_hooks;
+};
+
+struct hook {
+  unsigned char fingerprint[DUST_FINGERPRINT_SIZE];
+  uint64_t_be manifest; /* one more than its offset; 0 in unused slots */
+};
+
+struct cached_manifest {
+  uint64_t manifest;    /* as in struct hook */
+  uint64_t last_used;
+  uint32_t num_fingerprints;
+  unsigned char fingerprints[MANIFEST_BLOCKS][DUST_FINGERPRINT_SIZE]; /* sorted */
+};
+
+struct dust_manifests {
+  int fd;          /* the manifests file */
+  uint64_t end;    /* its size, counting what's still in unwritten */
+  char *hooks_path;
+
+  /* Manifests which have been finished, but not yet written; they're
+   * appended to the file when it's closed. */
+  unsigned char *unwritten;
+  size_t unwritten_len;
+  size_t unwritten_capacity;
+
+  /* An open-addressed hash table of hooks, kept at most half full. */
+  struct hook *hooks;
+  uint64_t hooks_capacity; /* always a power of two */
+  uint64_t num_hooks;
+  int hooks_dirtied;
+
+  struct cached_manifest *cache; /* MANIFEST_CACHE_SIZE of them */
+  uint64_t clock;
+
+  /* The manifest being built. */
+  unsigned char current[MANIFEST_BLOCKS][DUST_FINGERPRINT_SIZE];
+  uint32_t num_current;
+};
+
+static int is_hook(const unsigned char *fingerprint)
+{
+  return (fingerprint[HOOK_BYTE] & HOOK_MASK) == 0;
+}
+
+static int compare_fingerprints(const void *a, const void *b)
+{
+  return memcmp(a, b, DUST_FINGERPRINT_SIZE);
+}
+
+static struct hook *find_hook(struct dust_manifests *manifests, const unsigned char *fingerprint)
+{
+  uint64_t slot = 0;
+
+  /* Fingerprints are uniformly distributed, so any of their bits will do. */
+  for (size_t i = 0; i < sizeof(slot); i++) {
+    slot = (slot << 8) | fingerprint[i];
+  }
+  slot &= manifests->hooks_capacity - 1;
+
+  while (uint64be_to_host(manifests->hooks[slot].manifest) != 0) {
+    if (memcmp(manifests->hooks[slot].fingerprint, fingerprint, DUST_FINGERPRINT_SIZE) == 0) {
+      break;
+    }
+    slot = (slot + 1) & (manifests->hooks_capacity - 1);
+  }
+  return &manifests->hooks[slot];
+}
+
+static void allocate_hooks(struct dust_manifests *manifests, uint64_t capacity)
+{
+  manifests->hooks_capacity = capacity;
+  manifests->hooks = calloc(capacity, sizeof *manifests->hooks);
+  assert(manifests->hooks);
+}
+
+/* Points the hook at manifest, adding it if it isn't there already. */
+static void set_hook(struct dust_manifests *manifests, const unsigned char *fingerprint, uint64_t manifest)
+{
+  struct hook *hook = NULL;
+
+  if (manifests->num_hooks * 2 >= manifests->hooks_capacity) {
+    struct hook *old = manifests->hooks;
+    uint64_t old_capacity = manifests->hooks_capacity;
+
+    allocate_hooks(manifests, old_capacity * 2);
+    for (uint64_t i = 0; i < old_capacity; i++) {
+      if (uint64be_to_host(old[i].manifest) != 0) {
+        *find_hook(manifests, old[i].fingerprint) = old[i];
+      }
+    }
+    free(old);
+  }
+
+  hook = find_hook(manifests, fingerprint);
+  if (uint64be_to_host(hook->manifest) == 0) {
+    memcpy(hook->fingerprint, fingerprint, DUST_FINGERPRINT_SIZE);
+    manifests->num_hooks++;
+  }
+  hook->manifest = uint64host_to_be(manifest);
+  manifests->hooks_dirtied = 1;
+}
+
+/* Returns DUST_OK if there are no hooks saved at path, or they've all been
+ * read, and some other value if they can't be. */
+static int load_hooks(struct dust_manifests *manifests, const char *path)
+{
+  struct hooks_header header;
+  uint64_t num_hooks = 0;
+  FILE *stream = fopen(path, "r");
+  int rv = DUST_OK;
+
+  if (!stream) {
+    return errno == ENOENT ? DUST_OK : !DUST_OK;
+  }
+
+  if (fread(&header, sizeof header, 1, stream) != 1
+      || uint64be_to_host(header.version) != HOOKS_VERSION) {
+    fclose(stream);
+    return !DUST_OK;
+  }
+
+  num_hooks = uint64be_to_host(header.num_hooks);
+  for (uint64_t i = 0; i < num_hooks; i++) {
+    struct hook hook;
+
+    if (fread(&hook, sizeof hook, 1, stream) != 1) {
+      rv = !DUST_OK;
+      break;
+    }
+    set_hook(manifests, hook.fingerprint, uint64be_to_host(hook.manifest));
+  }
+  manifests->hooks_dirtied = 0;
+
+  fclose(stream);
+  return rv;
+}
+
+static void write_hooks(FILE *stream, void *data)
+{
+  struct dust_manifests *manifests = data;
+  struct hooks_header header;
+
+  header.version = uint64host_to_be(HOOKS_VERSION);
+  header.num_hooks = uint64host_to_be(manifests->num_hooks);
+  dfwrite(&header, sizeof header, 1, stream);
+  for (uint64_t i = 0; i < manifests->hooks_capacity; i++) {
+    if (uint64be_to_host(manifests->hooks[i].manifest) != 0) {
+      dfwrite(&manifests->hooks[i], sizeof manifests->hooks[i], 1, stream);
+    }
+  }
+}
+
+/* Saves the hooks over hooks_path, so that a failure part-way through
+ * leaves any earlier ones as they were. */
+static int save_hooks(struct dust_manifests *manifests)
+{
+  if (replace_file(manifests->hooks_path, write_hooks, manifests) != 0) {
+    return !DUST_OK;
+  }
+  return DUST_OK;
+}
+
+/* Returns the cache slot to put another manifest in: an empty one if
+ * there is one, and the least recently used one otherwise. */
+static struct cached_manifest *cache_slot_to_fill(struct dust_manifests *manifests)
+{
+  struct cached_manifest *victim = &manifests->cache[0];
+
+  for (int i = 0; i < MANIFEST_CACHE_SIZE; i++) {
+    struct cached_manifest *c = &manifests->cache[i];
+
+    if (c->manifest == 0) {
+      return c;
+    }
+    if (c->last_used < victim->last_used) {
+      victim = c;
+    }
+  }
+  return victim;
+}
+
+static struct cached_manifest *find_cached_manifest(struct dust_manifests *manifests, uint64_t manifest)
+{
+  for (int i = 0; i < MANIFEST_CACHE_SIZE; i++) {
+    if (manifests->cache[i].manifest == manifest) {
+      return &manifests->cache[i];
+    }
+  }
+  return NULL;
+}
+
+/* Puts num_fingerprints fingerprints into the cache as manifest. */
+static void cache_manifest(struct dust_manifests *manifests,
+                           uint64_t manifest,
+                           const unsigned char (*fingerprints)[DUST_FINGERPRINT_SIZE],
+                           uint32_t num_fingerprints)
+{
+  struct cached_manifest *c = cache_slot_to_fill(manifests);
+
+  c->manifest = manifest;
+  c->last_used = ++manifests->clock;
+  c->num_fingerprints = num_fingerprints;
+  memcpy(c->fingerprints, fingerprints, num_fingerprints * DUST_FINGERPRINT_SIZE);
+  qsort(c->fingerprints, num_fingerprints, DUST_FINGERPRINT_SIZE, compare_fingerprints);
+}
+
+/* Reads manifest back from the file into the cache, unless it's there
+ * already. A manifest which can't be read is left out; that only means
+ * its blocks won't be recognised.
+ * Returns the manifest which follows it, or 0 if there isn't one. */
+static uint64_t read_manifest(struct dust_manifests *manifests, uint64_t manifest)
+{
+  struct manifest_header header;
+  unsigned char fingerprints[MANIFEST_BLOCKS][DUST_FINGERPRINT_SIZE];
+  uint32_t num_fingerprints = 0;
+  uint64_t offset = manifest - 1;
+  uint64_t written = manifests->end - manifests->unwritten_len;
+  size_t len = 0;
+
+  struct cached_manifest *c = find_cached_manifest(manifests, manifest);
+  if (c) {
+    c->last_used = ++manifests->clock;
+    num_fingerprints = c->num_fingerprints;
+  } else if (offset >= written) {
+    const unsigned char *record = manifests->unwritten + (offset - written);
+
+    memcpy(&header, record, sizeof header);
+    num_fingerprints = uint32be_to_host(header.num_fingerprints);
+    memcpy(fingerprints, record + sizeof header, num_fingerprints * DUST_FINGERPRINT_SIZE);
+  } else {
+    if (pread(manifests->fd, &header, sizeof header, offset) != sizeof header) {
+      return 0;
+    }
+    num_fingerprints = uint32be_to_host(header.num_fingerprints);
+    if (num_fingerprints > MANIFEST_BLOCKS) {
+      return 0;
+    }
+    len = num_fingerprints * DUST_FINGERPRINT_SIZE;
+    if (pread(manifests->fd, fingerprints, len, offset + sizeof header) != (ssize_t)len) {
+      return 0;
+    }
+  }
+  if (!c) {
+    cache_manifest(manifests, manifest, (const unsigned char (*)[DUST_FINGERPRINT_SIZE])fingerprints,
+                   num_fingerprints);
+  }
+
+  offset += sizeof header + num_fingerprints * DUST_FINGERPRINT_SIZE;
+  return offset < manifests->end ? offset + 1 : 0;
+}
+
+/* Finishes the manifest being built, points its hooks at it, and keeps it
+ * in the cache, since later blocks are likely to repeat it. */
+static void finish_current_manifest(struct dust_manifests *manifests)
+{
+  struct manifest_header header;
+  uint64_t manifest = manifests->end + 1;
+  size_t len = sizeof header + manifests->num_current * DUST_FINGERPRINT_SIZE;
+
+  if (manifests->num_current == 0) {
+    return;
+  }
+
+  if (manifests->unwritten_len + len > manifests->unwritten_capacity) {
+    manifests->unwritten_capacity = 2 * (manifests->unwritten_capacity + len);
+    manifests->unwritten = realloc(manifests->unwritten, manifests->unwritten_capacity);
+    assert(manifests->unwritten);
+  }
+  header.num_fingerprints = uint32host_to_be(manifests->num_current);
+  memcpy(manifests->unwritten + manifests->unwritten_len, &header, sizeof header);
+  memcpy(manifests->unwritten + manifests->unwritten_len + sizeof header,
+         manifests->current,
+         manifests->num_current * DUST_FINGERPRINT_SIZE);
+  manifests->unwritten_len += len;
+  manifests->end += len;
+
+  for (uint32_t i = 0; i < manifests->num_current; i++) {
+    if (is_hook(manifests->current[i])) {
+      set_hook(manifests, manifests->current[i], manifest);
+    }
+  }
+  cache_manifest(manifests,
+                 manifest,
+                 (const unsigned char (*)[DUST_FINGERPRINT_SIZE])manifests->current,
+                 manifests->num_current);
+  manifests->num_current = 0;
+}
+
+struct dust_manifests *dust_manifests_open(const char *index_path)
+{
+  struct dust_manifests *manifests = NULL;
+  char *manifests_path = NULL;
+  struct stat sb;
+
+  assert(index_path);
+
+  manifests = dmalloc(sizeof *manifests);
+  memset(manifests, 0, sizeof *manifests);
+  manifests->fd = -1;
+
+  manifests_path = dmalloc(strlen(index_path) + sizeof(".manifests"));
+  strcpy(manifests_path, index_path);
+  strcat(manifests_path, ".manifests");
+  manifests->fd = open(manifests_path, O_RDWR | O_CREAT, 0644);
+  free(manifests_path);
+  if (manifests->fd == -1 || fstat(manifests->fd, &sb) != 0) {
+    goto fail;
+  }
+  manifests->end = sb.st_size;
+
+  manifests->hooks_path = dmalloc(strlen(index_path) + sizeof(".hooks"));
+  strcpy(manifests->hooks_path, index_path);
+  strcat(manifests->hooks_path, ".hooks");
+  allocate_hooks(manifests, HOOKS_INITIAL_CAPACITY);
+  if (load_hooks(manifests, manifests->hooks_path) != DUST_OK) {
+    /* They only make deduplication cheaper, so carry on without them,
+     * and have them replaced at close. */
+    fprintf(stderr,
+            "Warning: failed to read hooks from '%s'; starting without them.\n",
+            manifests->hooks_path);
+    free(manifests->hooks);
+    manifests->num_hooks = 0;
+    allocate_hooks(manifests, HOOKS_INITIAL_CAPACITY);
+    manifests->hooks_dirtied = 1;
+  }
+
+  manifests->cache = calloc(MANIFEST_CACHE_SIZE, sizeof *manifests->cache);
+  assert(manifests->cache);
+
+  return manifests;
+
+fail:
+  if (manifests->fd != -1) {
+    close(manifests->fd);
+  }
+  free(manifests->hooks_path);
+  free(manifests->hooks);
+  free(manifests);
+  return NULL;
+}
+
+int dust_manifests_contains(struct dust_manifests *manifests, const unsigned char *fingerprint)
+{
+  assert(manifests);
+  assert(fingerprint);
+
+  if (is_hook(fingerprint)) {
+    struct hook *hook = find_hook(manifests, fingerprint);
+    uint64_t manifest = uint64be_to_host(hook->manifest);
+
+    /* The hook turns up some way into its manifest, after the blocks
+     * before it have gone by, so the manifest after it is read as well:
+     * blocks following on as they did last time are then recognised from
+     * the start, rather than only from the next hook among them. */
+    if (manifest != 0) {
+      manifest = read_manifest(manifests, manifest);
+      if (manifest != 0) {
+        read_manifest(manifests, manifest);
+      }
+    }
+  }
+
+  for (int i = 0; i < MANIFEST_CACHE_SIZE; i++) {
+    struct cached_manifest *c = &manifests->cache[i];
+
+    if (c->manifest != 0
+        && bsearch(fingerprint, c->fingerprints, c->num_fingerprints,
+                   DUST_FINGERPRINT_SIZE, compare_fingerprints)) {
+      c->last_used = ++manifests->clock;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void dust_manifests_add(struct dust_manifests *manifests, const unsigned char *fingerprint)
+{
+  assert(manifests);
+  assert(fingerprint);
+
+  memcpy(manifests->current[manifests->num_current++], fingerprint, DUST_FINGERPRINT_SIZE);
+  if (manifests->num_current == MANIFEST_BLOCKS) {
+    finish_current_manifest(manifests);
+  }
+}
+
+int dust_manifests_close(struct dust_manifests **manifests)
+{
+  int rv = DUST_OK;
+
+  assert(manifests && *manifests);
+
+  finish_current_manifest(*manifests);
+  if ((*manifests)->unwritten_len > 0) {
+    dpwrite((*manifests)->fd,
+            (*manifests)->unwritten,
+            (*manifests)->unwritten_len,
+            (*manifests)->end - (*manifests)->unwritten_len);
+  }
+  /* The hooks are saved after the manifests they point to are written. */
+  if ((*manifests)->hooks_dirtied && save_hooks(*manifests) != DUST_OK) {
+    fprintf(stderr, "Failed to save hooks to '%s'.\n", (*manifests)->hooks_path);
+    rv = !DUST_OK;
+  }
+  if (close((*manifests)->fd) != 0) {
+    rv = !DUST_OK;
+  }
+
+  free((*manifests)->hooks_path);
+  free((*manifests)->hooks);
+  free((*manifests)->cache);
+  free((*manifests)->unwritten);
+  free(*manifests);
+  *manifests = NULL;
+  return rv;
+}
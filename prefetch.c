@@ -0,0 +1,455 @@
+#define _GNU_SOURCE
+
+#include "prefetch.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dust-internal.h"
+#include "memory.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+/* There's no liburing to lean on, so this talks to the kernel directly:
+ * requests go in the submission ring, results come back in the completion
+ * ring, and both are shared with the kernel through mmap(). */
+struct ring {
+  int fd;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+  unsigned unsubmitted;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_map;
+  size_t sq_map_size;
+  void *cq_map;
+  size_t cq_map_size;
+  size_t sqes_size;
+};
+
+/* What's in flight for a slot is recorded in the low bits of each
+ * request's user_data. */
+#define OP_OPEN  0
+#define OP_READ  1
+#define OP_CLOSE 2
+#define OP_BITS  2
+
+#define SLOT_FREE    0
+#define SLOT_OPENING 1
+#define SLOT_READING 2
+#define SLOT_DONE    3
+
+struct slot {
+  int state;
+  const char *path;
+  size_t size;          /* expected */
+  unsigned char *data;  /* size + 1 bytes, so we notice if the file grew */
+  int fd;
+  int64_t result;       /* bytes read, or -errno */
+};
+
+struct dust_prefetch {
+  struct ring ring;
+  unsigned depth;
+  struct slot *slots;
+  unsigned closing; /* closes submitted but not yet completed */
+};
+
+static int ring_init(struct ring *ring, unsigned entries)
+{
+  struct io_uring_params p;
+  unsigned char *sq, *cq;
+
+  memset(&p, 0, sizeof(p));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd < 0) {
+    return !DUST_OK;
+  }
+
+  ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_map_size > ring->sq_map_size) {
+      ring->sq_map_size = ring->cq_map_size;
+    }
+    ring->cq_map_size = ring->sq_map_size;
+  }
+
+  ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_map == MAP_FAILED) {
+    close(ring->fd);
+    return !DUST_OK;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_map = ring->sq_map;
+  } else {
+    ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_map == MAP_FAILED) {
+      munmap(ring->sq_map, ring->sq_map_size);
+      close(ring->fd);
+      return !DUST_OK;
+    }
+  }
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    if (ring->cq_map != ring->sq_map) {
+      munmap(ring->cq_map, ring->cq_map_size);
+    }
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+    return !DUST_OK;
+  }
+
+  sq = ring->sq_map;
+  cq = ring->cq_map;
+  ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sq_entries = p.sq_entries;
+  ring->unsubmitted = 0;
+  ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  /* Submission ring entry i always names SQE i. */
+  unsigned *array = (unsigned *)(sq + p.sq_off.array);
+  for (unsigned i = 0; i < p.sq_entries; i++) {
+    array[i] = i;
+  }
+
+  return DUST_OK;
+}
+
+static void ring_free(struct ring *ring)
+{
+  munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_map != ring->sq_map) {
+    munmap(ring->cq_map, ring->cq_map_size);
+  }
+  munmap(ring->sq_map, ring->sq_map_size);
+  assert(0 == close(ring->fd));
+}
+
+/* Hands everything queued so far to the kernel, and if wait is set, waits
+ * for at least one request to complete. */
+static void ring_enter(struct ring *ring, int wait)
+{
+  if (!wait && ring->unsubmitted == 0) {
+    return;
+  }
+
+  while (1) {
+    int rv = syscall(__NR_io_uring_enter,
+                     ring->fd,
+                     ring->unsubmitted,
+                     wait ? 1 : 0,
+                     wait ? IORING_ENTER_GETEVENTS : 0,
+                     NULL,
+                     0);
+    if (rv >= 0) {
+      ring->unsubmitted -= rv;
+      if (ring->unsubmitted == 0 || wait) {
+        return;
+      }
+    } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      fprintf(stderr, "io_uring_enter failed: %s. Bailing.\n", strerror(errno));
+      exit(1);
+    }
+  }
+}
+
+static struct io_uring_sqe *ring_get_sqe(struct ring *ring)
+{
+  unsigned tail = *ring->sq_tail;
+
+  if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+    ring_enter(ring, 0);
+  }
+  assert(tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) < ring->sq_entries);
+
+  struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+static void ring_queue_sqe(struct ring *ring)
+{
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+  ring->unsubmitted++;
+}
+
+/* Returns 1, having filled in *cqe, if a request has completed. */
+static int ring_pop_cqe(struct ring *ring, struct io_uring_cqe *cqe)
+{
+  unsigned head = *ring->cq_head;
+
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  *cqe = ring->cqes[head & ring->cq_mask];
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+static void queue_open(struct dust_prefetch *prefetch, int id)
+{
+  struct io_uring_sqe *sqe = ring_get_sqe(&prefetch->ring);
+
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uintptr_t)prefetch->slots[id].path;
+  sqe->open_flags = O_RDONLY | O_CLOEXEC;
+  sqe->user_data = ((uint64_t)id << OP_BITS) | OP_OPEN;
+  ring_queue_sqe(&prefetch->ring);
+}
+
+static void queue_read(struct dust_prefetch *prefetch, int id)
+{
+  struct io_uring_sqe *sqe = ring_get_sqe(&prefetch->ring);
+
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = prefetch->slots[id].fd;
+  sqe->addr = (uintptr_t)prefetch->slots[id].data;
+  sqe->len = prefetch->slots[id].size + 1;
+  sqe->off = 0;
+  sqe->user_data = ((uint64_t)id << OP_BITS) | OP_READ;
+  ring_queue_sqe(&prefetch->ring);
+}
+
+static void queue_close(struct dust_prefetch *prefetch, int fd)
+{
+  struct io_uring_sqe *sqe = ring_get_sqe(&prefetch->ring);
+
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = fd;
+  sqe->user_data = OP_CLOSE;
+  ring_queue_sqe(&prefetch->ring);
+  prefetch->closing++;
+}
+
+static void handle_completion(struct dust_prefetch *prefetch, struct io_uring_cqe *cqe)
+{
+  int op = cqe->user_data & ((1 << OP_BITS) - 1);
+  struct slot *slot = &prefetch->slots[cqe->user_data >> OP_BITS];
+
+  switch (op) {
+  case OP_OPEN:
+    assert(slot->state == SLOT_OPENING);
+    if (cqe->res < 0) {
+      slot->result = cqe->res;
+      slot->state = SLOT_DONE;
+    } else {
+      slot->fd = cqe->res;
+      slot->state = SLOT_READING;
+      queue_read(prefetch, slot - prefetch->slots);
+    }
+    break;
+  case OP_READ:
+    assert(slot->state == SLOT_READING);
+    slot->result = cqe->res;
+    slot->state = SLOT_DONE;
+    queue_close(prefetch, slot->fd);
+    slot->fd = -1;
+    break;
+  case OP_CLOSE:
+    /* Nothing was written through the descriptor, so there's nothing to
+     * lose if closing it fails. */
+    prefetch->closing--;
+    break;
+  default:
+    assert(0 && "unknown io_uring request");
+  }
+}
+
+/* Handles every completion there is, waiting for at least one first if
+ * wait is set. */
+static void process_completions(struct dust_prefetch *prefetch, int wait)
+{
+  struct io_uring_cqe cqe;
+
+  ring_enter(&prefetch->ring, wait);
+  while (ring_pop_cqe(&prefetch->ring, &cqe)) {
+    handle_completion(prefetch, &cqe);
+  }
+}
+
+struct dust_prefetch *dust_prefetch_new(unsigned depth)
+{
+  struct dust_prefetch *prefetch = dmalloc(sizeof *prefetch);
+
+  assert(depth > 0);
+
+  /* Each slot has at most one open or read in flight, plus perhaps the
+   * close of what it last read; the completion ring is twice the size of
+   * the submission ring, so it can't overflow. */
+  if (ring_init(&prefetch->ring, depth) != DUST_OK) {
+    free(prefetch);
+    return NULL;
+  }
+
+  prefetch->depth = depth;
+  prefetch->slots = dmalloc(depth * sizeof *prefetch->slots);
+  for (unsigned i = 0; i < depth; i++) {
+    prefetch->slots[i].state = SLOT_FREE;
+    prefetch->slots[i].data = NULL;
+    prefetch->slots[i].fd = -1;
+  }
+  prefetch->closing = 0;
+
+  return prefetch;
+}
+
+int dust_prefetch_start(struct dust_prefetch *prefetch, const char *path, size_t size)
+{
+  assert(prefetch);
+  assert(path);
+
+  for (unsigned id = 0; id < prefetch->depth; id++) {
+    struct slot *slot = &prefetch->slots[id];
+
+    if (slot->state != SLOT_FREE) {
+      continue;
+    }
+    slot->state = SLOT_OPENING;
+    slot->path = path;
+    slot->size = size;
+    slot->data = dmalloc(size + 1);
+    slot->fd = -1;
+    slot->result = 0;
+    /* This is only handed to the kernel once something is waited for,
+     * so a batch of files costs one system call to start. */
+    queue_open(prefetch, id);
+    return id;
+  }
+
+  return -1;
+}
+
+int dust_prefetch_wait(struct dust_prefetch *prefetch, int id, unsigned char **data)
+{
+  assert(prefetch);
+  assert(id >= 0 && (unsigned)id < prefetch->depth);
+  assert(data);
+
+  struct slot *slot = &prefetch->slots[id];
+  assert(slot->state != SLOT_FREE);
+
+  while (slot->state != SLOT_DONE) {
+    process_completions(prefetch, 1);
+  }
+
+  if (slot->result != (int64_t)slot->size) {
+    return !DUST_OK;
+  }
+  *data = slot->data;
+  return DUST_OK;
+}
+
+void dust_prefetch_release(struct dust_prefetch *prefetch, int id)
+{
+  assert(prefetch);
+  assert(id >= 0 && (unsigned)id < prefetch->depth);
+
+  struct slot *slot = &prefetch->slots[id];
+  assert(slot->state == SLOT_DONE);
+
+  free(slot->data);
+  slot->data = NULL;
+  slot->state = SLOT_FREE;
+}
+
+void dust_prefetch_free(struct dust_prefetch **prefetch)
+{
+  assert(prefetch && *prefetch);
+
+  for (unsigned id = 0; id < (*prefetch)->depth; id++) {
+    struct slot *slot = &(*prefetch)->slots[id];
+
+    if (slot->state == SLOT_FREE) {
+      continue;
+    }
+    while (slot->state != SLOT_DONE) {
+      process_completions(*prefetch, 1);
+    }
+    dust_prefetch_release(*prefetch, id);
+  }
+  while ((*prefetch)->closing > 0) {
+    process_completions(*prefetch, 1);
+  }
+
+  ring_free(&(*prefetch)->ring);
+  free((*prefetch)->slots);
+  free(*prefetch);
+  *prefetch = NULL;
+}
+
+#else /* !HAVE_IO_URING */
+
+struct dust_prefetch {
+  int unused;
+};
+
+struct dust_prefetch *dust_prefetch_new(unsigned depth)
+{
+  (void)depth;
+  return NULL;
+}
+
+int dust_prefetch_start(struct dust_prefetch *prefetch, const char *path, size_t size)
+{
+  (void)prefetch;
+  (void)path;
+  (void)size;
+  assert(0 && "io_uring isn't available");
+  return -1;
+}
+
+int dust_prefetch_wait(struct dust_prefetch *prefetch, int id, unsigned char **data)
+{
+  (void)prefetch;
+  (void)id;
+  (void)data;
+  assert(0 && "io_uring isn't available");
+  return !DUST_OK;
+}
+
+void dust_prefetch_release(struct dust_prefetch *prefetch, int id)
+{
+  (void)prefetch;
+  (void)id;
+  assert(0 && "io_uring isn't available");
+}
+
+void dust_prefetch_free(struct dust_prefetch **prefetch)
+{
+  (void)prefetch;
+  assert(0 && "io_uring isn't available");
+}
+
+#endif /* HAVE_IO_URING */
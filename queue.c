@@ -0,0 +1,98 @@
+#include "queue.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "memory.h"
+
+struct dust_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  void **items;
+  size_t capacity;
+  size_t head; /* index of the oldest item */
+  size_t count;
+};
+
+struct dust_queue *dust_queue_new(size_t capacity)
+{
+  struct dust_queue *queue = dmalloc(sizeof *queue);
+
+  assert(capacity > 0);
+  queue->items = dmalloc(capacity * sizeof *queue->items);
+  queue->capacity = capacity;
+  queue->head = 0;
+  queue->count = 0;
+  assert(0 == pthread_mutex_init(&queue->lock, NULL));
+  assert(0 == pthread_cond_init(&queue->not_empty, NULL));
+  assert(0 == pthread_cond_init(&queue->not_full, NULL));
+
+  return queue;
+}
+
+void dust_queue_free(struct dust_queue **queue)
+{
+  assert(queue && *queue);
+
+  assert(0 == pthread_mutex_destroy(&(*queue)->lock));
+  assert(0 == pthread_cond_destroy(&(*queue)->not_empty));
+  assert(0 == pthread_cond_destroy(&(*queue)->not_full));
+  free((*queue)->items);
+  free(*queue);
+  *queue = NULL;
+}
+
+void dust_queue_push(struct dust_queue *queue, void *item)
+{
+  assert(queue);
+
+  assert(0 == pthread_mutex_lock(&queue->lock));
+  while (queue->count == queue->capacity) {
+    assert(0 == pthread_cond_wait(&queue->not_full, &queue->lock));
+  }
+  queue->items[(queue->head + queue->count) % queue->capacity] = item;
+  queue->count++;
+  assert(0 == pthread_cond_signal(&queue->not_empty));
+  assert(0 == pthread_mutex_unlock(&queue->lock));
+}
+
+void *dust_queue_pop(struct dust_queue *queue)
+{
+  void *item = NULL;
+
+  assert(queue);
+
+  assert(0 == pthread_mutex_lock(&queue->lock));
+  while (queue->count == 0) {
+    assert(0 == pthread_cond_wait(&queue->not_empty, &queue->lock));
+  }
+  item = queue->items[queue->head];
+  queue->head = (queue->head + 1) % queue->capacity;
+  queue->count--;
+  assert(0 == pthread_cond_signal(&queue->not_full));
+  assert(0 == pthread_mutex_unlock(&queue->lock));
+
+  return item;
+}
+
+int dust_queue_try_pop(struct dust_queue *queue, void **item)
+{
+  int popped = 0;
+
+  assert(queue);
+  assert(item);
+
+  assert(0 == pthread_mutex_lock(&queue->lock));
+  if (queue->count > 0) {
+    *item = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    popped = 1;
+    assert(0 == pthread_cond_signal(&queue->not_full));
+  }
+  assert(0 == pthread_mutex_unlock(&queue->lock));
+
+  return popped;
+}
@@ -0,0 +1,195 @@
+#define _GNU_SOURCE
+
+#include "stat-cache.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dust-file-utils.h"
+#include "memory.h"
+
+struct cached_file {
+  char *path;
+  uint64_t size;
+  int64_t mtime;
+  int64_t ctime;
+  uint64_t inode;
+  struct dust_fingerprint fingerprint;
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+};
+
+struct dust_stat_cache {
+  struct cached_file *files; /* sorted by path */
+  size_t num_files;
+  size_t capacity;
+  int chunking;           /* only files cut into blocks this way are kept */
+  size_t num_mismatched;  /* files left out for having been cut otherwise */
+};
+
+/* for_item_in_listing() has no way to pass state to its callback. */
+static struct dust_stat_cache *g_loading = NULL;
+
+static int add_listing_item(dust_index *index, dust_arena *arena, struct listing_item item)
+{
+  struct dust_stat_cache *cache = g_loading;
+  struct cached_file *file = NULL;
+
+  (void)index;
+  (void)arena;
+
+  if (item.recordtype != DUST_LISTING_FILE || !item.data.file.has_stat) {
+    return DUST_OK;
+  }
+  if (item.data.file.chunking != cache->chunking) {
+    cache->num_mismatched++;
+    return DUST_OK;
+  }
+
+  if (cache->num_files == cache->capacity) {
+    struct cached_file *files = NULL;
+
+    cache->capacity = cache->capacity ? cache->capacity * 2 : 1024;
+    files = dmalloc(cache->capacity * sizeof *files);
+    if (cache->num_files > 0) {
+      memcpy(files, cache->files, cache->num_files * sizeof *files);
+    }
+    free(cache->files);
+    cache->files = files;
+  }
+
+  file = &cache->files[cache->num_files++];
+  file->path = dstrdup(item.path);
+  file->size = item.data.file.size;
+  file->mtime = item.data.file.mtime;
+  file->ctime = item.data.file.ctime;
+  file->inode = item.data.file.inode;
+  file->fingerprint = item.data.file.expected_fingerprint;
+  memcpy(file->hash, item.data.file.expected_hash, SHA256_DIGEST_LENGTH);
+
+  return DUST_OK;
+}
+
+static int compare_cached_files(const void *a, const void *b)
+{
+  const struct cached_file *fa = a, *fb = b;
+  return strcmp(fa->path, fb->path);
+}
+
+struct dust_stat_cache *dust_stat_cache_load(dust_index *index,
+                                             dust_arena *arena,
+                                             char *archive_path,
+                                             int chunking)
+{
+  struct dust_stat_cache *cache = NULL;
+  FILE *listing = NULL;
+
+  assert(index);
+  assert(arena);
+  assert(archive_path);
+
+  listing = extract_archive_listing(index, arena, archive_path);
+  if (!listing) {
+    return NULL;
+  }
+
+  cache = dmalloc(sizeof *cache);
+  cache->files = NULL;
+  cache->num_files = 0;
+  cache->capacity = 0;
+  cache->chunking = chunking;
+  cache->num_mismatched = 0;
+
+  assert(g_loading == NULL);
+  g_loading = cache;
+  if (for_item_in_listing(index, arena, listing, add_listing_item) != DUST_OK) {
+    fprintf(stderr, "Failed to read listing of '%s'.\n", archive_path);
+    g_loading = NULL;
+    assert(0 == fclose(listing));
+    dust_stat_cache_free(&cache);
+    return NULL;
+  }
+  g_loading = NULL;
+  assert(0 == fclose(listing));
+
+  if (cache->num_mismatched > 0) {
+    fprintf(stderr,
+            "%zu files in '%s' were cut into blocks differently, or by an older "
+            "version; they'll be read afresh.\n",
+            cache->num_mismatched, archive_path);
+  }
+
+  if (cache->num_files > 0) {
+    qsort(cache->files, cache->num_files, sizeof *cache->files, compare_cached_files);
+  }
+
+  return cache;
+}
+
+int dust_stat_cache_lookup(const struct dust_stat_cache *cache,
+                           const char *path,
+                           const struct stat *sb,
+                           struct dust_fingerprint *fingerprint,
+                           unsigned char *hash)
+{
+  struct cached_file key, *file = NULL;
+
+  assert(cache);
+  assert(path);
+  assert(sb);
+
+  if (cache->num_files == 0) {
+    return 0;
+  }
+
+  key.path = (char *)path;
+  file = bsearch(&key, cache->files, cache->num_files, sizeof *cache->files, compare_cached_files);
+  if (!file) {
+    return 0;
+  }
+
+  if (file->size != (uint64_t)sb->st_size
+      || file->mtime != dust_stat_mtime(sb)
+      || file->ctime != dust_stat_ctime(sb)
+      || file->inode != (uint64_t)sb->st_ino) {
+    return 0;
+  }
+
+  *fingerprint = file->fingerprint;
+  memcpy(hash, file->hash, SHA256_DIGEST_LENGTH);
+  return 1;
+}
+
+void dust_stat_cache_free(struct dust_stat_cache **cache)
+{
+  assert(cache && *cache);
+
+  for (size_t i = 0; i < (*cache)->num_files; i++) {
+    free((*cache)->files[i].path);
+  }
+  free((*cache)->files);
+  free(*cache);
+  *cache = NULL;
+}
+
+/* macOS names the timestamps in struct stat differently. */
+#ifdef __APPLE__
+#define STAT_MTIM(sb) ((sb)->st_mtimespec)
+#define STAT_CTIM(sb) ((sb)->st_ctimespec)
+#else
+#define STAT_MTIM(sb) ((sb)->st_mtim)
+#define STAT_CTIM(sb) ((sb)->st_ctim)
+#endif
+
+int64_t dust_stat_mtime(const struct stat *sb)
+{
+  assert(sb);
+  return (int64_t)STAT_MTIM(sb).tv_sec * 1000000000 + STAT_MTIM(sb).tv_nsec;
+}
+
+int64_t dust_stat_ctime(const struct stat *sb)
+{
+  assert(sb);
+  return (int64_t)STAT_CTIM(sb).tv_sec * 1000000000 + STAT_CTIM(sb).tv_nsec;
+}
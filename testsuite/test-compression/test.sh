@@ -0,0 +1,43 @@
+#!/bin/sh
+
+. ../test-common.sh
+
+setup
+
+mkdir "$TEST_DIR/orig"
+cd "$TEST_DIR/orig"
+
+# Text compresses well; random data doesn't, and is stored as it is.
+seq 1 300000 > text
+dd if=/dev/urandom of=random bs=100000 count=1
+echo foobar > small
+
+cd "$TEST_DIR"
+"$DUST"-archive --compress=zlib orig > "$TEST_DIR/archive.dust"
+
+# Compression shouldn't affect fingerprints, so archiving the same files
+# again without it should store nothing new.
+arena_size=`wc -c < "$DUST_ARENA"`
+"$DUST"-archive orig > "$TEST_DIR/archive-uncompressed.dust"
+cmp "$TEST_DIR/archive.dust" "$TEST_DIR/archive-uncompressed.dust"
+test "$arena_size" -eq "`wc -c < "$DUST_ARENA"`"
+echo "Archives match" >> "$RAW_OUTPUT"
+
+"$DUST"-check
+echo "Arena checks out" >> "$RAW_OUTPUT"
+
+"$DUST"-rebuild-index "$TEST_DIR/new-index"
+cmp "$DUST_INDEX" "$TEST_DIR/new-index"
+echo "Rebuilt index matches" >> "$RAW_OUTPUT"
+
+mkdir "$TEST_DIR/extracted"
+cd "$TEST_DIR/extracted"
+"$DUST"-extract "$TEST_DIR/archive.dust"
+for file in text random small; do
+  cmp "$TEST_DIR/orig/$file" "orig/$file"
+  echo "Extracted $file matches" >> "$RAW_OUTPUT"
+done
+
+compare_output
+
+teardown
@@ -0,0 +1,40 @@
+#!/bin/sh
+
+. ../test-common.sh
+
+setup
+
+mkdir "$TEST_DIR/orig"
+cd "$TEST_DIR/orig"
+
+seq 1 100000 > first
+ln first second
+mkdir subdir
+ln first subdir/third
+echo alone > alone
+
+# Each further link should be recorded as a link to the first, without
+# its data being read again.
+cd "$TEST_DIR"
+"$DUST"-archive --verbose orig > "$TEST_DIR/archive.dust" 2> "$TEST_DIR/log"
+"$DUST"-archive --threads=3 orig > "$TEST_DIR/pipelined.dust"
+cmp "$TEST_DIR/archive.dust" "$TEST_DIR/pipelined.dust"
+grep "file:\|hardlink:" "$TEST_DIR/log" >> "$RAW_OUTPUT"
+
+mkdir "$TEST_DIR/extracted"
+cd "$TEST_DIR/extracted"
+"$DUST"-extract "$TEST_DIR/archive.dust"
+
+banner "Links after extraction" >> "$RAW_OUTPUT"
+for f in second subdir/third alone; do
+  if test orig/first -ef "orig/$f"; then
+    echo "$f is a link to first" >> "$RAW_OUTPUT"
+  else
+    echo "$f is a separate file" >> "$RAW_OUTPUT"
+  fi
+done
+cmp orig/subdir/third "$TEST_DIR/orig/first"
+
+compare_output
+
+teardown
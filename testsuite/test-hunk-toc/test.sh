@@ -0,0 +1,68 @@
+#!/bin/sh
+
+. ../test-common.sh
+
+setup
+
+export DUST_INDEX="$TEST_DIR/index"
+export DUST_ARENA="$TEST_DIR/arena"
+
+mkdir "$TEST_DIR/first" "$TEST_DIR/second"
+head -c 60000000 /dev/urandom > "$TEST_DIR/first/a"
+head -c 100000000 /dev/urandom > "$TEST_DIR/second/b"
+head -c 80000000 /dev/urandom > "$TEST_DIR/second/c"
+
+# The first hunk is begun by one run, and finished by the next.
+cd "$TEST_DIR"
+"$DUST"-archive first > "$TEST_DIR/first.dust"
+"$DUST"-archive second > "$TEST_DIR/second.dust"
+
+hunk_size=100000000
+for hunk in 1 2; do
+  magic=`dd if="$DUST_ARENA" bs=1 skip=\`expr $hunk \* $hunk_size - 8\` count=8 2>/dev/null`
+  test "$magic" = dusttoc1
+done
+echo "Filled hunks have tables of contents" >> "$RAW_OUTPUT"
+
+"$DUST"-check
+echo "Arena checks out" >> "$RAW_OUTPUT"
+
+"$DUST"-rebuild-index "$TEST_DIR/new-index"
+cmp "$DUST_INDEX" "$TEST_DIR/new-index"
+echo "Rebuilt index matches" >> "$RAW_OUTPUT"
+
+# Damage the data of a block in a filled hunk, then put it back.
+block_byte=`expr $hunk_size + 1000`
+dd if="$DUST_ARENA" of="$TEST_DIR/saved-byte" bs=1 skip=$block_byte count=1 2>/dev/null
+printf 'x' | dd of="$DUST_ARENA" bs=1 seek=$block_byte conv=notrunc 2>/dev/null
+if "$DUST"-check 2>"$TEST_DIR/check-errors"; then
+  exit 1
+fi
+grep -q "but contents hash to" "$TEST_DIR/check-errors"
+echo "Damaged block noticed" >> "$RAW_OUTPUT"
+dd if="$TEST_DIR/saved-byte" of="$DUST_ARENA" bs=1 seek=$block_byte conv=notrunc 2>/dev/null
+"$DUST"-check
+
+# Damage the first hunk's table of contents; dust-check should notice, and
+# rebuilding should fall back to reading the hunk.
+printf 'x' | dd of="$DUST_ARENA" bs=1 seek=`expr $hunk_size - 1000` conv=notrunc 2>/dev/null
+if "$DUST"-check 2>/dev/null; then
+  exit 1
+fi
+echo "Damaged table of contents noticed" >> "$RAW_OUTPUT"
+
+"$DUST"-rebuild-index "$TEST_DIR/newer-index"
+cmp "$DUST_INDEX" "$TEST_DIR/newer-index"
+echo "Index rebuilt without it matches" >> "$RAW_OUTPUT"
+
+# Blocks in a hunk without an intact table are still found by way of the
+# index, so archiving them again stores nothing new.
+arena_size=`wc -c < "$DUST_ARENA"`
+"$DUST"-archive first > "$TEST_DIR/first-again.dust"
+cmp "$TEST_DIR/first.dust" "$TEST_DIR/first-again.dust"
+test "$arena_size" -eq "`wc -c < "$DUST_ARENA"`"
+echo "Blocks without a table found again" >> "$RAW_OUTPUT"
+
+compare_output
+
+teardown
@@ -0,0 +1,43 @@
+#!/bin/sh
+
+. ../test-common.sh
+
+setup
+
+mkdir "$TEST_DIR/orig"
+cd "$TEST_DIR/orig"
+
+echo foobar > unchanged
+seq 1 100000 > changed
+mkdir subdir
+seq 1 300000 > subdir/unchanged
+
+cd "$TEST_DIR"
+"$DUST"-archive orig > "$TEST_DIR/first.dust"
+
+seq 1 100 >> orig/changed
+echo new > orig/new
+
+# Only the files which have changed since the first archive should be
+# read; the result should be the same as archiving everything afresh.
+"$DUST"-archive --verbose --since="$TEST_DIR/first.dust" orig \
+  > "$TEST_DIR/since.dust" 2> "$TEST_DIR/since-log"
+"$DUST"-archive orig > "$TEST_DIR/full.dust"
+
+cmp "$TEST_DIR/since.dust" "$TEST_DIR/full.dust"
+echo "Archives match" >> "$RAW_OUTPUT"
+grep "file:" "$TEST_DIR/since-log" >> "$RAW_OUTPUT"
+
+# Files cut into blocks another way can't be reused.
+"$DUST"-archive --verbose --chunking=content --since="$TEST_DIR/full.dust" orig \
+  > "$TEST_DIR/content-since.dust" 2> "$TEST_DIR/content-since-log"
+"$DUST"-archive --chunking=content orig > "$TEST_DIR/content-full.dust"
+
+cmp "$TEST_DIR/content-since.dust" "$TEST_DIR/content-full.dust"
+echo "Archives with other chunking match" >> "$RAW_OUTPUT"
+grep -q "read afresh" "$TEST_DIR/content-since-log"
+grep "file:" "$TEST_DIR/content-since-log" >> "$RAW_OUTPUT"
+
+compare_output
+
+teardown
@@ -0,0 +1,35 @@
+#!/bin/sh
+
+. ../test-common.sh
+
+setup
+
+mkdir "$TEST_DIR/orig"
+cd "$TEST_DIR/orig"
+
+: > empty
+for i in `seq 1 200`; do
+  seq 1 $((i * 50)) > "small-$i"
+done
+seq 1 200000 > large
+
+# Reading with io_uring (or falling back to reading as usual, where it's
+# not available) must give the same archive as reading as usual.
+cd "$TEST_DIR"
+"$DUST"-archive orig > "$TEST_DIR/usual.dust"
+"$DUST"-archive --io-uring orig > "$TEST_DIR/io-uring.dust"
+"$DUST"-archive --io-uring --threads=3 orig > "$TEST_DIR/io-uring-threads.dust"
+
+cmp "$TEST_DIR/usual.dust" "$TEST_DIR/io-uring.dust"
+cmp "$TEST_DIR/usual.dust" "$TEST_DIR/io-uring-threads.dust"
+echo "Archives match" >> "$RAW_OUTPUT"
+
+mkdir "$TEST_DIR/extracted"
+cd "$TEST_DIR/extracted"
+"$DUST"-extract "$TEST_DIR/io-uring.dust"
+diff -r "$TEST_DIR/orig" orig
+echo "Extracted files match" >> "$RAW_OUTPUT"
+
+compare_output
+
+teardown
@@ -0,0 +1,41 @@
+#!/bin/sh
+
+. ../test-common.sh
+
+setup
+
+export DUST_INDEX="$TEST_DIR/index"
+export DUST_ARENA="$TEST_DIR/arena"
+
+mkdir "$TEST_DIR/first" "$TEST_DIR/second" "$TEST_DIR/both"
+seq 1 300000 > "$TEST_DIR/first/a"
+seq 300001 600000 > "$TEST_DIR/second/b"
+cp "$TEST_DIR/first/a" "$TEST_DIR/second/b" "$TEST_DIR/both"
+
+cd "$TEST_DIR"
+"$DUST"-archive first > "$TEST_DIR/first.dust"
+cp "$DUST_INDEX" "$TEST_DIR/saved-index"
+cp "$DUST_INDEX.bloom" "$TEST_DIR/saved-index.bloom"
+
+# Put the index back as it was before the second archive, as if that had
+# crashed before writing it out; the arena keeps the blocks of b, but the
+# index doesn't know about them.
+"$DUST"-archive second > "$TEST_DIR/second.dust"
+mv "$TEST_DIR/saved-index" "$DUST_INDEX"
+mv "$TEST_DIR/saved-index.bloom" "$DUST_INDEX.bloom"
+
+# The blocks of a are found in the same hunk as those of b, which mustn't
+# be taken as stored on that account.
+"$DUST"-archive both > "$TEST_DIR/both.dust"
+
+mkdir "$TEST_DIR/extracted"
+cd "$TEST_DIR/extracted"
+"$DUST"-extract "$TEST_DIR/both.dust"
+for file in a b; do
+  cmp "$TEST_DIR/both/$file" "both/$file"
+  echo "Extracted $file matches" >> "$RAW_OUTPUT"
+done
+
+compare_output
+
+teardown
@@ -0,0 +1,28 @@
+#!/bin/sh
+
+. ../test-common.sh
+
+setup
+
+export DUST_INDEX="$TEST_DIR/index"
+export DUST_ARENA="$TEST_DIR/arena"
+
+# Enough to fill a few arena hunks.
+mkdir "$TEST_DIR/orig"
+head -c 250000000 /dev/urandom > "$TEST_DIR/orig/random"
+seq 1 3000000 > "$TEST_DIR/orig/numbers"
+
+cd "$TEST_DIR"
+"$DUST"-archive --compress=zlib orig > "$TEST_DIR/archive.dust"
+
+"$DUST"-rebuild-index "$TEST_DIR/one-thread"
+cmp "$DUST_INDEX" "$TEST_DIR/one-thread"
+echo "Index rebuilt with one thread matches" >> "$RAW_OUTPUT"
+
+"$DUST"-rebuild-index --threads=4 "$TEST_DIR/four-threads"
+cmp "$DUST_INDEX" "$TEST_DIR/four-threads"
+echo "Index rebuilt with four threads matches" >> "$RAW_OUTPUT"
+
+compare_output
+
+teardown
@@ -0,0 +1,40 @@
+#!/bin/sh
+
+. ../test-common.sh
+
+setup
+
+mkdir "$TEST_DIR/orig"
+cd "$TEST_DIR/orig"
+
+# A mix of files which fit in one block, end exactly on a block boundary,
+# and span several blocks.
+touch empty
+echo foobar > small
+dd if=/dev/zero of=exact bs=65536 count=1
+seq 1 100000 > several
+mkdir subdir
+seq 1 300000 > subdir/more
+
+# Archive the same files with one thread and with several, each into a
+# fresh arena and index; the results should be byte-for-byte identical.
+cd "$TEST_DIR"
+for threads in 1 4; do
+  find orig | DUST_ARENA="$TEST_DIR/arena-$threads" DUST_INDEX="$TEST_DIR/index-$threads" \
+    "$DUST"-archive --threads=$threads > "$TEST_DIR/archive-$threads.dust"
+done
+
+cmp "$TEST_DIR/arena-1" "$TEST_DIR/arena-4"
+echo "Arenas match" >> "$RAW_OUTPUT"
+cmp "$TEST_DIR/archive-1.dust" "$TEST_DIR/archive-4.dust"
+echo "Archives match" >> "$RAW_OUTPUT"
+
+mkdir "$TEST_DIR/extracted"
+cd "$TEST_DIR/extracted"
+DUST_ARENA="$TEST_DIR/arena-4" DUST_INDEX="$TEST_DIR/index-4" \
+  "$DUST"-extract "$TEST_DIR/archive-4.dust"
+echo "SHA512 of extracted orig/subdir/more: `sha512 orig/subdir/more`" >> "$RAW_OUTPUT"
+
+compare_output
+
+teardown
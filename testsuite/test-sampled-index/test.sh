@@ -0,0 +1,58 @@
+#!/bin/sh
+
+. ../test-common.sh
+
+setup
+
+# Start from an empty index, so that there are no manifests yet.
+export DUST_INDEX="$TEST_DIR/index"
+export DUST_ARENA="$TEST_DIR/arena"
+
+mkdir "$TEST_DIR/orig"
+cd "$TEST_DIR/orig"
+seq 1 2000000 > numbers
+seq 2000000 -1 1 > reversed
+
+cd "$TEST_DIR"
+"$DUST"-archive --sampled-index --chunking=content orig > "$TEST_DIR/archive1.dust"
+first_size=`wc -c < "$DUST_ARENA"`
+test -f "$DUST_INDEX.manifests"
+test -f "$DUST_INDEX.hooks"
+
+# Change a little in the middle of one file; nearly everything else should
+# be recognised from the manifests written last time.
+sed -i 's/^1000000$/one million/' orig/numbers
+"$DUST"-archive --sampled-index --chunking=content orig > "$TEST_DIR/archive2.dust"
+second_size=`wc -c < "$DUST_ARENA"`
+test `expr "$second_size" - "$first_size"` -lt `expr "$first_size" / 4`
+echo "Second archive mostly deduplicated" >> "$RAW_OUTPUT"
+
+"$DUST"-check
+echo "Arena checks out" >> "$RAW_OUTPUT"
+
+# Some blocks were stored twice; rebuilding should index only the first
+# copy of each, just as archiving did.
+"$DUST"-rebuild-index "$TEST_DIR/new-index"
+cmp "$DUST_INDEX" "$TEST_DIR/new-index"
+echo "Rebuilt index matches" >> "$RAW_OUTPUT"
+
+# A damaged hooks file only costs deduplication.
+head -c 10 "$DUST_INDEX.hooks" > "$TEST_DIR/hooks" && mv "$TEST_DIR/hooks" "$DUST_INDEX.hooks"
+"$DUST"-archive --sampled-index --chunking=content orig > "$TEST_DIR/archive3.dust" 2> "$TEST_DIR/errors"
+cmp "$TEST_DIR/archive2.dust" "$TEST_DIR/archive3.dust"
+grep -q "starting without them" "$TEST_DIR/errors"
+"$DUST"-archive --sampled-index --chunking=content orig > "$TEST_DIR/archive4.dust" 2> "$TEST_DIR/errors"
+test ! -s "$TEST_DIR/errors"
+echo "Damaged hooks replaced" >> "$RAW_OUTPUT"
+
+mkdir "$TEST_DIR/extracted"
+cd "$TEST_DIR/extracted"
+"$DUST"-extract "$TEST_DIR/archive2.dust"
+for file in numbers reversed; do
+  cmp "$TEST_DIR/orig/$file" "orig/$file"
+  echo "Extracted $file matches" >> "$RAW_OUTPUT"
+done
+
+compare_output
+
+teardown
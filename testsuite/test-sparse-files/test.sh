@@ -0,0 +1,33 @@
+#!/bin/sh
+
+. ../test-common.sh
+
+setup
+
+mkdir "$TEST_DIR/orig"
+cd "$TEST_DIR/orig"
+
+# A sparse file with a little data in the middle of it, and a file which
+# is all zeroes but not sparse.
+dd if=/dev/null of=sparse bs=1 seek=50000000
+echo hello | dd of=sparse bs=1 seek=20000000 conv=notrunc
+dd if=/dev/zero of=zeroes bs=70000 count=1
+
+# Zeroes are never stored, so the arena should hold little more than one
+# block of data and the fingerprints naming everything else.
+cd "$TEST_DIR"
+DUST_ARENA="$TEST_DIR/arena" DUST_INDEX="$TEST_DIR/index" "$DUST"-archive orig > "$TEST_DIR/archive.dust"
+test "`wc -c < "$TEST_DIR/arena"`" -lt 200000
+echo "Zeroes weren't stored" >> "$RAW_OUTPUT"
+
+mkdir "$TEST_DIR/extracted"
+cd "$TEST_DIR/extracted"
+DUST_ARENA="$TEST_DIR/arena" DUST_INDEX="$TEST_DIR/index" "$DUST"-extract "$TEST_DIR/archive.dust"
+for file in sparse zeroes; do
+  cmp "$TEST_DIR/orig/$file" "orig/$file"
+  echo "Extracted $file matches" >> "$RAW_OUTPUT"
+done
+
+compare_output
+
+teardown
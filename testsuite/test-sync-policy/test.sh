@@ -0,0 +1,42 @@
+#!/bin/sh
+
+. ../test-common.sh
+
+setup
+
+mkdir "$TEST_DIR/orig"
+cd "$TEST_DIR/orig"
+
+seq 1 1000000 > big
+seq 1 300000 > medium
+echo foobar > small
+
+# However often the arena is synced, the arena and index written should
+# be the same.
+cd "$TEST_DIR"
+for policy in none mb ms; do
+  case $policy in
+  none) args="" ;;
+  mb) args="--sync-every-mb=1" ;;
+  ms) args="--sync-every-ms=1" ;;
+  esac
+  DUST_ARENA="$TEST_DIR/arena-$policy" DUST_INDEX="$TEST_DIR/index-$policy" \
+    "$DUST"-archive $args orig > "$TEST_DIR/archive-$policy.dust"
+done
+
+for policy in mb ms; do
+  cmp "$TEST_DIR/arena-none" "$TEST_DIR/arena-$policy"
+  cmp "$TEST_DIR/index-none" "$TEST_DIR/index-$policy"
+  echo "Arena and index match with --sync-every-$policy" >> "$RAW_OUTPUT"
+done
+
+mkdir "$TEST_DIR/extracted"
+cd "$TEST_DIR/extracted"
+DUST_ARENA="$TEST_DIR/arena-mb" DUST_INDEX="$TEST_DIR/index-mb" \
+  "$DUST"-extract "$TEST_DIR/archive-mb.dust"
+cmp "$TEST_DIR/orig/big" orig/big
+echo "Extracted file matches" >> "$RAW_OUTPUT"
+
+compare_output
+
+teardown
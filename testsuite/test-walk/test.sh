@@ -0,0 +1,41 @@
+#!/bin/sh
+
+. ../test-common.sh
+
+setup
+
+mkdir "$TEST_DIR/orig"
+cd "$TEST_DIR/orig"
+
+mkdir b b/c a z
+echo foobar > b/c/file
+seq 1 100000 > a/file
+echo top > top
+echo z > z/file
+chmod 644 b/c/file a/file top z/file
+chmod 755 b b/c a z
+
+cd "$TEST_DIR"
+chmod 755 orig
+
+# Walking the tree ourselves should visit the same paths in the same
+# order as a sorted find, no matter how many threads do the walking.
+find orig | LC_ALL=C sort | "$DUST"-archive > "$TEST_DIR/find.dust"
+"$DUST"-archive orig > "$TEST_DIR/walk-1.dust"
+"$DUST"-archive --threads=4 orig > "$TEST_DIR/walk-4.dust"
+
+cmp "$TEST_DIR/find.dust" "$TEST_DIR/walk-1.dust"
+cmp "$TEST_DIR/find.dust" "$TEST_DIR/walk-4.dust"
+
+"$DUST"-listing "$TEST_DIR/walk-4.dust" >> "$RAW_OUTPUT"
+
+# A path which can't be read ends the archive, with a single complaint.
+if "$DUST"-archive --threads=4 missing orig > /dev/null 2> "$TEST_DIR/errors"; then
+  exit 1
+fi
+test "`grep -c Bailing "$TEST_DIR/errors"`" -eq 1
+echo "Unreadable path stops the walk" >> "$RAW_OUTPUT"
+
+compare_output
+
+teardown
@@ -0,0 +1,67 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <openssl/sha.h>
+
+#include "bloom.h"
+#include "dust-internal.h"
+
+#define NUM_ENTRIES 100000
+
+static void make_fingerprint(unsigned char *fingerprint, int i)
+{
+  SHA256((const unsigned char *)&i, sizeof(i), fingerprint);
+}
+
+/* Returns how many of the fingerprints which weren't added the filter
+ * thinks might have been. */
+static int count_false_positives(const struct dust_bloom *bloom)
+{
+  unsigned char fingerprint[DUST_FINGERPRINT_SIZE];
+  int false_positives = 0;
+
+  for (int i = 0; i < NUM_ENTRIES; i++) {
+    make_fingerprint(fingerprint, i);
+    assert(dust_bloom_may_contain(bloom, fingerprint));
+  }
+  for (int i = NUM_ENTRIES; i < 2 * NUM_ENTRIES; i++) {
+    make_fingerprint(fingerprint, i);
+    false_positives += dust_bloom_may_contain(bloom, fingerprint);
+  }
+  return false_positives;
+}
+
+int main(void)
+{
+  unsigned char fingerprint[DUST_FINGERPRINT_SIZE];
+  struct dust_bloom *bloom = NULL, *loaded = NULL;
+  int false_positives = 0;
+
+  bloom = dust_bloom_new(NUM_ENTRIES);
+  assert(bloom);
+  assert(dust_bloom_capacity(bloom) >= NUM_ENTRIES);
+  for (int i = 0; i < NUM_ENTRIES; i++) {
+    make_fingerprint(fingerprint, i);
+    dust_bloom_add(bloom, fingerprint);
+  }
+  assert(dust_bloom_count(bloom) == NUM_ENTRIES);
+
+  false_positives = count_false_positives(bloom);
+  assert(false_positives < NUM_ENTRIES / 50);
+
+  assert(!dust_bloom_load("saved-bloom"));
+  assert(dust_bloom_save(bloom, "saved-bloom") == DUST_OK);
+  loaded = dust_bloom_load("saved-bloom");
+  assert(loaded);
+  assert(dust_bloom_count(loaded) == NUM_ENTRIES);
+  assert(dust_bloom_capacity(loaded) == dust_bloom_capacity(bloom));
+  assert(count_false_positives(loaded) == false_positives);
+
+  dust_bloom_free(&bloom);
+  dust_bloom_free(&loaded);
+  assert(!bloom && !loaded);
+
+  return 0;
+}
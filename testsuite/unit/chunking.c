@@ -0,0 +1,88 @@
+#include "chunking.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define DATA_SIZE (1024 * 1024)
+#define MAX_CUTS (DATA_SIZE / DUST_CDC_MIN_SIZE + 1)
+
+static void fill_pseudorandom(unsigned char *buf, size_t len)
+{
+  uint64_t x = 88172645463325252ULL;
+  for (size_t i = 0; i < len; i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    buf[i] = x & 0xff;
+  }
+}
+
+/* Cuts buf into chunks, storing the offset at which each chunk ends.
+ * Returns the number of chunks. */
+static size_t cut(int chunking, const unsigned char *buf, size_t len, size_t *cuts)
+{
+  size_t offset = 0, n = 0;
+
+  while (offset < len) {
+    size_t remaining = len - offset;
+    int eof = remaining < DUST_DATA_BLOCK_SIZE;
+    size_t bytes = dust_chunk_length(chunking, buf + offset, remaining, eof);
+
+    assert(bytes > 0);
+    assert(bytes <= DUST_DATA_BLOCK_SIZE);
+    offset += bytes;
+    if (offset < len && chunking == DUST_CHUNKING_CONTENT) {
+      assert(bytes >= DUST_CDC_MIN_SIZE);
+    }
+    cuts[n++] = offset;
+  }
+
+  return n;
+}
+
+int main(void)
+{
+  unsigned char *data = malloc(DATA_SIZE + 1);
+  size_t cuts[MAX_CUTS], shifted_cuts[MAX_CUTS];
+  size_t n, shifted_n, shared = 0;
+
+  assert(data);
+  fill_pseudorandom(data + 1, DATA_SIZE);
+
+  assert(dust_chunk_length(DUST_CHUNKING_FIXED, data, 0, 1) == 0);
+  assert(dust_chunk_length(DUST_CHUNKING_CONTENT, data, 0, 1) == 0);
+  assert(dust_chunk_length(DUST_CHUNKING_CONTENT, data, 100, 1) == 100);
+
+  n = cut(DUST_CHUNKING_FIXED, data + 1, DATA_SIZE, cuts);
+  assert(n == DATA_SIZE / DUST_DATA_BLOCK_SIZE);
+
+  /* Content-defined boundaries should survive a byte being inserted at the
+   * start of the data; all but the first chunk or two should be shared. */
+  n = cut(DUST_CHUNKING_CONTENT, data + 1, DATA_SIZE, cuts);
+  data[0] = 'x';
+  shifted_n = cut(DUST_CHUNKING_CONTENT, data, DATA_SIZE + 1, shifted_cuts);
+  assert(n > DATA_SIZE / DUST_DATA_BLOCK_SIZE);
+
+  for (size_t i = 0, j = 0; i < n && j < shifted_n;) {
+    if (cuts[i] + 1 == shifted_cuts[j]) {
+      shared++;
+      i++;
+      j++;
+    } else if (cuts[i] + 1 < shifted_cuts[j]) {
+      i++;
+    } else {
+      j++;
+    }
+  }
+  assert(shared + 2 >= n);
+
+  assert(dust_chunking_from_name("fixed") == DUST_CHUNKING_FIXED);
+  assert(dust_chunking_from_name("content") == DUST_CHUNKING_CONTENT);
+  assert(dust_chunking_from_name("bogus") == -1);
+
+  free(data);
+  return 0;
+}
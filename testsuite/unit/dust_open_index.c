@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 /*
  * Reading and writing a a 4GB index is slow; don't do it for unit tests.
@@ -93,6 +94,55 @@ int main(void)
     assert(!index);
   }
 
+  {
+    /* A version 0 index, of one bucket holding one block's entry: 102
+     * entries of a fingerprint and a big-endian address, then a
+     * big-endian count of them. */
+    static unsigned char header[4096], bucket[4096];
+    unsigned char data[] = "some data";
+    struct dust_fingerprint fingerprint;
+    struct dust_block *block = NULL;
+    dust_arena *arena = NULL;
+    FILE *f = NULL;
+
+    arena = dust_open_arena("arena9", DUST_PERM_RW, DUST_ARENA_FLAG_CREATE);
+    assert(arena);
+    index = dust_open_index("index9-new", DUST_PERM_RW, DUST_INDEX_FLAG_CREATE, TINY_INDEX_NUM_BUCKETS);
+    assert(index);
+    fingerprint = dust_put(index, arena, data, sizeof data, 0);
+    assert(dust_close_arena(&arena) == DUST_OK);
+    assert(dust_close_index(&index) == DUST_OK);
+
+    header[7] = 1; /* num_buckets */
+    memcpy(bucket, fingerprint.bytes, DUST_FINGERPRINT_SIZE); /* at address 0 */
+    bucket[102 * 40 + 3] = 1; /* num_entries */
+    f = fopen("index9", "w");
+    assert(f);
+    assert(fwrite(header, sizeof header, 1, f) == 1);
+    assert(fwrite(bucket, sizeof bucket, 1, f) == 1);
+    assert(fclose(f) == 0);
+
+    /* Only converted when opened for writing. */
+    index = dust_open_index("index9", DUST_PERM_READ, DUST_INDEX_FLAG_MMAP);
+    assert(!index);
+
+    index = dust_open_index("index9", DUST_PERM_RW, DUST_INDEX_FLAG_NONE);
+    assert(index);
+    rv = dust_close_index(&index);
+    assert(rv == DUST_OK);
+
+    index = dust_open_index("index9", DUST_PERM_READ, DUST_INDEX_FLAG_MMAP);
+    assert(index);
+    arena = dust_open_arena("arena9", DUST_PERM_READ, DUST_ARENA_FLAG_NONE);
+    assert(arena);
+    block = dust_get(index, arena, fingerprint);
+    assert(dust_block_size(block) == sizeof data);
+    assert(memcmp(dust_block_data(block), data, sizeof data) == 0);
+    dust_release(&block);
+    assert(dust_close_arena(&arena) == DUST_OK);
+    assert(dust_close_index(&index) == DUST_OK);
+  }
+
   return 0;
 }
 
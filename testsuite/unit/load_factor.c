@@ -0,0 +1,83 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dust-internal.h"
+#include "dust-file-utils.h"
+
+#define TINY_INDEX_NUM_BUCKETS 1024
+
+/* Buckets hold 96 entries each; put in several times what the index
+ * starts out with room for, so that it has to grow as it goes. */
+#define NUM_BLOCKS 200000
+
+static void fill_block(unsigned char *data, int i)
+{
+  memset(data, 0xa5, 16);
+  memcpy(data, &i, sizeof(i));
+}
+
+static void check_blocks(dust_index *index, dust_arena *arena, struct dust_fingerprint *fingerprints)
+{
+  unsigned char data[16];
+
+  for (int i = 0; i < NUM_BLOCKS; i++) {
+    struct dust_block *block = dust_get(index, arena, fingerprints[i]);
+
+    fill_block(data, i);
+    assert(block);
+    assert(dust_block_size(block) == sizeof(data));
+    assert(memcmp(dust_block_data(block), data, sizeof(data)) == 0);
+    dust_release(&block);
+  }
+}
+
+/* Fills a new index, opened with the given flags, then checks that it can
+ * be read back either way. */
+static void test_index_growth(const char *index_path, const char *arena_path, int flags)
+{
+  dust_index *index = NULL;
+  dust_arena *arena = NULL;
+  struct dust_fingerprint *fingerprints = malloc(NUM_BLOCKS * sizeof *fingerprints);
+  unsigned char data[16];
+
+  assert(fingerprints);
+
+  index = dust_open_index(index_path, DUST_PERM_RW,
+                          flags | DUST_INDEX_FLAG_CREATE,
+                          (uint64_t)TINY_INDEX_NUM_BUCKETS);
+  assert(index);
+  arena = dust_open_arena(arena_path, DUST_PERM_RW, DUST_ARENA_FLAG_CREATE);
+  assert(arena);
+
+  for (int i = 0; i < NUM_BLOCKS; i++) {
+    fill_block(data, i);
+    fingerprints[i] = dust_put(index, arena, data, sizeof(data), DUST_TYPE_FILEDATA);
+  }
+  check_blocks(index, arena, fingerprints);
+
+  assert(dust_close_arena(&arena) == DUST_OK);
+  assert(dust_close_index(&index) == DUST_OK);
+
+  arena = dust_open_arena(arena_path, DUST_PERM_READ, DUST_ARENA_FLAG_NONE);
+  assert(arena);
+  index = dust_open_index(index_path, DUST_PERM_READ, DUST_INDEX_FLAG_MMAP);
+  assert(index);
+  check_blocks(index, arena, fingerprints);
+  assert(dust_close_index(&index) == DUST_OK);
+  index = dust_open_index(index_path, DUST_PERM_READ, DUST_INDEX_FLAG_NONE);
+  assert(index);
+  check_blocks(index, arena, fingerprints);
+  assert(dust_close_index(&index) == DUST_OK);
+  assert(dust_close_arena(&arena) == DUST_OK);
+
+  free(fingerprints);
+}
+
+int main(void)
+{
+  test_index_growth("index-load1", "arena-load1", DUST_INDEX_FLAG_MMAP);
+  test_index_growth("index-load2", "arena-load2", DUST_INDEX_FLAG_NONE);
+  return 0;
+}
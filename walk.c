@@ -0,0 +1,463 @@
+#define _GNU_SOURCE
+
+#include "walk.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memory.h"
+
+#define DIR_PENDING 0
+#define DIR_SCANNED 1
+#define DIR_FAILED  2
+
+/* The threads stop scanning directories ahead of the walk once those it
+ * has yet to finish with hold this many entries between them, so that
+ * walking a huge tree doesn't mean holding all of it in memory at once.
+ * The directory the walk is waiting on is always scanned, though. */
+#define WALK_MAX_BUFFERED_ENTRIES (1024 * 256)
+
+struct walk_dir;
+
+struct walk_child {
+  char *name;
+  struct stat sb;
+  struct walk_dir *dir; /* for subdirectories, until the walk is past them */
+};
+
+struct walk_dir {
+  char *path;              /* as reported; children are reported as path/name */
+  struct walk_dir *parent; /* NULL for roots */
+  const char *name;        /* within parent */
+  int fd;                  /* kept open until every subdirectory has been opened */
+  size_t unopened;         /* subdirectories not yet opened relative to fd */
+  int state;               /* DIR_... */
+  int error;               /* errno, if DIR_FAILED */
+  struct walk_child *children; /* sorted by name */
+  size_t num_children;
+  int queued;              /* in the walk's pending list */
+  struct walk_dir *prev_pending, *next_pending;
+};
+
+struct walk_frame {
+  struct walk_dir *dir;
+  size_t next_child;
+};
+
+struct dust_walk {
+  pthread_mutex_t lock;
+  pthread_cond_t work_available;
+  pthread_cond_t dir_scanned;
+  struct walk_dir *pending; /* stack of directories waiting to be scanned */
+  struct walk_dir *wanted;  /* the directory dust_walk_next() is waiting on */
+  size_t buffered_entries;  /* in directories scanned, and not yet freed */
+  int stopping;
+  int num_threads;
+  pthread_t *threads;
+
+  /* Only used by the thread calling dust_walk_next(). */
+  char **roots;
+  int num_roots;
+  int next_root;
+  struct walk_frame *frames;
+  size_t depth;
+  size_t max_depth;
+};
+
+static char *join_path(const char *dir, const char *name)
+{
+  size_t dirlen = strlen(dir);
+  int slash = (dirlen == 0 || dir[dirlen - 1] != '/');
+  char *path = dmalloc(dirlen + slash + strlen(name) + 1);
+
+  strcpy(path, dir);
+  if (slash) {
+    strcat(path, "/");
+  }
+  strcat(path, name);
+
+  return path;
+}
+
+static struct walk_dir *new_dir(char *path, struct walk_dir *parent, const char *name)
+{
+  struct walk_dir *dir = dmalloc(sizeof *dir);
+
+  dir->path = path;
+  dir->parent = parent;
+  dir->name = name;
+  dir->fd = -1;
+  dir->unopened = 0;
+  dir->state = DIR_PENDING;
+  dir->error = 0;
+  dir->children = NULL;
+  dir->num_children = 0;
+  dir->queued = 0;
+  dir->prev_pending = NULL;
+  dir->next_pending = NULL;
+
+  return dir;
+}
+
+/* Frees dir, along with any of its subdirectories the walk hasn't
+ * reached yet. The threads must not be able to reach any of them. */
+static void free_dir(struct walk_dir *dir)
+{
+  assert(dir);
+
+  for (size_t i = 0; i < dir->num_children; i++) {
+    if (dir->children[i].dir) {
+      free_dir(dir->children[i].dir);
+    }
+    free(dir->children[i].name);
+  }
+  if (dir->fd != -1) {
+    close(dir->fd);
+  }
+  free(dir->children);
+  free(dir->path);
+  free(dir);
+}
+
+static int compare_children(const void *a, const void *b)
+{
+  const struct walk_child *x = a, *y = b;
+  return strcmp(x->name, y->name);
+}
+
+/* Reads the entries of dir, without holding the walk's lock. Returns 0 on
+ * success, or an errno value on failure. */
+static int read_dir(struct dust_walk *walk, struct walk_dir *dir)
+{
+  DIR *stream = NULL;
+  struct dirent *dirent = NULL;
+  size_t capacity = 0;
+  int dup_fd = -1;
+
+  if (dir->parent) {
+    dir->fd = openat(dir->parent->fd, dir->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+
+    assert(0 == pthread_mutex_lock(&walk->lock));
+    if (--dir->parent->unopened == 0) {
+      close(dir->parent->fd);
+      dir->parent->fd = -1;
+    }
+    assert(0 == pthread_mutex_unlock(&walk->lock));
+  } else {
+    dir->fd = open(dir->path, O_RDONLY | O_DIRECTORY);
+  }
+  if (dir->fd == -1) {
+    return errno;
+  }
+
+  /* closedir() closes the descriptor it's given, and we need to keep
+   * ours for opening subdirectories. */
+  dup_fd = dup(dir->fd);
+  if (dup_fd == -1) {
+    return errno;
+  }
+  stream = fdopendir(dup_fd);
+  if (!stream) {
+    int error = errno;
+    close(dup_fd);
+    return error;
+  }
+
+  errno = 0;
+  while ((dirent = readdir(stream)) != NULL) {
+    struct walk_child *child = NULL;
+
+    if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+      continue;
+    }
+    if (dir->num_children == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      dir->children = realloc(dir->children, capacity * sizeof *dir->children);
+      assert(dir->children);
+    }
+
+    child = &dir->children[dir->num_children];
+    if (0 != fstatat(dir->fd, dirent->d_name, &child->sb, AT_SYMLINK_NOFOLLOW)) {
+      int error = errno;
+      closedir(stream);
+      return error;
+    }
+    child->name = dstrdup(dirent->d_name);
+    child->dir = NULL;
+    dir->num_children++;
+    errno = 0;
+  }
+  if (errno != 0) {
+    int error = errno;
+    closedir(stream);
+    return error;
+  }
+  assert(0 == closedir(stream));
+
+  qsort(dir->children, dir->num_children, sizeof *dir->children, compare_children);
+
+  for (size_t i = 0; i < dir->num_children; i++) {
+    struct walk_child *child = &dir->children[i];
+    if (S_ISDIR(child->sb.st_mode)) {
+      child->dir = new_dir(join_path(dir->path, child->name), dir, child->name);
+      dir->unopened++;
+    }
+  }
+
+  return 0;
+}
+
+/* Must be called with the walk's lock held. */
+static void push_pending(struct dust_walk *walk, struct walk_dir *dir)
+{
+  dir->queued = 1;
+  dir->prev_pending = NULL;
+  dir->next_pending = walk->pending;
+  if (walk->pending) {
+    walk->pending->prev_pending = dir;
+  }
+  walk->pending = dir;
+  assert(0 == pthread_cond_signal(&walk->work_available));
+}
+
+/* Must be called with the walk's lock held. */
+static void remove_pending(struct dust_walk *walk, struct walk_dir *dir)
+{
+  assert(dir->queued);
+  if (dir->prev_pending) {
+    dir->prev_pending->next_pending = dir->next_pending;
+  } else {
+    walk->pending = dir->next_pending;
+  }
+  if (dir->next_pending) {
+    dir->next_pending->prev_pending = dir->prev_pending;
+  }
+  dir->queued = 0;
+}
+
+/* Returns the next directory to scan, or NULL if there's none which
+ * should be scanned yet. Must be called with the walk's lock held. */
+static struct walk_dir *next_to_scan(struct dust_walk *walk)
+{
+  struct walk_dir *dir = NULL;
+
+  if (walk->wanted && walk->wanted->queued) {
+    dir = walk->wanted;
+  } else if (walk->pending && walk->buffered_entries < WALK_MAX_BUFFERED_ENTRIES) {
+    dir = walk->pending;
+  }
+  if (dir) {
+    remove_pending(walk, dir);
+  }
+  return dir;
+}
+
+static void *walk_thread_main(void *data)
+{
+  struct dust_walk *walk = data;
+
+  assert(0 == pthread_mutex_lock(&walk->lock));
+  while (1) {
+    struct walk_dir *dir = NULL;
+    int error = 0;
+
+    while (!walk->stopping && !(dir = next_to_scan(walk))) {
+      assert(0 == pthread_cond_wait(&walk->work_available, &walk->lock));
+    }
+    if (walk->stopping) {
+      break;
+    }
+    assert(0 == pthread_mutex_unlock(&walk->lock));
+
+    error = read_dir(walk, dir);
+
+    assert(0 == pthread_mutex_lock(&walk->lock));
+    walk->buffered_entries += dir->num_children;
+    if (error) {
+      dir->state = DIR_FAILED;
+      dir->error = error;
+    } else {
+      dir->state = DIR_SCANNED;
+      /* Queue subdirectories so that the first is scanned first, since
+       * that's the one the walk will need soonest. */
+      for (size_t i = dir->num_children; i > 0; i--) {
+        if (dir->children[i - 1].dir) {
+          push_pending(walk, dir->children[i - 1].dir);
+        }
+      }
+    }
+    if (dir->unopened == 0 && dir->fd != -1) {
+      close(dir->fd);
+      dir->fd = -1;
+    }
+    assert(0 == pthread_cond_broadcast(&walk->dir_scanned));
+  }
+  assert(0 == pthread_mutex_unlock(&walk->lock));
+
+  return NULL;
+}
+
+struct dust_walk *dust_walk_start(char **roots, int num_roots, int num_threads)
+{
+  struct dust_walk *walk = dmalloc(sizeof *walk);
+
+  assert(roots || num_roots == 0);
+  assert(num_threads > 0);
+
+  assert(0 == pthread_mutex_init(&walk->lock, NULL));
+  assert(0 == pthread_cond_init(&walk->work_available, NULL));
+  assert(0 == pthread_cond_init(&walk->dir_scanned, NULL));
+  walk->pending = NULL;
+  walk->wanted = NULL;
+  walk->buffered_entries = 0;
+  walk->stopping = 0;
+  walk->roots = roots;
+  walk->num_roots = num_roots;
+  walk->next_root = 0;
+  walk->depth = 0;
+  walk->max_depth = 64;
+  walk->frames = dmalloc(walk->max_depth * sizeof *walk->frames);
+
+  walk->num_threads = num_threads;
+  walk->threads = dmalloc(num_threads * sizeof *walk->threads);
+  for (int i = 0; i < num_threads; i++) {
+    if (0 != pthread_create(&walk->threads[i], NULL, walk_thread_main, walk)) {
+      fprintf(stderr, "Couldn't start directory walking thread. Bailing.\n");
+      exit(1);
+    }
+  }
+
+  return walk;
+}
+
+static void push_frame(struct dust_walk *walk, struct walk_dir *dir)
+{
+  if (walk->depth == walk->max_depth) {
+    walk->max_depth *= 2;
+    walk->frames = realloc(walk->frames, walk->max_depth * sizeof *walk->frames);
+    assert(walk->frames);
+  }
+  walk->frames[walk->depth].dir = dir;
+  walk->frames[walk->depth].next_child = 0;
+  walk->depth++;
+}
+
+int dust_walk_next(struct dust_walk *walk, char **path, struct stat *sb)
+{
+  assert(walk);
+  assert(path);
+  assert(sb);
+
+  while (1) {
+    struct walk_frame *frame = NULL;
+    struct walk_dir *dir = NULL;
+    struct walk_child *child = NULL;
+
+    if (walk->depth == 0) {
+      char *root = NULL;
+
+      if (walk->next_root == walk->num_roots) {
+        return 0;
+      }
+      root = walk->roots[walk->next_root++];
+
+      if (0 != lstat(root, sb)) {
+        fprintf(stderr, "Failed to stat file '%s'. Bailing.\n", root);
+        return -1;
+      }
+      *path = dstrdup(root);
+      if (S_ISDIR(sb->st_mode)) {
+        dir = new_dir(dstrdup(root), NULL, NULL);
+        push_frame(walk, dir);
+        assert(0 == pthread_mutex_lock(&walk->lock));
+        push_pending(walk, dir);
+        assert(0 == pthread_mutex_unlock(&walk->lock));
+      }
+      return 1;
+    }
+
+    frame = &walk->frames[walk->depth - 1];
+    dir = frame->dir;
+
+    assert(0 == pthread_mutex_lock(&walk->lock));
+    if (dir->state == DIR_PENDING) {
+      /* It may be waiting behind the limit on entries scanned ahead. */
+      walk->wanted = dir;
+      assert(0 == pthread_cond_broadcast(&walk->work_available));
+      while (dir->state == DIR_PENDING) {
+        assert(0 == pthread_cond_wait(&walk->dir_scanned, &walk->lock));
+      }
+      walk->wanted = NULL;
+    }
+    assert(0 == pthread_mutex_unlock(&walk->lock));
+
+    if (dir->state == DIR_FAILED) {
+      fprintf(stderr,
+              "Failed to read directory '%s': %s. Bailing.\n",
+              dir->path,
+              strerror(dir->error));
+      return -1;
+    }
+
+    if (frame->next_child == dir->num_children) {
+      /* Finished with this directory; its subdirectories have already
+       * been freed as the walk left them. */
+      walk->depth--;
+      if (walk->depth > 0) {
+        struct walk_frame *parent = &walk->frames[walk->depth - 1];
+        parent->dir->children[parent->next_child - 1].dir = NULL;
+      }
+      assert(0 == pthread_mutex_lock(&walk->lock));
+      walk->buffered_entries -= dir->num_children;
+      if (walk->buffered_entries < WALK_MAX_BUFFERED_ENTRIES) {
+        assert(0 == pthread_cond_broadcast(&walk->work_available));
+      }
+      free_dir(dir);
+      assert(0 == pthread_mutex_unlock(&walk->lock));
+      continue;
+    }
+
+    child = &dir->children[frame->next_child++];
+    *path = join_path(dir->path, child->name);
+    *sb = child->sb;
+    if (child->dir) {
+      push_frame(walk, child->dir);
+    }
+    return 1;
+  }
+}
+
+void dust_walk_finish(struct dust_walk **walk)
+{
+  assert(walk && *walk);
+
+  assert(0 == pthread_mutex_lock(&(*walk)->lock));
+  (*walk)->stopping = 1;
+  assert(0 == pthread_cond_broadcast(&(*walk)->work_available));
+  assert(0 == pthread_mutex_unlock(&(*walk)->lock));
+
+  for (int i = 0; i < (*walk)->num_threads; i++) {
+    assert(0 == pthread_join((*walk)->threads[i], NULL));
+  }
+
+  /* Everything the walk hasn't finished with hangs off the outermost
+   * directory it was in. */
+  if ((*walk)->depth > 0) {
+    free_dir((*walk)->frames[0].dir);
+  }
+
+  assert(0 == pthread_mutex_destroy(&(*walk)->lock));
+  assert(0 == pthread_cond_destroy(&(*walk)->work_available));
+  assert(0 == pthread_cond_destroy(&(*walk)->dir_scanned));
+  free((*walk)->frames);
+  free((*walk)->threads);
+  free(*walk);
+  *walk = NULL;
+}